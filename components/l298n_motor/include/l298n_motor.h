@@ -7,6 +7,11 @@
 
 typedef struct l298n_motor_t *l298n_motor_handle_t;
 
+typedef enum {
+    L298N_MOTOR_ENCODER_GPIO_ISR = 0, // GPIO interrupt on rising edges of A, 1 count per pulse
+    L298N_MOTOR_ENCODER_PCNT,         // Pulse counter unit, 4 counts per pulse, no CPU per edge
+} l298n_motor_encoder_backend_t;
+
 typedef struct {
     gpio_num_t in1_pin;
     gpio_num_t in2_pin;
@@ -22,8 +27,63 @@ typedef struct {
     gpio_num_t encoder_a_pin;
     gpio_num_t encoder_b_pin;
     uint16_t encoder_pulses_per_rev; // Pulses per revolution
+
+    // Encoder backend and throttle ramps
+    l298n_motor_encoder_backend_t encoder_backend;
+    uint32_t encoder_glitch_ns;   // PCNT input filter, pulses shorter than this are ignored, 0 for 1000 ns
+    uint16_t accel_ms;            // l298n_motor_set_speed() and speed control ramp from 0 to full duty, 0 for none
+    uint16_t decel_ms;            // and from full duty to 0
 } l298n_motor_config_t;
 
+typedef struct {
+    float rpm;
+    float deg_per_s;
+    int64_t timestamp_us;         // esp_timer time of the newest encoder edge used
+} l298n_motor_velocity_t;
+
+// Closed loop speed control, output is the duty in percent
+typedef struct {
+    float kp;                     // Percent per RPM of error
+    float ki;                     // Percent per RPM of error and second
+    float kd;                     // Percent per RPM per second of measured change
+    float kff;                    // Feedforward, percent per RPM of target
+    float ff_offset;              // Feedforward duty to overcome friction, percent
+    uint32_t rate_hz;             // Control rate, 200 to 5000
+} l298n_motor_speed_ctrl_config_t;
+
+typedef struct {
+    uint32_t loops;
+    uint32_t periods;             // Measured step intervals
+    uint32_t period_min_us;
+    uint32_t period_max_us;
+    float period_avg_us;
+    uint32_t jitter_max_us;       // Largest deviation from the nominal period
+    float loop_avg_us;            // Run time of one step
+    uint32_t loop_max_us;
+} l298n_motor_speed_ctrl_stats_t;
+
+typedef enum {
+    L298N_MOTOR_MOVE_DONE,        // Settled within the band of the target
+    L298N_MOTOR_MOVE_TIMEOUT,
+    L298N_MOTOR_MOVE_STALLED,     // No encoder edge for stall_ms while away from the target
+    L298N_MOTOR_MOVE_CANCELLED,   // Replaced by another command
+} l298n_motor_move_result_t;
+
+// Called from the esp_timer task, or from the task whose command cancelled the move
+typedef void (*l298n_motor_move_cb_t)(l298n_motor_handle_t motor, l298n_motor_move_result_t result, void *arg);
+
+typedef struct {
+    float target_angle;           // Degrees, same reference as l298n_motor_get_angle()
+    float max_velocity;           // Cruise speed, deg/s
+    float acceleration;           // Ramp up and down, deg/s^2
+    float settle_band;            // Done within this many degrees, 0 for 1
+    float kp;                     // deg/s per degree of following error, 0 for 10
+    uint32_t timeout_ms;          // 0 for none
+    uint32_t stall_ms;            // 0 for no stall detection
+    l298n_motor_move_cb_t done_cb;
+    void *done_arg;
+} l298n_motor_move_config_t;
+
 esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config_t *config);
 esp_err_t l298n_motor_set_speed(l298n_motor_handle_t motor, int8_t speed_percent);
 esp_err_t l298n_motor_stop(l298n_motor_handle_t motor);
@@ -34,4 +94,23 @@ l298n_motor_config_t *l298n_motor_get_config(l298n_motor_handle_t motor);
 // Rotary encoder/angle functions
 esp_err_t l298n_motor_reset_angle(l298n_motor_handle_t motor);
 float l298n_motor_get_angle(l298n_motor_handle_t motor);
-esp_err_t l298n_motor_drive_to_angle(l298n_motor_handle_t motor, float target_angle, int8_t speed_percent);
\ No newline at end of file
+int64_t l298n_motor_get_count(l298n_motor_handle_t motor);
+// Shaft speed from the encoder edges of the last 20 ms, or the last edge interval when slower.
+// The GPIO ISR backend stamps every edge in the interrupt. The PCNT backend samples the count
+// every 1 ms while the velocity is read (sampling stops 2 s after the last read), so edge times
+// are only known to +-1 ms: up to 5% error over the 20 ms window. It reads 0 until 20 ms of
+// counts were seen after a standstill or the first read.
+esp_err_t l298n_motor_get_velocity(l298n_motor_handle_t motor, l298n_motor_velocity_t *velocity);
+
+// Closed loop speed control, l298n_motor_set_speed() and l298n_motor_stop() return to open loop
+esp_err_t l298n_motor_speed_control_init(l298n_motor_handle_t motor, const l298n_motor_speed_ctrl_config_t *config);
+esp_err_t l298n_motor_set_rpm(l298n_motor_handle_t motor, float rpm);
+esp_err_t l298n_motor_get_speed_control_stats(l298n_motor_handle_t motor, l298n_motor_speed_ctrl_stats_t *stats, bool reset);
+// Blocking move to target_angle, a profiled move with speed control and open loop at
+// speed_percent without it. ESP_ERR_TIMEOUT on timeout, ESP_FAIL when the motor stalls.
+esp_err_t l298n_motor_drive_to_angle(l298n_motor_handle_t motor, float target_angle, int8_t speed_percent);
+
+// Non-blocking position moves on the speed controller
+esp_err_t l298n_motor_move_to_angle(l298n_motor_handle_t motor, const l298n_motor_move_config_t *config);
+esp_err_t l298n_motor_move_cancel(l298n_motor_handle_t motor);
+bool l298n_motor_move_busy(l298n_motor_handle_t motor);
\ No newline at end of file
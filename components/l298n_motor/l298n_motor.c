@@ -1,11 +1,48 @@
 #include "l298n_motor.h"
 #include <stdlib.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/pulse_cnt.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
 #include <math.h>
 
+// PCNT counts in 16 bits, the overflows are added up in software
+#define L298N_MOTOR_PCNT_HIGH_LIMIT 32767
+#define L298N_MOTOR_PCNT_LOW_LIMIT -32768
+// Watch points at half the range keep pcnt_last away from zero while the count nears a limit
+#define L298N_MOTOR_PCNT_HALF 16384
+// A count this close to zero may be a wrap the interrupt has not added yet
+#define L298N_MOTOR_PCNT_WRAP_WINDOW 256
+#define L298N_MOTOR_PCNT_WRAP_WAIT_US 20 // Longer than the interrupt latency
+#define L298N_MOTOR_GLITCH_NS_DEFAULT 1000
+
+// Velocity estimation, counts over at least the window, or the time between the last two edges when slower
+#define L298N_MOTOR_VELOCITY_SAMPLE_US 1000   // PCNT sampling period
+#define L298N_MOTOR_VELOCITY_IDLE_US 2000000  // PCNT sampling stops when the velocity was not read for this long
+#define L298N_MOTOR_VELOCITY_WINDOW_US 20000  // Shortest span of an estimate
+#define L298N_MOTOR_VELOCITY_STOP_US 500000   // No edge for this long reads as stopped
+#define L298N_MOTOR_VELOCITY_EDGES 32         // More than the samples in a window
+
+#define L298N_MOTOR_SPEED_RATE_MIN_HZ 200
+#define L298N_MOTOR_SPEED_RATE_MAX_HZ 5000
+
+// Position moves
+#define L298N_MOTOR_MOVE_SETTLE_BAND_DEFAULT 1.0f  // Degrees
+#define L298N_MOTOR_MOVE_KP_DEFAULT 10.0f          // deg/s per degree of following error
+#define L298N_MOTOR_MOVE_SETTLE_DPS 20.0f          // Slower than this counts as standing still
+#define L298N_MOTOR_DRIVE_RAMP_MS 200              // l298n_motor_drive_to_angle() time to reach cruise speed
+#define L298N_MOTOR_DRIVE_STALL_MS 500
+#define L298N_MOTOR_DRIVE_POLL_MS 10                // Open loop l298n_motor_drive_to_angle() angle check period
+#define L298N_MOTOR_DRIVE_OPEN_LOOP_TIMEOUT_MS 10000
+
+#define L298N_MOTOR_RAMP_POLL_US 1000 // Recheck for zero duty when a fade ends late
+
 // Forward declaration for rotary encoder ISR
 static void l298n_motor_encoder_isr(void *arg);
+static void l298n_motor_ramp_done(void *arg);
 
 typedef struct {
     gpio_num_t in1_pin;
@@ -19,14 +56,233 @@ typedef struct {
     uint32_t pwm_max_duty;
 
     int8_t speed;
+    int8_t direction;         // Of the direction pins: 1, -1, or 0 with both low
+
+    // Throttle ramps on the LEDC fade engine
+    uint16_t accel_ms;        // 0 to full duty
+    uint16_t decel_ms;        // Full duty to 0
+    bool fading;
+    esp_timer_handle_t ramp_timer; // Turns around or releases the pins once the duty is zero
+    bool ramp_pending;
+    int8_t ramp_target;
     
     // Rotary encoder
     gpio_num_t encoder_a_pin;
     gpio_num_t encoder_b_pin;
     uint16_t encoder_pulses_per_rev;
+    uint32_t encoder_counts_per_rev; // Pulses per revolution times the counts per pulse
     volatile int32_t encoder_count;
+    l298n_motor_encoder_backend_t encoder_backend;
+    uint32_t encoder_glitch_ns;
+
+    // PCNT backend
+    pcnt_unit_handle_t pcnt_unit;
+    pcnt_channel_handle_t pcnt_chan_a;
+    pcnt_channel_handle_t pcnt_chan_b;
+    int64_t pcnt_overflow; // Counts of the hardware counter overflows
+    int pcnt_last;         // Hardware count at the last read, watch point or overflow
+    portMUX_TYPE encoder_lock;
+
+    // Velocity, samples taken when the count changed, oldest first in the ring
+    esp_timer_handle_t velocity_timer; // PCNT backend only, runs while the velocity is read
+    bool velocity_sampling;
+    int64_t velocity_read_us;
+    struct {
+        int64_t time_us;
+        int64_t count;
+    } velocity_edges[L298N_MOTOR_VELOCITY_EDGES];
+    uint8_t velocity_head;
+    uint8_t velocity_len;
+
+    // Serializes bridge updates between callers and the speed controller
+    SemaphoreHandle_t lock;
+
+    // Closed loop speed control
+    l298n_motor_speed_ctrl_config_t ctrl;
+    esp_timer_handle_t ctrl_timer;
+    uint32_t ctrl_period_us;
+    bool ctrl_active;
+    volatile float ctrl_target_rpm;
+    float ctrl_integral;   // Duty percent
+    float ctrl_output;     // Applied duty percent, slew limited by accel_ms and decel_ms
+    float ctrl_last_rpm;
+    int64_t ctrl_last_us;  // Start of the previous step, 0 before the first
+    uint64_t ctrl_period_sum_us;
+    uint64_t ctrl_loop_sum_us;
+    l298n_motor_speed_ctrl_stats_t ctrl_stats;
+
+    // Position move, sets the target of the speed controller from a trapezoidal profile
+    bool move_active;
+    l298n_motor_move_config_t move;
+    float move_start_angle;
+    float move_distance;      // Degrees, positive, move_dir gives the direction
+    float move_dir;
+    float move_peak_dps;      // Cruise speed, lower than max_velocity for short moves
+    float move_accel_s;       // Duration of the ramps
+    float move_total_s;
+    int64_t move_start_us;
+    int64_t move_count;       // Encoder count when it last changed
+    int64_t move_progress_us; // and when
 } l298n_motor_t;
 
+static esp_err_t l298n_motor_set_direction(l298n_motor_t *mtr, int8_t direction);
+
+// Encoder count, takes encoder_lock itself and must not be called with it held.
+// The counter restarts from zero at a limit before the interrupt adds the overflow. A count
+// near zero while pcnt_last is not may be such a wrap, so it is read again after the
+// interrupt had time to run. The count can not reach a limit from near zero unseen, it
+// passes a half range watch point first.
+static int64_t l298n_motor_read_count(l298n_motor_t *mtr) {
+    if (mtr->encoder_backend != L298N_MOTOR_ENCODER_PCNT) {
+        portENTER_CRITICAL(&mtr->encoder_lock);
+        int64_t count = mtr->encoder_count;
+        portEXIT_CRITICAL(&mtr->encoder_lock);
+        return count;
+    }
+    int count = 0;
+    portENTER_CRITICAL(&mtr->encoder_lock);
+    pcnt_unit_get_count(mtr->pcnt_unit, &count);
+    if (abs(count) < L298N_MOTOR_PCNT_WRAP_WINDOW && abs(mtr->pcnt_last) >= L298N_MOTOR_PCNT_WRAP_WINDOW) {
+        // Let a pending overflow interrupt run, then the count and the overflow agree
+        portEXIT_CRITICAL(&mtr->encoder_lock);
+        esp_rom_delay_us(L298N_MOTOR_PCNT_WRAP_WAIT_US);
+        portENTER_CRITICAL(&mtr->encoder_lock);
+        pcnt_unit_get_count(mtr->pcnt_unit, &count);
+    }
+    mtr->pcnt_last = count;
+    int64_t total = mtr->pcnt_overflow + count;
+    portEXIT_CRITICAL(&mtr->encoder_lock);
+    return total;
+}
+
+// Add a sample to the velocity ring. The caller holds encoder_lock.
+static void IRAM_ATTR l298n_motor_velocity_push(l298n_motor_t *mtr, int64_t time_us, int64_t count) {
+    mtr->velocity_edges[mtr->velocity_head].time_us = time_us;
+    mtr->velocity_edges[mtr->velocity_head].count = count;
+    mtr->velocity_head = (mtr->velocity_head + 1) % L298N_MOTOR_VELOCITY_EDGES;
+    if (mtr->velocity_len < L298N_MOTOR_VELOCITY_EDGES) mtr->velocity_len++;
+}
+
+// Record when the PCNT count changed, the edge happened within the last sample period.
+// Rearms itself until the velocity was not read for L298N_MOTOR_VELOCITY_IDLE_US.
+static void l298n_motor_velocity_sample(void *arg) {
+    l298n_motor_t *mtr = (l298n_motor_t *)arg;
+    int64_t now = esp_timer_get_time();
+    int64_t count = l298n_motor_read_count(mtr);
+    portENTER_CRITICAL(&mtr->encoder_lock);
+    int last = (mtr->velocity_head + L298N_MOTOR_VELOCITY_EDGES - 1) % L298N_MOTOR_VELOCITY_EDGES;
+    if (mtr->velocity_len == 0 || mtr->velocity_edges[last].count != count) {
+        l298n_motor_velocity_push(mtr, now, count);
+    }
+    if (now - mtr->velocity_read_us > L298N_MOTOR_VELOCITY_IDLE_US) mtr->velocity_sampling = false;
+    bool rearm = mtr->velocity_sampling;
+    portEXIT_CRITICAL(&mtr->encoder_lock);
+    if (rearm) esp_timer_start_once(mtr->velocity_timer, L298N_MOTOR_VELOCITY_SAMPLE_US);
+}
+
+// Add the count of a hardware overflow, the counter restarts from zero at either limit.
+// The half range watch points only track the count for l298n_motor_read_count().
+static bool IRAM_ATTR l298n_motor_pcnt_reach(pcnt_unit_handle_t unit, const pcnt_watch_event_data_t *edata, void *user_ctx) {
+    l298n_motor_t *mtr = (l298n_motor_t *)user_ctx;
+    int value = edata->watch_point_value;
+    portENTER_CRITICAL_ISR(&mtr->encoder_lock);
+    if (value == L298N_MOTOR_PCNT_HIGH_LIMIT || value == L298N_MOTOR_PCNT_LOW_LIMIT) {
+        mtr->pcnt_overflow += value;
+        mtr->pcnt_last = 0;
+    } else {
+        mtr->pcnt_last = value;
+    }
+    portEXIT_CRITICAL_ISR(&mtr->encoder_lock);
+    return false;
+}
+
+// 4x quadrature decoding, A and B each count on both edges gated by the level of the other.
+// Direction matches the GPIO ISR backend: rising A while B is high counts up.
+static esp_err_t l298n_motor_pcnt_init(l298n_motor_t *mtr) {
+    const char *TAG = "l298n_motor_pcnt_init";
+    pcnt_unit_config_t unit_config = {
+        .low_limit = L298N_MOTOR_PCNT_LOW_LIMIT,
+        .high_limit = L298N_MOTOR_PCNT_HIGH_LIMIT,
+    };
+    ESP_RETURN_ON_ERROR(pcnt_new_unit(&unit_config, &mtr->pcnt_unit), TAG, "failed to create pcnt unit");
+
+    pcnt_glitch_filter_config_t filter_config = {
+        .max_glitch_ns = mtr->encoder_glitch_ns,
+    };
+    ESP_RETURN_ON_ERROR(pcnt_unit_set_glitch_filter(mtr->pcnt_unit, &filter_config), TAG, "failed to set glitch filter of %lu ns", (unsigned long)mtr->encoder_glitch_ns);
+
+    pcnt_chan_config_t chan_a_config = {
+        .edge_gpio_num = mtr->encoder_a_pin,
+        .level_gpio_num = mtr->encoder_b_pin,
+    };
+    ESP_RETURN_ON_ERROR(pcnt_new_channel(mtr->pcnt_unit, &chan_a_config, &mtr->pcnt_chan_a), TAG, "failed to create pcnt channel A");
+    pcnt_chan_config_t chan_b_config = {
+        .edge_gpio_num = mtr->encoder_b_pin,
+        .level_gpio_num = mtr->encoder_a_pin,
+    };
+    ESP_RETURN_ON_ERROR(pcnt_new_channel(mtr->pcnt_unit, &chan_b_config, &mtr->pcnt_chan_b), TAG, "failed to create pcnt channel B");
+
+    ESP_RETURN_ON_ERROR(pcnt_channel_set_edge_action(mtr->pcnt_chan_a, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE), TAG, "failed to set channel A edge action");
+    ESP_RETURN_ON_ERROR(pcnt_channel_set_level_action(mtr->pcnt_chan_a, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE), TAG, "failed to set channel A level action");
+    ESP_RETURN_ON_ERROR(pcnt_channel_set_edge_action(mtr->pcnt_chan_b, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE), TAG, "failed to set channel B edge action");
+    ESP_RETURN_ON_ERROR(pcnt_channel_set_level_action(mtr->pcnt_chan_b, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE), TAG, "failed to set channel B level action");
+
+    ESP_RETURN_ON_ERROR(pcnt_unit_add_watch_point(mtr->pcnt_unit, L298N_MOTOR_PCNT_HIGH_LIMIT), TAG, "failed to add high limit watch point");
+    ESP_RETURN_ON_ERROR(pcnt_unit_add_watch_point(mtr->pcnt_unit, L298N_MOTOR_PCNT_LOW_LIMIT), TAG, "failed to add low limit watch point");
+    ESP_RETURN_ON_ERROR(pcnt_unit_add_watch_point(mtr->pcnt_unit, L298N_MOTOR_PCNT_HALF), TAG, "failed to add high half watch point");
+    ESP_RETURN_ON_ERROR(pcnt_unit_add_watch_point(mtr->pcnt_unit, -L298N_MOTOR_PCNT_HALF), TAG, "failed to add low half watch point");
+    pcnt_event_callbacks_t cbs = {
+        .on_reach = l298n_motor_pcnt_reach,
+    };
+    ESP_RETURN_ON_ERROR(pcnt_unit_register_event_callbacks(mtr->pcnt_unit, &cbs, mtr), TAG, "failed to register pcnt callbacks");
+
+    ESP_RETURN_ON_ERROR(pcnt_unit_enable(mtr->pcnt_unit), TAG, "failed to enable pcnt unit");
+    ESP_RETURN_ON_ERROR(pcnt_unit_clear_count(mtr->pcnt_unit), TAG, "failed to clear pcnt count");
+    ESP_RETURN_ON_ERROR(pcnt_unit_start(mtr->pcnt_unit), TAG, "failed to start pcnt unit");
+    return ESP_OK;
+}
+
+// Release the encoder of either backend, also after a partial init
+static void l298n_motor_encoder_del(l298n_motor_t *mtr) {
+    if (mtr->velocity_timer) {
+        portENTER_CRITICAL(&mtr->encoder_lock);
+        mtr->velocity_sampling = false;
+        portEXIT_CRITICAL(&mtr->encoder_lock);
+        esp_timer_stop(mtr->velocity_timer);
+        esp_timer_delete(mtr->velocity_timer);
+        mtr->velocity_timer = NULL;
+    }
+    if (mtr->encoder_backend != L298N_MOTOR_ENCODER_PCNT) {
+        gpio_isr_handler_remove(mtr->encoder_a_pin);
+        return;
+    }
+    if (mtr->pcnt_unit) {
+        pcnt_unit_stop(mtr->pcnt_unit);
+        pcnt_unit_disable(mtr->pcnt_unit);
+    }
+    if (mtr->pcnt_chan_a) pcnt_del_channel(mtr->pcnt_chan_a);
+    if (mtr->pcnt_chan_b) pcnt_del_channel(mtr->pcnt_chan_b);
+    if (mtr->pcnt_unit) pcnt_del_unit(mtr->pcnt_unit);
+    mtr->pcnt_unit = NULL;
+    mtr->pcnt_chan_a = NULL;
+    mtr->pcnt_chan_b = NULL;
+}
+
+// Release what init created, also after a partial init. No timer callback may be in flight.
+static void l298n_motor_free(l298n_motor_t *mtr) {
+    l298n_motor_encoder_del(mtr);
+    if (mtr->ramp_timer) {
+        esp_timer_stop(mtr->ramp_timer);
+        esp_timer_delete(mtr->ramp_timer);
+    }
+    if (mtr->ctrl_timer) {
+        esp_timer_stop(mtr->ctrl_timer);
+        esp_timer_delete(mtr->ctrl_timer);
+    }
+    if (mtr->lock) vSemaphoreDelete(mtr->lock);
+    free(mtr);
+}
+
 esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config_t *config) {
     const char *TAG = "l298n_motor_init";
     if (!config) return ESP_ERR_INVALID_ARG;
@@ -46,12 +302,19 @@ esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config
     mtr->ledc_mode = config->ledc_mode;
 
     mtr->speed = 0;
+    mtr->accel_ms = config->accel_ms;
+    mtr->decel_ms = config->decel_ms;
 
     // Rotary encoder
     mtr->encoder_a_pin = config->encoder_a_pin;
     mtr->encoder_b_pin = config->encoder_b_pin;
     mtr->encoder_pulses_per_rev = config->encoder_pulses_per_rev;
     mtr->encoder_count = 0;
+    mtr->encoder_backend = config->encoder_backend;
+    mtr->encoder_glitch_ns = config->encoder_glitch_ns ? config->encoder_glitch_ns : L298N_MOTOR_GLITCH_NS_DEFAULT;
+    mtr->encoder_counts_per_rev = mtr->encoder_pulses_per_rev;
+    if (mtr->encoder_backend == L298N_MOTOR_ENCODER_PCNT) mtr->encoder_counts_per_rev = 4 * mtr->encoder_pulses_per_rev;
+    portMUX_INITIALIZE(&mtr->encoder_lock);
 
     // Configure GPIOs for direction pins
     gpio_config_t io_conf = {
@@ -75,11 +338,33 @@ esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config
             .pull_down_en = GPIO_PULLDOWN_DISABLE,
             .intr_type = GPIO_INTR_POSEDGE,
         };
+        if (mtr->encoder_backend == L298N_MOTOR_ENCODER_PCNT) enc_conf.intr_type = GPIO_INTR_DISABLE;
         gpio_config(&enc_conf);
 
-        // Install ISR for encoder A pin
-        gpio_install_isr_service(0);
-        gpio_isr_handler_add(mtr->encoder_a_pin, l298n_motor_encoder_isr, (void *)mtr);
+        if (mtr->encoder_backend == L298N_MOTOR_ENCODER_PCNT) {
+            // Hardware quadrature decoding, no interrupt per edge
+            if (l298n_motor_pcnt_init(mtr) != ESP_OK) {
+                ESP_LOGE(TAG, "failed to set up pcnt encoder");
+                l298n_motor_free(mtr);
+                return ESP_ERR_INVALID_STATE;
+            }
+            // Edge times for the velocity, started by l298n_motor_get_velocity()
+            esp_timer_create_args_t velocity_timer_args = {
+                .callback = l298n_motor_velocity_sample,
+                .arg = mtr,
+                .dispatch_method = ESP_TIMER_TASK,
+                .name = "motor_velocity",
+            };
+            if (esp_timer_create(&velocity_timer_args, &mtr->velocity_timer) != ESP_OK) {
+                ESP_LOGE(TAG, "failed to create velocity sampling timer");
+                l298n_motor_free(mtr);
+                return ESP_ERR_INVALID_STATE;
+            }
+        } else {
+            // Install ISR for encoder A pin
+            gpio_install_isr_service(0);
+            gpio_isr_handler_add(mtr->encoder_a_pin, l298n_motor_encoder_isr, (void *)mtr);
+        }
 
     // Configure LEDC timer
     ledc_timer_config_t ledc_timer = {
@@ -91,7 +376,7 @@ esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config
     };
     if (ledc_timer_config(&ledc_timer) != ESP_OK) {
         ESP_LOGE(TAG, "failed to set ledc timer config");
-        free(mtr);
+        l298n_motor_free(mtr);
         return ESP_ERR_INVALID_STATE;
     }
 
@@ -106,15 +391,40 @@ esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config
     };
     if (ledc_channel_config(&ledc_channel) != ESP_OK) {
         ESP_LOGE(TAG, "failed to set ledc channel config");
-        free(mtr);
+        l298n_motor_free(mtr);
         return ESP_ERR_INVALID_STATE;
     }
 
     mtr->pwm_max_duty = (1 << LEDC_TIMER_13_BIT) - 1;
 
+    if (mtr->accel_ms || mtr->decel_ms) {
+        // Shared by all channels, may be installed already
+        esp_err_t err = ledc_fade_func_install(0);
+        esp_timer_create_args_t ramp_timer_args = {
+            .callback = l298n_motor_ramp_done,
+            .arg = mtr,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "motor_ramp",
+        };
+        if ((err != ESP_OK && err != ESP_ERR_INVALID_STATE) || esp_timer_create(&ramp_timer_args, &mtr->ramp_timer) != ESP_OK) {
+            ESP_LOGE(TAG, "failed to set up throttle ramps");
+            l298n_motor_free(mtr);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+
+    mtr->lock = xSemaphoreCreateMutex();
+    if (!mtr->lock) {
+        ESP_LOGE(TAG, "failed to create motor lock");
+        l298n_motor_free(mtr);
+        return ESP_ERR_NO_MEM;
+    }
+
     // Init motor stopped
-    ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in1_pin, 0), TAG, "failed to set gpio %d", mtr->in1_pin);
-    ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in2_pin, 0), TAG, "failed to set gpio %d", mtr->in2_pin);
+    if (l298n_motor_set_direction(mtr, 0) != ESP_OK) {
+        l298n_motor_free(mtr);
+        return ESP_ERR_INVALID_STATE;
+    }
     ledc_set_duty(mtr->ledc_mode, mtr->ledc_channel, 0);
     ledc_update_duty(mtr->ledc_mode, mtr->ledc_channel);
 
@@ -128,49 +438,445 @@ esp_err_t l298n_motor_init(l298n_motor_handle_t *motor, const l298n_motor_config
         l298n_motor_t *mtr = (l298n_motor_t *)arg;
         int a = gpio_get_level(mtr->encoder_a_pin);
         int b = gpio_get_level(mtr->encoder_b_pin);
+        portENTER_CRITICAL_ISR(&mtr->encoder_lock);
         if (a == b) {
             mtr->encoder_count++;
         } else {
             mtr->encoder_count--;
         }
+        l298n_motor_velocity_push(mtr, esp_timer_get_time(), mtr->encoder_count);
+        portEXIT_CRITICAL_ISR(&mtr->encoder_lock);
         // Do NOT update current_angle here!
     }
 
-esp_err_t l298n_motor_set_speed(l298n_motor_handle_t motor, int8_t speed_percent) {
-    const char *TAG = "l298n_motor_set_speed";
-    if (!motor) return ESP_ERR_INVALID_ARG;
-    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+// Set the direction pins, 0 sets both low. Caller holds the lock.
+static esp_err_t l298n_motor_set_direction(l298n_motor_t *mtr, int8_t direction) {
+    const char *TAG = "l298n_motor_set_direction";
+    ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in1_pin, direction > 0), TAG, "failed to set gpio %d", mtr->in1_pin);
+    ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in2_pin, direction < 0), TAG, "failed to set gpio %d", mtr->in2_pin);
+    mtr->direction = direction;
+    return ESP_OK;
+}
 
+// Stop a running ramp, the duty stays where the fade was. Caller holds the lock.
+static void l298n_motor_fade_stop(l298n_motor_t *mtr) {
+    if (mtr->ramp_pending) {
+        mtr->ramp_pending = false;
+        esp_timer_stop(mtr->ramp_timer);
+    }
+    if (mtr->fading) {
+        ledc_fade_stop(mtr->ledc_mode, mtr->ledc_channel);
+        mtr->fading = false;
+    }
+}
+
+// Drive the bridge with a duty in percent, the sign selects the direction. Caller holds the lock.
+static esp_err_t l298n_motor_apply(l298n_motor_t *mtr, float speed_percent) {
     if (speed_percent > 100) speed_percent = 100;
     if (speed_percent < -100) speed_percent = -100;
+    l298n_motor_fade_stop(mtr);
+    mtr->speed = (int8_t)lroundf(speed_percent);
 
-    if (speed_percent == 0) {
-        // brake: both direction pins low, PWM off
-        ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in1_pin, 0), TAG, "failed to set gpio %d", mtr->in1_pin);
-        ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in2_pin, 0), TAG, "failed to set gpio %d", mtr->in2_pin);
+    int8_t direction = (speed_percent > 0) - (speed_percent < 0);
+    uint32_t duty = (uint32_t)(mtr->pwm_max_duty * fabsf(speed_percent) / 100.0f);
+    if (direction != mtr->direction) {
+        // PWM off before the direction pins change, 0 brakes with both pins low
         ledc_set_duty(mtr->ledc_mode, mtr->ledc_channel, 0);
-        return ledc_update_duty(mtr->ledc_mode, mtr->ledc_channel);
+        ESP_RETURN_ON_ERROR(ledc_update_duty(mtr->ledc_mode, mtr->ledc_channel), "l298n_motor_apply", "failed to update duty");
+        ESP_RETURN_ON_ERROR(l298n_motor_set_direction(mtr, direction), "l298n_motor_apply", "failed to set direction");
+        if (duty == 0) return ESP_OK;
+    }
+
+    ledc_set_duty(mtr->ledc_mode, mtr->ledc_channel, duty);
+    return ledc_update_duty(mtr->ledc_mode, mtr->ledc_channel);
+}
+
+// Ramp to a speed on the LEDC fade engine, the hardware steps the duty. A reversal ramps
+// down first and the ramp timer turns around once the duty is zero. Caller holds the lock.
+static esp_err_t l298n_motor_ramp(l298n_motor_t *mtr, int8_t speed_percent) {
+    const char *TAG = "l298n_motor_ramp";
+    if (speed_percent > 100) speed_percent = 100;
+    if (speed_percent < -100) speed_percent = -100;
+    l298n_motor_fade_stop(mtr);
+    mtr->speed = speed_percent;
+
+    int8_t direction = (speed_percent > 0) - (speed_percent < 0);
+    uint32_t duty = ledc_get_duty(mtr->ledc_mode, mtr->ledc_channel);
+    uint32_t target_duty = mtr->pwm_max_duty * abs(speed_percent) / 100;
+    if (duty > 0 && direction != mtr->direction) {
+        // Through zero, or down to a stop, before the pins change
+        target_duty = 0;
+    } else if (direction != 0) {
+        ESP_RETURN_ON_ERROR(l298n_motor_set_direction(mtr, direction), TAG, "failed to set direction");
     }
 
-    // Set direction pins accordingly
-    if (speed_percent > 0) {
-        ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in1_pin, 1), TAG, "failed to set gpio %d", mtr->in1_pin);
-        ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in2_pin, 0), TAG, "failed to set gpio %d", mtr->in2_pin);
+    uint32_t ramp_ms = (target_duty > duty) ? (uint64_t)(target_duty - duty) * mtr->accel_ms / mtr->pwm_max_duty
+                                            : (uint64_t)(duty - target_duty) * mtr->decel_ms / mtr->pwm_max_duty;
+    if (ramp_ms == 0) {
+        ledc_set_duty(mtr->ledc_mode, mtr->ledc_channel, target_duty);
+        ESP_RETURN_ON_ERROR(ledc_update_duty(mtr->ledc_mode, mtr->ledc_channel), TAG, "failed to update duty");
     } else {
-        ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in1_pin, 0), TAG, "failed to set gpio %d", mtr->in1_pin);
-        ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in2_pin, 1), TAG, "failed to set gpio %d", mtr->in2_pin);
-        speed_percent = -speed_percent;
+        ESP_RETURN_ON_ERROR(ledc_set_fade_with_time(mtr->ledc_mode, mtr->ledc_channel, target_duty, ramp_ms), TAG, "failed to set fade");
+        ESP_RETURN_ON_ERROR(ledc_fade_start(mtr->ledc_mode, mtr->ledc_channel, LEDC_FADE_NO_WAIT), TAG, "failed to start fade");
+        mtr->fading = true;
+    }
+    if (target_duty == 0 && direction != mtr->direction) {
+        mtr->ramp_target = speed_percent;
+        mtr->ramp_pending = true;
+        ESP_RETURN_ON_ERROR(esp_timer_start_once(mtr->ramp_timer, ramp_ms * 1000ULL), TAG, "failed to start ramp timer");
     }
+    return ESP_OK;
+}
 
-    // Calculate duty
-    uint32_t duty = (mtr->pwm_max_duty * speed_percent) / 100;
+// The ramp down of a reversal or stop should be over, continue once the duty is zero
+static void l298n_motor_ramp_done(void *arg) {
+    l298n_motor_t *mtr = (l298n_motor_t *)arg;
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    if (mtr->ramp_pending) {
+        if (ledc_get_duty(mtr->ledc_mode, mtr->ledc_channel) != 0) {
+            esp_timer_start_once(mtr->ramp_timer, L298N_MOTOR_RAMP_POLL_US);
+        } else {
+            mtr->ramp_pending = false;
+            mtr->fading = false;
+            l298n_motor_set_direction(mtr, 0);
+            if (mtr->ramp_target != 0) l298n_motor_ramp(mtr, mtr->ramp_target);
+        }
+    }
+    xSemaphoreGive(mtr->lock);
+}
 
-    ledc_set_duty(mtr->ledc_mode, mtr->ledc_channel, duty);
-    return ledc_update_duty(mtr->ledc_mode, mtr->ledc_channel);
+// End a running move. Caller holds the lock and calls the returned callback after releasing it.
+static l298n_motor_move_cb_t l298n_motor_move_end(l298n_motor_t *mtr, void **arg) {
+    if (!mtr->move_active) return NULL;
+    mtr->move_active = false;
+    *arg = mtr->move.done_arg;
+    return mtr->move.done_cb;
+}
+
+// Leave closed loop control. Caller holds the lock.
+static void l298n_motor_ctrl_stop(l298n_motor_t *mtr) {
+    if (mtr->ctrl_active) {
+        mtr->ctrl_active = false;
+        esp_timer_stop(mtr->ctrl_timer);
+    }
 }
 
+// Start closed loop control if it is not running. Caller holds the lock.
+static esp_err_t l298n_motor_ctrl_start(l298n_motor_t *mtr) {
+    if (mtr->ctrl_active) return ESP_OK;
+    l298n_motor_velocity_t velocity;
+    l298n_motor_get_velocity((l298n_motor_handle_t)mtr, &velocity);
+    mtr->ctrl_integral = 0;
+    // Slew from the duty an open loop ramp left
+    mtr->ctrl_output = mtr->direction * 100.0f * ledc_get_duty(mtr->ledc_mode, mtr->ledc_channel) / mtr->pwm_max_duty;
+    mtr->ctrl_last_rpm = velocity.rpm;
+    mtr->ctrl_last_us = 0;
+    esp_err_t err = esp_timer_start_periodic(mtr->ctrl_timer, mtr->ctrl_period_us);
+    mtr->ctrl_active = (err == ESP_OK);
+    return err;
+}
+
+// Open loop command, ramped when ramps are configured
+static esp_err_t l298n_motor_command(l298n_motor_handle_t motor, int8_t speed_percent, bool ramp) {
+    if (!motor) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    // An open loop command ends closed loop control and cancels a move
+    void *done_arg = NULL;
+    l298n_motor_move_cb_t done_cb = l298n_motor_move_end(mtr, &done_arg);
+    l298n_motor_ctrl_stop(mtr);
+    esp_err_t err;
+    if (ramp && mtr->ramp_timer) {
+        err = l298n_motor_ramp(mtr, speed_percent);
+    } else {
+        err = l298n_motor_apply(mtr, speed_percent);
+    }
+    xSemaphoreGive(mtr->lock);
+    if (done_cb) done_cb(motor, L298N_MOTOR_MOVE_CANCELLED, done_arg);
+    return err;
+}
+
+// Set the duty in percent, ramped by the acceleration and deceleration limits
+esp_err_t l298n_motor_set_speed(l298n_motor_handle_t motor, int8_t speed_percent) {
+    return l298n_motor_command(motor, speed_percent, true);
+}
+
+// Reference position (relative to the start, positive) and velocity of the move profile at t
+static void l298n_motor_move_profile(l298n_motor_t *mtr, float t, float *position, float *velocity) {
+    float accel = mtr->move.acceleration;
+    float cruise_end = mtr->move_total_s - mtr->move_accel_s;
+    if (t >= mtr->move_total_s) {
+        *position = mtr->move_distance;
+        *velocity = 0;
+    } else if (t < mtr->move_accel_s) {
+        *position = 0.5f * accel * t * t;
+        *velocity = accel * t;
+    } else if (t < cruise_end) {
+        *position = 0.5f * mtr->move_peak_dps * mtr->move_accel_s + mtr->move_peak_dps * (t - mtr->move_accel_s);
+        *velocity = mtr->move_peak_dps;
+    } else {
+        float left = mtr->move_total_s - t;
+        *position = mtr->move_distance - 0.5f * accel * left * left;
+        *velocity = accel * left;
+    }
+}
+
+// Follow the move profile: the speed target is the profile velocity plus a correction
+// for the following error. Returns the result once the move is over, or -1.
+static int l298n_motor_move_step(l298n_motor_t *mtr, int64_t now, float rpm) {
+    float t = (now - mtr->move_start_us) / 1e6f;
+    float ref_position, ref_velocity;
+    l298n_motor_move_profile(mtr, t, &ref_position, &ref_velocity);
+    float angle = l298n_motor_get_angle((l298n_motor_handle_t)mtr);
+    float error = mtr->move_start_angle + mtr->move_dir * ref_position - angle;
+    float remaining = fabsf(mtr->move.target_angle - angle);
+
+    if (t >= mtr->move_total_s && remaining <= mtr->move.settle_band && fabsf(rpm) * 6.0f <= L298N_MOTOR_MOVE_SETTLE_DPS) {
+        return L298N_MOTOR_MOVE_DONE;
+    }
+    if (mtr->move.timeout_ms && now - mtr->move_start_us > mtr->move.timeout_ms * 1000LL) {
+        return L298N_MOTOR_MOVE_TIMEOUT;
+    }
+    int64_t count = l298n_motor_get_count((l298n_motor_handle_t)mtr);
+    if (count != mtr->move_count) {
+        mtr->move_count = count;
+        mtr->move_progress_us = now;
+    } else if (mtr->move.stall_ms && remaining > mtr->move.settle_band && now - mtr->move_progress_us > mtr->move.stall_ms * 1000LL) {
+        return L298N_MOTOR_MOVE_STALLED;
+    }
+    mtr->ctrl_target_rpm = (mtr->move_dir * ref_velocity + mtr->move.kp * error) / 6.0f;
+    return -1;
+}
+
+// Limit the change of the controller output over dt to the throttle ramps. A reversal
+// ramps down and stops at zero for a step, so the direction pins only change with the
+// PWM off. Without a down ramp it turns around from zero at once.
+static float l298n_motor_ctrl_slew(l298n_motor_t *mtr, float output, float dt) {
+    float applied = mtr->ctrl_output;
+    if (applied != 0 && (output > 0) != (applied > 0)) {
+        if (mtr->decel_ms) {
+            output = 0;
+        } else {
+            applied = 0;
+        }
+    }
+    uint16_t ramp_ms = (fabsf(output) > fabsf(applied)) ? mtr->accel_ms : mtr->decel_ms;
+    if (ramp_ms == 0) return output;
+    float max_step = 100.0f * dt * 1000.0f / ramp_ms;
+    if (output > applied + max_step) output = applied + max_step;
+    if (output < applied - max_step) output = applied - max_step;
+    return output;
+}
+
+// One step of the speed controller: feedforward from the target plus PID on the
+// measured RPM. The derivative acts on the measurement, so target steps do not kick.
+// The integral is frozen while the output is saturated in the direction of the error.
+// The output is slew limited by the throttle ramps, except for the brake at the end of a move.
+static void l298n_motor_speed_step(void *arg) {
+    l298n_motor_t *mtr = (l298n_motor_t *)arg;
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    if (!mtr->ctrl_active) {
+        // Stopped while this step was waiting for the lock
+        xSemaphoreGive(mtr->lock);
+        return;
+    }
+
+    float dt = mtr->ctrl_period_us / 1e6f;
+    if (mtr->ctrl_last_us) {
+        uint32_t period = start - mtr->ctrl_last_us;
+        uint32_t jitter = (period > mtr->ctrl_period_us) ? period - mtr->ctrl_period_us : mtr->ctrl_period_us - period;
+        l298n_motor_speed_ctrl_stats_t *stats = &mtr->ctrl_stats;
+        if (stats->periods == 0 || period < stats->period_min_us) stats->period_min_us = period;
+        if (period > stats->period_max_us) stats->period_max_us = period;
+        if (jitter > stats->jitter_max_us) stats->jitter_max_us = jitter;
+        mtr->ctrl_period_sum_us += period;
+        stats->periods++;
+        stats->period_avg_us = (float)mtr->ctrl_period_sum_us / stats->periods;
+        dt = period / 1e6f;
+    }
+    mtr->ctrl_last_us = start;
+
+    l298n_motor_velocity_t velocity;
+    l298n_motor_get_velocity((l298n_motor_handle_t)mtr, &velocity);
+    int move_result = -1;
+    if (mtr->move_active) {
+        move_result = l298n_motor_move_step(mtr, start, velocity.rpm);
+        if (move_result >= 0) {
+            // Over, brake and leave closed loop control
+            mtr->ctrl_target_rpm = 0;
+        }
+    }
+    float target = mtr->ctrl_target_rpm;
+    float output = 0;
+    float last_integral = mtr->ctrl_integral;
+    if (target == 0) {
+        // Brake like an open loop stop
+        mtr->ctrl_integral = 0;
+    } else {
+        float error = target - velocity.rpm;
+        float derivative = (velocity.rpm - mtr->ctrl_last_rpm) / dt;
+        float feedforward = mtr->ctrl.kff * target + copysignf(mtr->ctrl.ff_offset, target);
+        float integral = mtr->ctrl_integral + mtr->ctrl.ki * error * dt;
+        output = feedforward + mtr->ctrl.kp * error + integral - mtr->ctrl.kd * derivative;
+        if ((output > 100 && error > 0) || (output < -100 && error < 0)) {
+            output = output - integral + mtr->ctrl_integral;
+        } else {
+            mtr->ctrl_integral = integral;
+        }
+        if (output > 100) output = 100;
+        if (output < -100) output = -100;
+    }
+    mtr->ctrl_last_rpm = velocity.rpm;
+    if (move_result < 0) {
+        float limited = l298n_motor_ctrl_slew(mtr, output, dt);
+        // The integral also holds while the ramp holds the output back
+        if (target != 0 && limited != output && (output > limited) == (target > velocity.rpm)) mtr->ctrl_integral = last_integral;
+        output = limited;
+    }
+    mtr->ctrl_output = output;
+    l298n_motor_apply(mtr, output);
+
+    uint32_t loop = esp_timer_get_time() - start;
+    mtr->ctrl_loop_sum_us += loop;
+    mtr->ctrl_stats.loops++;
+    mtr->ctrl_stats.loop_avg_us = (float)mtr->ctrl_loop_sum_us / mtr->ctrl_stats.loops;
+    if (loop > mtr->ctrl_stats.loop_max_us) mtr->ctrl_stats.loop_max_us = loop;
+
+    void *done_arg = NULL;
+    l298n_motor_move_cb_t done_cb = NULL;
+    if (move_result >= 0) {
+        done_cb = l298n_motor_move_end(mtr, &done_arg);
+        l298n_motor_ctrl_stop(mtr);
+    }
+    xSemaphoreGive(mtr->lock);
+    if (done_cb) done_cb((l298n_motor_handle_t)mtr, (l298n_motor_move_result_t)move_result, done_arg);
+}
+
+// Set up closed loop speed control, l298n_motor_set_rpm() starts it
+esp_err_t l298n_motor_speed_control_init(l298n_motor_handle_t motor, const l298n_motor_speed_ctrl_config_t *config) {
+    const char *TAG = "l298n_motor_speed_control_init";
+    if (!motor || !config) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    ESP_RETURN_ON_FALSE(config->rate_hz >= L298N_MOTOR_SPEED_RATE_MIN_HZ && config->rate_hz <= L298N_MOTOR_SPEED_RATE_MAX_HZ,
+                        ESP_ERR_INVALID_ARG, TAG, "rate %lu Hz out of range", (unsigned long)config->rate_hz);
+
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (!mtr->ctrl_timer) {
+        esp_timer_create_args_t ctrl_timer_args = {
+            .callback = l298n_motor_speed_step,
+            .arg = mtr,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "motor_speed",
+            .skip_unhandled_events = true,
+        };
+        err = esp_timer_create(&ctrl_timer_args, &mtr->ctrl_timer);
+    }
+    if (err == ESP_OK) {
+        mtr->ctrl = *config;
+        mtr->ctrl_period_us = 1000000 / config->rate_hz;
+        if (mtr->ctrl_active) {
+            // Apply the new rate
+            esp_timer_stop(mtr->ctrl_timer);
+            mtr->ctrl_last_us = 0;
+            err = esp_timer_start_periodic(mtr->ctrl_timer, mtr->ctrl_period_us);
+        }
+    }
+    xSemaphoreGive(mtr->lock);
+    ESP_RETURN_ON_ERROR(err, TAG, "failed to set up speed control timer");
+    return ESP_OK;
+}
+
+// Drive at a wheel speed in RPM, starting closed loop control if it is not running
+esp_err_t l298n_motor_set_rpm(l298n_motor_handle_t motor, float rpm) {
+    const char *TAG = "l298n_motor_set_rpm";
+    if (!motor) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    ESP_RETURN_ON_FALSE(mtr->ctrl_timer, ESP_ERR_INVALID_STATE, TAG, "speed control not initialized");
+
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    // A speed command replaces a running move
+    void *done_arg = NULL;
+    l298n_motor_move_cb_t done_cb = l298n_motor_move_end(mtr, &done_arg);
+    mtr->ctrl_target_rpm = rpm;
+    esp_err_t err = l298n_motor_ctrl_start(mtr);
+    xSemaphoreGive(mtr->lock);
+    if (done_cb) done_cb(motor, L298N_MOTOR_MOVE_CANCELLED, done_arg);
+    return err;
+}
+
+// Start a move to an absolute angle and return. The speed controller follows a trapezoidal
+// profile (triangular when the cruise speed is not reached) and done_cb reports the end.
+// A new move, speed command or open loop command cancels a running move.
+esp_err_t l298n_motor_move_to_angle(l298n_motor_handle_t motor, const l298n_motor_move_config_t *config) {
+    const char *TAG = "l298n_motor_move_to_angle";
+    if (!motor || !config) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    ESP_RETURN_ON_FALSE(mtr->ctrl_timer, ESP_ERR_INVALID_STATE, TAG, "speed control not initialized");
+    ESP_RETURN_ON_FALSE(config->max_velocity > 0 && config->acceleration > 0, ESP_ERR_INVALID_ARG, TAG, "velocity and acceleration must be positive");
+
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    void *done_arg = NULL;
+    l298n_motor_move_cb_t done_cb = l298n_motor_move_end(mtr, &done_arg);
+
+    mtr->move = *config;
+    if (mtr->move.settle_band <= 0) mtr->move.settle_band = L298N_MOTOR_MOVE_SETTLE_BAND_DEFAULT;
+    if (mtr->move.kp <= 0) mtr->move.kp = L298N_MOTOR_MOVE_KP_DEFAULT;
+    mtr->move_start_angle = l298n_motor_get_angle(motor);
+    float distance = config->target_angle - mtr->move_start_angle;
+    mtr->move_dir = (distance < 0) ? -1.0f : 1.0f;
+    mtr->move_distance = fabsf(distance);
+    // Cruise speed is only reached when the ramps leave room for it
+    mtr->move_peak_dps = fminf(config->max_velocity, sqrtf(mtr->move_distance * config->acceleration));
+    mtr->move_accel_s = mtr->move_peak_dps / config->acceleration;
+    mtr->move_total_s = 2 * mtr->move_accel_s;
+    if (mtr->move_peak_dps > 0) mtr->move_total_s += mtr->move_distance / mtr->move_peak_dps - mtr->move_accel_s;
+    mtr->move_start_us = esp_timer_get_time();
+    mtr->move_count = l298n_motor_get_count(motor);
+    mtr->move_progress_us = mtr->move_start_us;
+    mtr->move_active = true;
+    esp_err_t err = l298n_motor_ctrl_start(mtr);
+    if (err != ESP_OK) mtr->move_active = false;
+    xSemaphoreGive(mtr->lock);
+    if (done_cb) done_cb(motor, L298N_MOTOR_MOVE_CANCELLED, done_arg);
+    ESP_RETURN_ON_ERROR(err, TAG, "failed to start speed control");
+    return ESP_OK;
+}
+
+// Stop a running move and brake, done_cb reports L298N_MOTOR_MOVE_CANCELLED
+esp_err_t l298n_motor_move_cancel(l298n_motor_handle_t motor) {
+    if (!motor) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    if (!mtr->move_active) return ESP_ERR_INVALID_STATE;
+    return l298n_motor_stop(motor);
+}
+
+bool l298n_motor_move_busy(l298n_motor_handle_t motor) {
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    return mtr->move_active;
+}
+
+// Timing of the control loop since it was set up or the last reset
+esp_err_t l298n_motor_get_speed_control_stats(l298n_motor_handle_t motor, l298n_motor_speed_ctrl_stats_t *stats, bool reset) {
+    if (!motor || !stats) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    if (!mtr->ctrl_timer) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    *stats = mtr->ctrl_stats;
+    if (reset) {
+        memset(&mtr->ctrl_stats, 0, sizeof(mtr->ctrl_stats));
+        mtr->ctrl_period_sum_us = 0;
+        mtr->ctrl_loop_sum_us = 0;
+    }
+    xSemaphoreGive(mtr->lock);
+    return ESP_OK;
+}
+
+// Stop at once, without a ramp
 esp_err_t l298n_motor_stop(l298n_motor_handle_t motor) {
-    return l298n_motor_set_speed(motor, 0);
+    return l298n_motor_command(motor, 0, false);
 }
 
 int8_t l298n_motor_get_speed(l298n_motor_handle_t motor) {
@@ -178,33 +884,203 @@ int8_t l298n_motor_get_speed(l298n_motor_handle_t motor) {
     return mtr->speed;
 }
 
+// Get encoder counts since the last reset, 4 per pulse with the PCNT backend
+int64_t l298n_motor_get_count(l298n_motor_handle_t motor) {
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    return l298n_motor_read_count(mtr);
+}
+
+// Get the shaft velocity. At speed it is the count change over at least the window
+// (count method), below one count per window the span stretches back to the previous
+// edge (period method). Both are the same formula, so the switch has no step.
+// timestamp_us is the time of the newest edge the estimate is based on.
+// With PCNT a read keeps the 1 ms sampler running for L298N_MOTOR_VELOCITY_IDLE_US.
+esp_err_t l298n_motor_get_velocity(l298n_motor_handle_t motor, l298n_motor_velocity_t *velocity) {
+    if (!motor || !velocity) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    int64_t now = esp_timer_get_time();
+    float counts_per_us = 0.0f;
+
+    portENTER_CRITICAL(&mtr->encoder_lock);
+    mtr->velocity_read_us = now;
+    bool start = mtr->velocity_timer && !mtr->velocity_sampling;
+    if (start) mtr->velocity_sampling = true;
+    int newest = (mtr->velocity_head + L298N_MOTOR_VELOCITY_EDGES - 1) % L298N_MOTOR_VELOCITY_EDGES;
+    int64_t newest_us = mtr->velocity_len ? mtr->velocity_edges[newest].time_us : now;
+    int64_t newest_count = mtr->velocity_edges[newest].count;
+    int first = newest;
+    for (int i = 1; i < mtr->velocity_len; i++) {
+        int index = (newest + L298N_MOTOR_VELOCITY_EDGES - i) % L298N_MOTOR_VELOCITY_EDGES;
+        // An edge from before a standstill says nothing about the current speed
+        if (newest_us - mtr->velocity_edges[index].time_us > L298N_MOTOR_VELOCITY_STOP_US) break;
+        first = index;
+        if (newest_us - mtr->velocity_edges[index].time_us >= L298N_MOTOR_VELOCITY_WINDOW_US) break;
+    }
+    int64_t span_us = newest_us - mtr->velocity_edges[first].time_us;
+    int64_t counts = newest_count - mtr->velocity_edges[first].count;
+    portEXIT_CRITICAL(&mtr->encoder_lock);
+    if (start) esp_timer_start_once(mtr->velocity_timer, L298N_MOTOR_VELOCITY_SAMPLE_US);
+
+    int64_t idle_us = now - newest_us;
+    // PCNT edge times are only known to the sample period, a shorter span than the window
+    // (right after standstill or the start of sampling) would be mostly quantization
+    bool trusted = !mtr->velocity_timer || span_us >= L298N_MOTOR_VELOCITY_WINDOW_US;
+    if (first != newest && span_us > 0 && trusted && idle_us < L298N_MOTOR_VELOCITY_STOP_US) {
+        counts_per_us = (float)counts / (float)span_us;
+        // Without a new edge the speed is at most one count since the last one
+        if (fabsf(counts_per_us) * idle_us > 1.0f) {
+            counts_per_us = copysignf(1.0f / (float)idle_us, counts_per_us);
+        }
+    }
+
+    velocity->deg_per_s = counts_per_us * 1e6f * 360.0f / (float)mtr->encoder_counts_per_rev;
+    velocity->rpm = velocity->deg_per_s / 6.0f;
+    velocity->timestamp_us = newest_us;
+    return ESP_OK;
+}
+
 // Get current angle in degrees
 float l298n_motor_get_angle(l298n_motor_handle_t motor) {
     l298n_motor_t *mtr = (l298n_motor_t *)motor;
-    // Calculate angle from encoder_count
-    return 360.0f * ((float)mtr->encoder_count / (float)mtr->encoder_pulses_per_rev);
+    // Calculate angle from the encoder count
+    return 360.0f * ((float)l298n_motor_get_count(motor) / (float)mtr->encoder_counts_per_rev);
 }
 
 // Reset encoder count and angle
 esp_err_t l298n_motor_reset_angle(l298n_motor_handle_t motor) {
     l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    portENTER_CRITICAL(&mtr->encoder_lock);
     mtr->encoder_count = 0;
+    if (mtr->encoder_backend == L298N_MOTOR_ENCODER_PCNT) {
+        pcnt_unit_clear_count(mtr->pcnt_unit);
+        mtr->pcnt_overflow = 0;
+        mtr->pcnt_last = 0;
+    }
+    // Velocity history is in the old counts
+    mtr->velocity_len = 0;
+    portEXIT_CRITICAL(&mtr->encoder_lock);
     // current_angle is now calculated on demand
     return ESP_OK;
 }
 
-// Drive to target angle (blocking, simple implementation)
-esp_err_t l298n_motor_drive_to_angle(l298n_motor_handle_t motor, float target_angle, int8_t speed_percent) {
-    float current = l298n_motor_get_angle(motor);
-    int8_t dir = (target_angle > current) ? speed_percent : -speed_percent;
-    l298n_motor_set_speed(motor, dir);
-    while (fabsf(l298n_motor_get_angle(motor) - target_angle) > 1.0f) {
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+typedef struct {
+    SemaphoreHandle_t done;
+    l298n_motor_move_result_t result;
+} l298n_motor_drive_wait_t;
+
+static void l298n_motor_drive_done(l298n_motor_handle_t motor, l298n_motor_move_result_t result, void *arg) {
+    l298n_motor_drive_wait_t *wait = (l298n_motor_drive_wait_t *)arg;
+    wait->result = result;
+    xSemaphoreGive(wait->done);
+}
+
+// Without speed control: speed_percent of duty until the angle is in the settle band or
+// passed, stopped when the count does not change for the stall time or on the timeout
+static esp_err_t l298n_motor_drive_open_loop(l298n_motor_t *mtr, float target_angle, int8_t speed_percent) {
+    const char *TAG = "l298n_motor_drive_open_loop";
+    l298n_motor_handle_t motor = (l298n_motor_handle_t)mtr;
+    float sign = (target_angle > l298n_motor_get_angle(motor)) ? 1.0f : -1.0f;
+    if (sign * (target_angle - l298n_motor_get_angle(motor)) <= L298N_MOTOR_MOVE_SETTLE_BAND_DEFAULT) return ESP_OK;
+    ESP_RETURN_ON_ERROR(l298n_motor_set_speed(motor, sign > 0 ? abs(speed_percent) : -abs(speed_percent)), TAG, "failed to set speed");
+
+    int64_t start_us = esp_timer_get_time();
+    // The throttle ramp counts as progress
+    int64_t progress_us = start_us + mtr->accel_ms * 1000LL;
+    int64_t count = l298n_motor_get_count(motor);
+    esp_err_t err = ESP_OK;
+    while (sign * (target_angle - l298n_motor_get_angle(motor)) > L298N_MOTOR_MOVE_SETTLE_BAND_DEFAULT) {
+        vTaskDelay(pdMS_TO_TICKS(L298N_MOTOR_DRIVE_POLL_MS));
+        int64_t now = esp_timer_get_time();
+        int64_t new_count = l298n_motor_get_count(motor);
+        if (new_count != count) {
+            count = new_count;
+            if (now > progress_us) progress_us = now;
+        } else if (now - progress_us > L298N_MOTOR_DRIVE_STALL_MS * 1000LL) {
+            ESP_LOGW(TAG, "stalled at %.1f deg", l298n_motor_get_angle(motor));
+            err = ESP_FAIL;
+            break;
+        }
+        if (now - start_us > L298N_MOTOR_DRIVE_OPEN_LOOP_TIMEOUT_MS * 1000LL) {
+            ESP_LOGW(TAG, "timed out at %.1f deg", l298n_motor_get_angle(motor));
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
     }
     l298n_motor_stop(motor);
-    return ESP_OK;
+    return err;
 }
 
+// Drive to target angle, blocking until the move ends. With speed control the cruise speed
+// is the wheel speed that speed_percent of duty gives by the feedforward, without it the
+// motor runs open loop at speed_percent.
+esp_err_t l298n_motor_drive_to_angle(l298n_motor_handle_t motor, float target_angle, int8_t speed_percent) {
+    if (!motor) return ESP_ERR_INVALID_ARG;
+    l298n_motor_t *mtr = (l298n_motor_t *)motor;
+    if (speed_percent == 0) return ESP_ERR_INVALID_ARG;
+    if (!mtr->ctrl_timer || mtr->ctrl.kff <= 0) return l298n_motor_drive_open_loop(mtr, target_angle, speed_percent);
+
+    l298n_motor_drive_wait_t wait = {
+        .done = xSemaphoreCreateBinary(),
+        .result = L298N_MOTOR_MOVE_CANCELLED,
+    };
+    if (!wait.done) return ESP_ERR_NO_MEM;
+    float max_velocity = 6.0f * abs(speed_percent) / mtr->ctrl.kff;
+    float distance = fabsf(target_angle - l298n_motor_get_angle(motor));
+    l298n_motor_move_config_t move = {
+        .target_angle = target_angle,
+        .max_velocity = max_velocity,
+        .acceleration = max_velocity * 1000 / L298N_MOTOR_DRIVE_RAMP_MS,
+        // Twice the planned time and a second to settle
+        .timeout_ms = (uint32_t)(2000 * distance / max_velocity) + 2 * L298N_MOTOR_DRIVE_RAMP_MS + 1000,
+        .stall_ms = L298N_MOTOR_DRIVE_STALL_MS,
+        .done_cb = l298n_motor_drive_done,
+        .done_arg = &wait,
+    };
+    esp_err_t err = l298n_motor_move_to_angle(motor, &move);
+    if (err == ESP_OK) {
+        xSemaphoreTake(wait.done, portMAX_DELAY);
+        switch (wait.result) {
+            case L298N_MOTOR_MOVE_DONE:
+                err = ESP_OK;
+                break;
+            case L298N_MOTOR_MOVE_TIMEOUT:
+                err = ESP_ERR_TIMEOUT;
+                break;
+            case L298N_MOTOR_MOVE_STALLED:
+                err = ESP_FAIL;
+                break;
+            default:
+                err = ESP_ERR_INVALID_STATE;
+                break;
+        }
+    }
+    vSemaphoreDelete(wait.done);
+    return err;
+}
+
+static void l298n_motor_sync_done(void *arg) {
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+
+// Wait until the esp_timer task has finished every callback dispatched so far, they run one after the other
+static void l298n_motor_timer_sync(void) {
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    if (!done) return;
+    esp_timer_handle_t timer;
+    esp_timer_create_args_t timer_args = {
+        .callback = l298n_motor_sync_done,
+        .arg = done,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "motor_sync",
+    };
+    if (esp_timer_create(&timer_args, &timer) == ESP_OK) {
+        if (esp_timer_start_once(timer, 0) == ESP_OK) xSemaphoreTake(done, portMAX_DELAY);
+        esp_timer_delete(timer);
+    }
+    vSemaphoreDelete(done);
+}
+
+// Must not be called from an esp_timer callback
 esp_err_t l298n_motor_deinit(l298n_motor_handle_t motor) {
     const char *TAG = "l298n_motor_deinit";
     if (!motor) return ESP_ERR_INVALID_ARG;
@@ -213,18 +1089,31 @@ esp_err_t l298n_motor_deinit(l298n_motor_handle_t motor) {
     // Stop motor
     l298n_motor_stop(motor);
 
-    ESP_RETURN_ON_ERROR(ledc_stop(mtr->ledc_mode, mtr->ledc_channel, 0), TAG, "failed to stop ledc");
+    // Stop the timers under the lock, so no callback restarts one. A speed step or ramp
+    // check waiting for the lock finds nothing to do once it gets it.
+    xSemaphoreTake(mtr->lock, portMAX_DELAY);
+    l298n_motor_ctrl_stop(mtr);
+    mtr->ramp_pending = false;
+    if (mtr->ramp_timer) esp_timer_stop(mtr->ramp_timer);
+    xSemaphoreGive(mtr->lock);
+    portENTER_CRITICAL(&mtr->encoder_lock);
+    mtr->velocity_sampling = false;
+    portEXIT_CRITICAL(&mtr->encoder_lock);
+    if (mtr->velocity_timer) esp_timer_stop(mtr->velocity_timer);
+    // A callback already dispatched may still run, the timers, the lock and mtr stay until it returned
+    l298n_motor_timer_sync();
+
+    if (ledc_stop(mtr->ledc_mode, mtr->ledc_channel, 0) != ESP_OK) ESP_LOGE(TAG, "failed to stop ledc");
 
     // Optionally reset GPIOs (not mandatory)
-    ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in1_pin, 0), TAG, "failed to set gpio %d", mtr->in1_pin);
-    ESP_RETURN_ON_ERROR(gpio_set_level(mtr->in2_pin, 0), TAG, "failed to set gpio %d", mtr->in2_pin);
+    l298n_motor_set_direction(mtr, 0);
     gpio_reset_pin(mtr->in1_pin);
     gpio_reset_pin(mtr->in2_pin);
 
     // Reset PWM pin
     gpio_reset_pin(mtr->en_pin);
 
-    free(mtr);
+    l298n_motor_free(mtr);
     return ESP_OK;
 }
 
@@ -245,6 +1134,10 @@ l298n_motor_config_t *l298n_motor_get_config(l298n_motor_handle_t motor) {
     config->encoder_a_pin = mtr->encoder_a_pin;
     config->encoder_b_pin = mtr->encoder_b_pin;
     config->encoder_pulses_per_rev = mtr->encoder_pulses_per_rev;
+    config->encoder_backend = mtr->encoder_backend;
+    config->encoder_glitch_ns = mtr->encoder_glitch_ns;
+    config->accel_ms = mtr->accel_ms;
+    config->decel_ms = mtr->decel_ms;
 
     return config;
 }
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# Generate the scaled glyph atlases of font8x8_basic_tr.
+#
+# ssd1306_display_text_x3() used to stretch every glyph bit by bit at runtime.
+# This script does it once at build time and writes font8x8_atlas.h with
+#   font8x8_x1[code][column]               8x8 glyphs
+#   font8x8_x2[code][page * 16 + column]   16x16 glyphs
+#   font8x8_x3[code][page * 24 + column]   24x24 glyphs
+#   font8x8_x4[code][page * 32 + column]   32x32 glyphs
+#   font8x8_prop[code] = { first column, width }   proportional metrics at 1x
+# Glyphs are in GDDRAM layout (one byte per column and page, LSB on top),
+# pages of a glyph are stored one after the other.
+#
+# Usage: gen_font_atlas.py font8x8_basic.h font8x8_atlas.h
+
+import sys
+
+# Keep the source tree free of __pycache__
+sys.dont_write_bytecode = True
+from gen_font_variants import read_font  # noqa: E402
+
+SCALES = (1, 2, 3, 4)
+SPACE_WIDTH = 4  # Width of glyphs without pixels, in 1x columns
+
+
+def scale_glyph(glyph, scale):
+    columns = []
+    for value in glyph:
+        tall = 0
+        for bit in range(8):
+            if value & (1 << bit):
+                tall |= ((1 << scale) - 1) << (bit * scale)
+        columns += [tall] * scale
+    out = []
+    for page in range(scale):
+        out += [(tall >> (page * 8)) & 0xFF for tall in columns]
+    return out
+
+
+def metrics(glyph):
+    used = [column for column, value in enumerate(glyph) if value]
+    if not used:
+        return 0, SPACE_WIDTH
+    return used[0], used[-1] - used[0] + 1
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: gen_font_atlas.py font8x8_basic.h font8x8_atlas.h')
+    glyphs = read_font(sys.argv[1])
+
+    lines = [
+        '// Generated by gen_font_atlas.py from font8x8_basic.h, do not edit',
+        '',
+        '#ifndef MAIN_FONT8X8_ATLAS_H_',
+        '#define MAIN_FONT8X8_ATLAS_H_',
+        '',
+    ]
+    for scale in SCALES:
+        size = 8 * scale * scale
+        lines.append('static const uint8_t font8x8_x{}[128][{}] = {{'.format(scale, size))
+        for code, glyph in enumerate(glyphs):
+            data = ','.join('0x{:02X}'.format(v) for v in scale_glyph(glyph, scale))
+            lines.append('  {{ {} }},   // U+00{:02X}'.format(data, code))
+        lines += ['};', '']
+    lines.append('static const uint8_t font8x8_prop[128][2] = {')
+    for code, glyph in enumerate(glyphs):
+        lines.append('  {{ {}, {} }},   // U+00{:02X}'.format(*metrics(glyph), code))
+    lines += ['};', '', '#endif /* MAIN_FONT8X8_ATLAS_H_ */', '']
+
+    with open(sys.argv[2], 'w') as f:
+        f.write('\n'.join(lines))
+
+
+if __name__ == '__main__':
+    main()
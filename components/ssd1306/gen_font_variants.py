@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+#
+# Generate the ready to send variants of font8x8_basic_tr.
+#
+# The driver used to invert every glyph at runtime.
+# This script does it once at build time and writes font8x8_variants.h with
+#   font8x8_variants[FONT8X8_INVERT][code][column]
+# Flip is done by the panel, so there are no bit reversed variants.
+#
+# Usage: gen_font_variants.py font8x8_basic.h font8x8_variants.h
+
+import re
+import sys
+
+
+def read_font(path):
+    with open(path) as f:
+        source = f.read()
+    table = source[source.index('font8x8_basic_tr['):]
+    # Row comments name the character, which may be a brace
+    table = re.sub(r'//[^\n]*', '', table)
+    glyphs = []
+    for row in re.findall(r'\{([^{}]*)\}', table):
+        glyphs.append([int(v, 16) for v in re.findall(r'0x[0-9A-Fa-f]{2}', row)])
+    if len(glyphs) != 128 or any(len(g) != 8 for g in glyphs):
+        sys.exit('{}: expected 128 glyphs of 8 columns'.format(path))
+    return glyphs
+
+
+def variant(glyph, invert):
+    if invert:
+        return [~v & 0xFF for v in glyph]
+    return glyph
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: gen_font_variants.py font8x8_basic.h font8x8_variants.h')
+    glyphs = read_font(sys.argv[1])
+
+    lines = [
+        '// Generated by gen_font_variants.py from font8x8_basic.h, do not edit',
+        '',
+        '#ifndef MAIN_FONT8X8_VARIANTS_H_',
+        '#define MAIN_FONT8X8_VARIANTS_H_',
+        '',
+        '#define FONT8X8_INVERT 0x01',
+        '',
+        'static const uint8_t font8x8_variants[2][128][8] = {',
+    ]
+    for index in range(2):
+        lines.append('  {{ // {}'.format('invert' if index & 1 else 'normal'))
+        for code, glyph in enumerate(glyphs):
+            data = ', '.join('0x{:02X}'.format(v) for v in variant(glyph, index & 1))
+            lines.append('    {{ {} }},   // U+00{:02X}'.format(data, code))
+        lines.append('  },')
+    lines += ['};', '', '#endif /* MAIN_FONT8X8_VARIANTS_H_ */', '']
+
+    with open(sys.argv[2], 'w') as f:
+        f.write('\n'.join(lines))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,31 +1,323 @@
 #include <string.h>
+#include <stdlib.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "ssd1306.h"
+#include "ssd1306_font.h"
 #include "font8x8_basic.h"
+#include "font8x8_variants.h"
 
-#define PACK8 __attribute__((aligned( __alignof__( uint8_t ) ), packed ))
-
-typedef union out_column_t {
-	uint32_t u32;
-	uint8_t  u8[4];
-} PACK8 out_column_t;
+// Bit reversal table for ssd1306_rotate_byte() and ssd1306_flip()
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+static const uint8_t ssd1306_rev8[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R2
+#undef R4
+#undef R6
 
 void ssd1306_init(SSD1306_t * dev, int width, int height)
 {
-	if (dev->_address == SPI_ADDRESS) {
-		spi_init(dev, width, height);
-	} else {
-		i2c_init(dev, width, height);
-	}
+	dev->_ops->init(dev, width, height);
+	// Init sets the display start line back to 0
+	dev->_conEnable = false;
+	dev->_conTop = 0;
+	dev->_contrast = 0xFF;
 	// Initialize internal buffer
+	// GRAM content is undefined after power-up, so the first flush sends everything
 	for (int i=0;i<dev->_pages;i++) {
 		memset(dev->_page[i]._segs, 0, 128);
+		ssd1306_mark_dirty(dev, i, 0, dev->_width);
+	}
+	if (dev->_front != NULL) ssd1306_swap_buffers(dev);
+}
+
+static inline void ssd1306_send_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width)
+{
+	dev->_ops->write_region(dev, page, seg, images, width);
+}
+
+// Wait for transfers the transport queued in the background
+static inline void ssd1306_wait_idle(SSD1306_t * dev)
+{
+	dev->_ops->wait(dev);
+}
+
+static inline void ssd1306_send_frame(SSD1306_t * dev, const PAGE_t * pages)
+{
+	dev->_ops->flush(dev, pages);
+}
+
+// Frame streamed to the panel, the front buffer when double buffering
+static inline PAGE_t * ssd1306_shown_pages(SSD1306_t * dev)
+{
+	return (dev->_front != NULL) ? dev->_front : dev->_page;
+}
+
+// Update the transfer time and the frame rate, averaged over one second
+static void ssd1306_frame_done(SSD1306_t * dev, int64_t start)
+{
+	int64_t now = esp_timer_get_time();
+	dev->_frameUs = now - start;
+	dev->_fpsFrames++;
+	if (dev->_fpsStart == 0) dev->_fpsStart = start;
+	int64_t elapsed = now - dev->_fpsStart;
+	if (elapsed >= 1000000) {
+		dev->_fps = dev->_fpsFrames * 1000000.0f / elapsed;
+		ESP_LOGD(__FUNCTION__, "fps=%.1f frame=%lldus", dev->_fps, dev->_frameUs);
+		dev->_fpsFrames = 0;
+		dev->_fpsStart = now;
+	}
+}
+
+static inline void ssd1306_clear_dirty(PAGE_t * page)
+{
+	page->_dirtyStart = 128;
+	page->_dirtyEnd = -1;
+}
+
+static void ssd1306_extend_dirty(PAGE_t * page, int seg, int end)
+{
+	if (page->_dirtyEnd < page->_dirtyStart) {
+		page->_dirtyStart = seg;
+		page->_dirtyEnd = end;
+		return;
+	}
+	if (seg < page->_dirtyStart) page->_dirtyStart = seg;
+	if (end > page->_dirtyEnd) page->_dirtyEnd = end;
+}
+
+// Have done(arg) called once everything queued so far is sent, by the transport if it can tell
+static void ssd1306_notify_done(SSD1306_t * dev, ssd1306_done_cb_t done, void * arg)
+{
+	if (done == NULL) return;
+	if (dev->_ops->notify == NULL) {
+		ssd1306_wait_idle(dev);
+		done(arg);
+		return;
+	}
+	dev->_doneCb = done;
+	dev->_doneArg = arg;
+	dev->_ops->notify(dev);
+}
+
+// End of a frame. Without a callback wait for the transfer and time it, with one return
+// right away, the transport times the transfer when it reports it done.
+static void ssd1306_frame_sent(SSD1306_t * dev, int64_t start, ssd1306_done_cb_t done, void * arg)
+{
+	dev->_batch = false;
+	if (done == NULL || dev->_ops->notify == NULL) ssd1306_wait_idle(dev);
+	ssd1306_frame_done(dev, start);
+	dev->_frameStart = start;
+	ssd1306_notify_done(dev, done, arg);
+}
+
+// Send every page of a frame and mark it clean
+static void ssd1306_send_buffer(SSD1306_t * dev, PAGE_t * pages, ssd1306_done_cb_t done, void * arg)
+{
+	int64_t start = esp_timer_get_time();
+	if (dev->_burst) {
+		ssd1306_send_frame(dev, pages);
+	} else {
+		dev->_batch = true;
+		for (int page=0; page<dev->_pages;page++) {
+			ssd1306_send_image(dev, page, 0, pages[page]._segs, dev->_width);
+		}
+	}
+	for (int page=0; page<dev->_pages;page++) {
+		ssd1306_clear_dirty(&pages[page]);
+	}
+	ssd1306_frame_sent(dev, start, done, arg);
+}
+
+// Store images to internal buffer and extend the dirty range by the segments that actually changed
+static void ssd1306_store_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width)
+{
+	uint8_t * segs = &dev->_page[page]._segs[seg];
+	if (images == segs) {
+		// Modified in place by the caller, nothing to compare against
+		ssd1306_mark_dirty(dev, page, seg, width);
+		return;
+	}
+	int first = 0;
+	while (first < width && segs[first] == images[first]) first++;
+	if (first == width) return;
+	int last = width - 1;
+	while (segs[last] == images[last]) last--;
+	memcpy(&segs[first], &images[first], last - first + 1);
+	ssd1306_mark_dirty(dev, page, seg + first, last - first + 1);
+}
+
+void ssd1306_set_deferred(SSD1306_t * dev, bool deferred)
+{
+	dev->_deferred = deferred;
+}
+
+void ssd1306_mark_dirty(SSD1306_t * dev, int page, int seg, int width)
+{
+	if (page < 0 || page >= dev->_pages) return;
+	int end = seg + width - 1;
+	if (seg < 0) seg = 0;
+	if (end >= dev->_width) end = dev->_width - 1;
+	if (seg > end) return;
+	ssd1306_extend_dirty(&dev->_page[page], seg, end);
+}
+
+// Allocate a front buffer, from now on drawing goes to the back buffer (_page)
+// and only frames published by ssd1306_swap_buffers() reach the panel
+esp_err_t ssd1306_enable_back_buffer(SSD1306_t * dev)
+{
+	if (dev->_front != NULL) return ESP_OK;
+	PAGE_t * front = malloc(sizeof(PAGE_t) * 8);
+	if (front == NULL) return ESP_ERR_NO_MEM;
+	// Whatever was not flushed yet becomes the first published frame
+	memcpy(front, dev->_page, sizeof(PAGE_t) * 8);
+	for (int page=0; page<8; page++) {
+		ssd1306_clear_dirty(&dev->_page[page]);
+	}
+	dev->_front = front;
+	return ESP_OK;
+}
+
+void ssd1306_disable_back_buffer(SSD1306_t * dev)
+{
+	PAGE_t * front = dev->_front;
+	if (front == NULL) return;
+	// Keep the pending changes of both buffers so the next flush sends them
+	for (int page=0; page<8; page++) {
+		if (front[page]._dirtyEnd >= front[page]._dirtyStart) {
+			ssd1306_extend_dirty(&dev->_page[page], front[page]._dirtyStart, front[page]._dirtyEnd);
+		}
+	}
+	dev->_front = NULL;
+	free(front);
+}
+
+// Publish the back buffer. Only the spans changed since the last swap are copied,
+// so this is cheap enough to call once per frame while the panel still shows the old one
+void ssd1306_swap_buffers(SSD1306_t * dev)
+{
+	if (dev->_front == NULL) return;
+	for (int page=0; page<dev->_pages; page++) {
+		PAGE_t * back = &dev->_page[page];
+		PAGE_t * front = &dev->_front[page];
+		if (back->_dirtyEnd < back->_dirtyStart) continue;
+		memcpy(&front->_segs[back->_dirtyStart], &back->_segs[back->_dirtyStart], back->_dirtyEnd - back->_dirtyStart + 1);
+		ssd1306_extend_dirty(front, back->_dirtyStart, back->_dirtyEnd);
+		ssd1306_clear_dirty(back);
+	}
+}
+
+int ssd1306_swap_and_flush(SSD1306_t * dev)
+{
+	ssd1306_swap_buffers(dev);
+	return ssd1306_flush(dev);
+}
+
+static int ssd1306_flush_pages(SSD1306_t * dev, ssd1306_done_cb_t done, void * arg)
+{
+	// One asynchronous flush at a time, the previous callback must not be lost
+	if (dev->_doneArmed) ssd1306_wait_idle(dev);
+	PAGE_t * pages = ssd1306_shown_pages(dev);
+	int frame = dev->_pages * dev->_width;
+	int dirty = 0;
+	for (int page=0; page<dev->_pages; page++) {
+		PAGE_t * _page = &pages[page];
+		if (_page->_dirtyEnd >= _page->_dirtyStart) dirty = dirty + _page->_dirtyEnd - _page->_dirtyStart + 1;
+	}
+	if (dirty == 0) {
+		ssd1306_notify_done(dev, done, arg);
+		return frame;
+	}
+	// One full frame transfer is cheaper than many address setups once most of the screen changed
+	if (dev->_burst && dirty * 2 >= frame) {
+		ssd1306_send_buffer(dev, pages, done, arg);
+		return 0;
+	}
+
+	int64_t start = esp_timer_get_time();
+	int sent = 0;
+	dev->_batch = true;
+	for (int page=0; page<dev->_pages; page++) {
+		PAGE_t * _page = &pages[page];
+		if (_page->_dirtyEnd < _page->_dirtyStart) continue;
+		int width = _page->_dirtyEnd - _page->_dirtyStart + 1;
+		ssd1306_send_image(dev, page, _page->_dirtyStart, &_page->_segs[_page->_dirtyStart], width);
+		ssd1306_clear_dirty(_page);
+		sent = sent + width;
 	}
+	ssd1306_frame_sent(dev, start, done, arg);
+	int saved = frame - sent;
+	ESP_LOGD(__FUNCTION__, "sent=%d saved=%d", sent, saved);
+	return saved;
+}
+
+// Send the dirty span of every page and return the number of data bytes
+// saved compared to ssd1306_show_buffer()
+int ssd1306_flush(SSD1306_t * dev)
+{
+	return ssd1306_flush_pages(dev, NULL, NULL);
+}
+
+// Like ssd1306_flush(), but return as soon as the transport has the frame.
+// The transport sends from its own transfer buffer, so drawing may go on at once.
+// done(arg) is called when the frame is on the panel, from the bus interrupt if the
+// transport queues its writes. A second flush waits until the first one is done.
+int ssd1306_flush_async(SSD1306_t * dev, ssd1306_done_cb_t done, void * arg)
+{
+	return ssd1306_flush_pages(dev, done, arg);
+}
+
+// Columns of a page waiting to be sent
+int ssd1306_get_dirty(SSD1306_t * dev, int page)
+{
+	if (page < 0 || page >= dev->_pages) return 0;
+	PAGE_t * _page = &ssd1306_shown_pages(dev)[page];
+	if (_page->_dirtyEnd < _page->_dirtyStart) return 0;
+	return _page->_dirtyEnd - _page->_dirtyStart + 1;
+}
+
+// Send the dirty span of one page and wait until it is out, returns the bytes sent.
+// The bus is free again on return, so a scheduler can interleave pages of several panels.
+// A frame is counted once its last dirty page is out, the frame time includes the gaps between pages.
+int ssd1306_flush_page(SSD1306_t * dev, int page)
+{
+	int width = ssd1306_get_dirty(dev, page);
+	if (width == 0) return 0;
+	if (dev->_doneArmed) ssd1306_wait_idle(dev);
+	if (dev->_sliceStart == 0) dev->_sliceStart = esp_timer_get_time();
+	PAGE_t * _page = &ssd1306_shown_pages(dev)[page];
+	ssd1306_send_image(dev, page, _page->_dirtyStart, &_page->_segs[_page->_dirtyStart], width);
+	ssd1306_clear_dirty(_page);
+	ssd1306_wait_idle(dev);
+	for (int next=0; next<dev->_pages; next++) {
+		if (ssd1306_get_dirty(dev, next) > 0) return width;
+	}
+	ssd1306_frame_done(dev, dev->_sliceStart);
+	dev->_sliceStart = 0;
+	return width;
+}
+
+void ssd1306_set_burst(SSD1306_t * dev, bool burst)
+{
+	dev->_burst = burst;
+}
+
+// Frames actually sent per second by ssd1306_show_buffer(), ssd1306_flush() and ssd1306_flush_page()
+float ssd1306_get_fps(SSD1306_t * dev)
+{
+	return dev->_fps;
+}
+
+// Duration of the last frame transfer in microseconds
+int64_t ssd1306_get_frame_time(SSD1306_t * dev)
+{
+	return dev->_frameUs;
 }
 
 int ssd1306_get_width(SSD1306_t * dev)
@@ -45,22 +337,21 @@ int ssd1306_get_pages(SSD1306_t * dev)
 
 void ssd1306_show_buffer(SSD1306_t * dev)
 {
-	if (dev->_address == SPI_ADDRESS) {
-		for (int page=0; page<dev->_pages;page++) {
-			spi_display_image(dev, page, 0, dev->_page[page]._segs, dev->_width);
-		}
-	} else {
+	if (dev->_front != NULL) {
+		// Publish the whole back buffer
 		for (int page=0; page<dev->_pages;page++) {
-			i2c_display_image(dev, page, 0, dev->_page[page]._segs, dev->_width);
+			memcpy(dev->_front[page]._segs, dev->_page[page]._segs, 128);
+			ssd1306_clear_dirty(&dev->_page[page]);
 		}
 	}
+	ssd1306_send_buffer(dev, ssd1306_shown_pages(dev), NULL, NULL);
 }
 
 void ssd1306_set_buffer(SSD1306_t * dev, const uint8_t * buffer)
 {
 	int index = 0;
 	for (int page=0; page<dev->_pages;page++) {
-		memcpy(&dev->_page[page]._segs, &buffer[index], 128);
+		ssd1306_store_image(dev, page, 0, &buffer[index], 128);
 		index = index + 128;
 	}
 }
@@ -74,9 +365,21 @@ void ssd1306_get_buffer(SSD1306_t * dev, uint8_t * buffer)
 	}
 }
 
+// Frame the panel shows or is about to show, in screen order. This is the front buffer
+// when double buffering, and the console pages are put back in the order they scroll.
+void ssd1306_get_shown_buffer(SSD1306_t * dev, uint8_t * buffer)
+{
+	PAGE_t * pages = ssd1306_shown_pages(dev);
+	for (int row=0; row<dev->_pages; row++) {
+		int page = row;
+		if (dev->_conEnable) page = (row + dev->_conTop) % dev->_pages;
+		memcpy(&buffer[row * 128], pages[page]._segs, 128);
+	}
+}
+
 void ssd1306_set_page(SSD1306_t * dev, int page, const uint8_t * buffer)
 {
-	memcpy(&dev->_page[page]._segs, buffer, 128);
+	ssd1306_store_image(dev, page, 0, buffer, 128);
 }
 
 void ssd1306_get_page(SSD1306_t * dev, int page, uint8_t * buffer)
@@ -86,30 +389,46 @@ void ssd1306_get_page(SSD1306_t * dev, int page, uint8_t * buffer)
 
 void ssd1306_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width)
 {
-	if (dev->_address == SPI_ADDRESS) {
-		spi_display_image(dev, page, seg, images, width);
-	} else {
-		i2c_display_image(dev, page, seg, images, width);
+	if (dev->_deferred) {
+		// Set to internal buffer only, ssd1306_flush() sends it
+		ssd1306_store_image(dev, page, seg, images, width);
+		return;
 	}
+	ssd1306_send_image(dev, page, seg, images, width);
 	// Set to internal buffer
 	memcpy(&dev->_page[page]._segs[seg], images, width);
+	if (dev->_front != NULL) memcpy(&dev->_front[page]._segs[seg], images, width);
+	// The panel is in sync if this write covered the whole dirty range
+	PAGE_t * _page = &dev->_page[page];
+	if (seg <= _page->_dirtyStart && seg + width - 1 >= _page->_dirtyEnd) {
+		ssd1306_clear_dirty(_page);
+	}
 }
 
-void ssd1306_display_text(SSD1306_t * dev, int page, const char * text, int text_len, bool invert)
+// Glyph in GDDRAM format, inversion is precomputed by gen_font_variants.py
+static inline const uint8_t * ssd1306_glyph(char ch, bool invert)
+{
+	return font8x8_variants[invert ? FONT8X8_INVERT : 0][(uint8_t)ch & 0x7F];
+}
+
+// Render up to 16 characters into a line buffer and return the number of segments written
+int ssd1306_render_text(SSD1306_t * dev, uint8_t * line, const char * text, int text_len, bool invert)
 {
-	if (page >= dev->_pages) return;
 	int _text_len = text_len;
 	if (_text_len > 16) _text_len = 16;
-
-	int seg = 0;
-	uint8_t image[8];
 	for (int i = 0; i < _text_len; i++) {
-		memcpy(image, font8x8_basic_tr[(uint8_t)text[i]], 8);
-		if (invert) ssd1306_invert(image, 8);
-		if (dev->_flip) ssd1306_flip(image, 8);
-		ssd1306_display_image(dev, page, seg, image, 8);
-		seg = seg + 8;
+		memcpy(&line[i * 8], ssd1306_glyph(text[i], invert), 8);
 	}
+	return _text_len * 8;
+}
+
+void ssd1306_display_text(SSD1306_t * dev, int page, const char * text, int text_len, bool invert)
+{
+	if (page >= dev->_pages) return;
+	// Whole text goes out in one write
+	uint8_t line[128];
+	int width = ssd1306_render_text(dev, line, text, text_len, invert);
+	if (width > 0) ssd1306_display_image(dev, page, 0, line, width);
 }
 
 void ssd1306_display_text_box1(SSD1306_t * dev, int page, int seg, const char * text, int box_width, int text_len, bool invert, int delay)
@@ -119,11 +438,9 @@ void ssd1306_display_text_box1(SSD1306_t * dev, int page, int seg, const char *
 	if (seg + text_box_pixel > dev->_width) return;
 
 	int _seg = seg;
-	uint8_t image[8];
+	const uint8_t * image;
 	for (int i = 0; i < box_width; i++) {
-		memcpy(image, font8x8_basic_tr[(uint8_t)text[i]], 8);
-		if (invert) ssd1306_invert(image, 8);
-		if (dev->_flip) ssd1306_flip(image, 8);
+		image = ssd1306_glyph(text[i], invert);
 		ssd1306_display_image(dev, page, _seg, image, 8);
 		_seg = _seg + 8;
 	}
@@ -131,9 +448,7 @@ void ssd1306_display_text_box1(SSD1306_t * dev, int page, int seg, const char *
 
 	// Horizontally scroll inside the box
 	for (int _text=box_width;_text<text_len;_text++) {
-		memcpy(image, font8x8_basic_tr[(uint8_t)text[_text]], 8);
-		if (invert) ssd1306_invert(image, 8);
-		if (dev->_flip) ssd1306_flip(image, 8);
+		image = ssd1306_glyph(text[_text], invert);
 		for (int _bit=0;_bit<8;_bit++) {
 			for (int _pixel=0;_pixel<text_box_pixel;_pixel++) {
 				//ESP_LOGI(__FUNCTION__, "_text=%d _bit=%d _pixel=%d", _text, _bit, _pixel);
@@ -153,14 +468,11 @@ void ssd1306_display_text_box2(SSD1306_t * dev, int page, int seg, const char *
 	if (seg + text_box_pixel > dev->_width) return;
 
 	int _seg = seg;
-	uint8_t image[8];
+	const uint8_t * image;
 
 	// Fill the text box with blanks
 	for (int i = 0; i < box_width; i++) {
-		//memcpy(image, font8x8_basic_tr[(uint8_t)text[i]], 8);
-		memcpy(image, font8x8_basic_tr[0x20], 8);
-		if (invert) ssd1306_invert(image, 8);
-		if (dev->_flip) ssd1306_flip(image, 8);
+		image = ssd1306_glyph(' ', invert);
 		ssd1306_display_image(dev, page, _seg, image, 8);
 		_seg = _seg + 8;
 	}
@@ -168,9 +480,7 @@ void ssd1306_display_text_box2(SSD1306_t * dev, int page, int seg, const char *
 
 	// Horizontally scroll inside the box
 	for (int _text=0;_text<text_len;_text++) {
-		memcpy(image, font8x8_basic_tr[(uint8_t)text[_text]], 8);
-		if (invert) ssd1306_invert(image, 8);
-		if (dev->_flip) ssd1306_flip(image, 8);
+		image = ssd1306_glyph(text[_text], invert);
 		for (int _bit=0;_bit<8;_bit++) {
 			for (int _pixel=0;_pixel<text_box_pixel;_pixel++) {
 				//ESP_LOGI(__FUNCTION__, "_text=%d _bit=%d _pixel=%d", _text, _bit, _pixel);
@@ -184,9 +494,7 @@ void ssd1306_display_text_box2(SSD1306_t * dev, int page, int seg, const char *
 
 	// Horizontally scroll inside the box
 	for (int _text=0;_text<box_width;_text++) {
-		memcpy(image, font8x8_basic_tr[0x20], 8);
-		if (invert) ssd1306_invert(image, 8);
-		if (dev->_flip) ssd1306_flip(image, 8);
+		image = ssd1306_glyph(' ', invert);
 		for (int _bit=0;_bit<8;_bit++) {
 			for (int _pixel=0;_pixel<text_box_pixel;_pixel++) {
 				//ESP_LOGI(__FUNCTION__, "_text=%d _bit=%d _pixel=%d", _text, _bit, _pixel);
@@ -199,7 +507,7 @@ void ssd1306_display_text_box2(SSD1306_t * dev, int page, int seg, const char *
 	}
 }
 
-// by Coert Vonk
+// by Coert Vonk, glyphs come from the atlas generated by gen_font_atlas.py
 void 
 ssd1306_display_text_x3(SSD1306_t * dev, int page, const char * text, int text_len, bool invert)
 {
@@ -211,43 +519,15 @@ ssd1306_display_text_x3(SSD1306_t * dev, int page, const char * text, int text_l
 
 	for (int nn = 0; nn < _text_len; nn++) {
 
-		uint8_t const * const in_columns = font8x8_basic_tr[(uint8_t)text[nn]];
-
-		// make the character 3x as high
-		out_column_t out_columns[8];
-		memset(out_columns, 0, sizeof(out_columns));
-
-		for (int xx = 0; xx < 8; xx++) { // for each column (x-direction)
+		const uint8_t * glyph = ssd1306_font_glyph(text[nn], 3);
 
-			uint32_t in_bitmask = 0b1;
-			uint32_t out_bitmask = 0b111;
-
-			for (int yy = 0; yy < 8; yy++) { // for pixel (y-direction)
-				if (in_columns[xx] & in_bitmask) {
-					out_columns[xx].u32 |= out_bitmask;
-				}
-				in_bitmask <<= 1;
-				out_bitmask <<= 3;
-			}
-		}
-
-		// render character in 8 column high pieces, making them 3x as wide
+		// render character in 8 column high pieces
 		for (int yy = 0; yy < 3; yy++)	{ // for each group of 8 pixels high (y-direction)
 
 			uint8_t image[24];
-			for (int xx = 0; xx < 8; xx++) { // for each column (x-direction)
-				image[xx*3+0] = 
-				image[xx*3+1] = 
-				image[xx*3+2] = out_columns[xx].u8[yy];
-			}
+			memcpy(image, &glyph[yy * 24], 24);
 			if (invert) ssd1306_invert(image, 24);
-			if (dev->_flip) ssd1306_flip(image, 24);
-			if (dev->_address == SPI_ADDRESS) {
-				spi_display_image(dev, page+yy, seg, image, 24);
-			} else {
-				i2c_display_image(dev, page+yy, seg, image, 24);
-			}
-			memcpy(&dev->_page[page+yy]._segs[seg], image, 24);
+			ssd1306_display_image(dev, page+yy, seg, image, 24);
 		}
 		seg = seg + 24;
 	}
@@ -271,11 +551,11 @@ void ssd1306_clear_line(SSD1306_t * dev, int page, bool invert)
 
 void ssd1306_contrast(SSD1306_t * dev, int contrast)
 {
-	if (dev->_address == SPI_ADDRESS) {
-		spi_contrast(dev, contrast);
-	} else {
-		i2c_contrast(dev, contrast);
-	}
+	if (contrast < 0) contrast = 0;
+	if (contrast > 0xFF) contrast = 0xFF;
+	dev->_contrast = contrast;
+	uint8_t commands[2] = { OLED_CMD_SET_CONTRAST, contrast }; // 81
+	dev->_ops->write_cmds(dev, commands, 2);
 }
 
 void ssd1306_software_scroll(SSD1306_t * dev, int start, int end)
@@ -300,21 +580,11 @@ void ssd1306_scroll_text(SSD1306_t * dev, const char * text, int text_len, bool
 	ESP_LOGD(__FUNCTION__, "dev->_scEnable=%d", dev->_scEnable);
 	if (dev->_scEnable == false) return;
 
-	void (*func)(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width);
-	if (dev->_address == SPI_ADDRESS) {
-		func = spi_display_image;
-	} else {
-		func = i2c_display_image;
-	}
-
 	int srcIndex = dev->_scEnd - dev->_scDirection;
 	while(1) {
 		int dstIndex = srcIndex + dev->_scDirection;
 		ESP_LOGD(__FUNCTION__, "srcIndex=%d dstIndex=%d", srcIndex,dstIndex);
-		for(int seg = 0; seg < dev->_width; seg++) {
-			dev->_page[dstIndex]._segs[seg] = dev->_page[srcIndex]._segs[seg];
-		}
-		(*func)(dev, dstIndex, 0, dev->_page[dstIndex]._segs, sizeof(dev->_page[dstIndex]._segs));
+		ssd1306_display_image(dev, dstIndex, 0, dev->_page[srcIndex]._segs, dev->_width);
 		if (srcIndex == dev->_scStart) break;
 		srcIndex = srcIndex - dev->_scDirection;
 	}
@@ -341,12 +611,175 @@ void ssd1306_scroll_clear(SSD1306_t * dev)
 }
 
 
+// Scroll the whole screen in hardware, SCROLL_STOP stops it
 void ssd1306_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll)
 {
-	if (dev->_address == SPI_ADDRESS) {
-		spi_hardware_scroll(dev, scroll);
+	uint8_t commands[10];
+	int index = 0;
+	if (scroll == SCROLL_RIGHT || scroll == SCROLL_LEFT) {
+		commands[index++] = (scroll == SCROLL_RIGHT) ? OLED_CMD_HORIZONTAL_RIGHT : OLED_CMD_HORIZONTAL_LEFT; // 26/27
+		commands[index++] = 0x00; // Dummy byte
+		commands[index++] = 0x00; // Define start page address
+		commands[index++] = 0x07; // Frame frequency
+		commands[index++] = 0x07; // Define end page address
+		commands[index++] = 0x00; //
+		commands[index++] = 0xFF; //
+		commands[index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
+	}
+	if (scroll == SCROLL_DOWN || scroll == SCROLL_UP) {
+		commands[index++] = OLED_CMD_CONTINUOUS_SCROLL; // 29
+		commands[index++] = 0x00; // Dummy byte
+		commands[index++] = 0x00; // Define start page address
+		commands[index++] = 0x07; // Frame frequency
+		commands[index++] = 0x00; // Define end page address
+		commands[index++] = (scroll == SCROLL_DOWN) ? 0x3F : 0x01; // Vertical scrolling offset
+		commands[index++] = OLED_CMD_VERTICAL; // A3
+		commands[index++] = 0x00;
+		commands[index++] = (dev->_height == 32) ? 0x20 : 0x40;
+		commands[index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
+	}
+	if (scroll == SCROLL_STOP) {
+		commands[index++] = OLED_CMD_DEACTIVE_SCROLL; // 2E
+	}
+	if (index == 0) return;
+	dev->_ops->write_cmds(dev, commands, index);
+}
+
+// Frames between two hardware scroll steps and their interval codes
+static const uint8_t ssd1306_scroll_frames[8] = { 2, 3, 4, 5, 25, 64, 128, 0 }; // 0 is 256
+static const uint8_t ssd1306_scroll_codes[8] = { 0x07, 0x04, 0x05, 0x00, 0x06, 0x01, 0x02, 0x03 };
+
+// Scroll pages start..end continuously in hardware. Once set up the panel moves the content
+// by itself, no CPU or bus time until ssd1306_hardware_scroll(dev, SCROLL_STOP).
+// SCROLL_RIGHT / SCROLL_LEFT move the pages sideways by one column per step.
+// SCROLL_UP / SCROLL_DOWN move the rows of the pages by one row per step. The SSD1306 has no
+// vertical only scroll, the same pages also move one column to the right (diagonal).
+// GRAM must not be written while scrolling and has to be rewritten after the stop.
+// Other scroll types return ESP_ERR_NOT_SUPPORTED, ssd1306_wrap_arround() scrolls any region in software.
+esp_err_t ssd1306_hardware_scroll_region(SSD1306_t * dev, ssd1306_scroll_type_t scroll, int start, int end, int frames)
+{
+	if (start < 0 || end >= dev->_pages || start > end) return ESP_ERR_INVALID_ARG;
+	int interval = 7;
+	for (int i=0; i<8; i++) {
+		if (ssd1306_scroll_frames[i] == 0 || frames <= ssd1306_scroll_frames[i]) {
+			interval = i;
+			break;
+		}
+	}
+	uint8_t commands[16];
+	int index = 0;
+	// Parameters may only change while scrolling is off
+	commands[index++] = OLED_CMD_DEACTIVE_SCROLL; // 2E
+	if (scroll == SCROLL_RIGHT || scroll == SCROLL_LEFT) {
+		commands[index++] = (scroll == SCROLL_RIGHT) ? OLED_CMD_HORIZONTAL_RIGHT : OLED_CMD_HORIZONTAL_LEFT; // 26/27
+		commands[index++] = 0x00; // Dummy byte
+		commands[index++] = start;
+		commands[index++] = ssd1306_scroll_codes[interval];
+		commands[index++] = end;
+		commands[index++] = 0x00; // Dummy byte
+		commands[index++] = 0xFF; // Dummy byte
+	} else if (scroll == SCROLL_UP || scroll == SCROLL_DOWN) {
+		commands[index++] = OLED_CMD_VERTICAL; // A3
+		commands[index++] = start * 8; // Fixed rows above the area
+		commands[index++] = (end - start + 1) * 8; // Rows in the area
+		commands[index++] = OLED_CMD_CONTINUOUS_SCROLL; // 29
+		commands[index++] = 0x00; // Dummy byte
+		commands[index++] = start;
+		commands[index++] = ssd1306_scroll_codes[interval];
+		commands[index++] = end;
+		commands[index++] = (scroll == SCROLL_UP) ? 0x01 : 0x3F; // Vertical offset per step
 	} else {
-		i2c_hardware_scroll(dev, scroll);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	commands[index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
+	ESP_LOGD(__FUNCTION__, "scroll=%d pages=%d-%d interval=0x%02x", scroll, start, end, ssd1306_scroll_codes[interval]);
+
+	ssd1306_wait_idle(dev);
+	dev->_ops->write_cmds(dev, commands, index);
+	return ESP_OK;
+}
+
+static void ssd1306_start_line(SSD1306_t * dev, int line)
+{
+	uint8_t command = OLED_CMD_SET_DISPLAY_START_LINE | (line & 0x3F); // 40-7F
+	dev->_ops->write_cmds(dev, &command, 1);
+}
+
+// Console mode treats GRAM as a ring of text lines. A new line replaces the oldest
+// one and the display start line moves by one page, so printing a line costs one
+// page write and one command, however many lines are on the screen.
+// The ring is all 64 rows of GRAM, so only 64 row panels are supported.
+esp_err_t ssd1306_console_enable(SSD1306_t * dev)
+{
+	if (dev->_pages != 8) return ESP_ERR_NOT_SUPPORTED;
+	dev->_conEnable = true;
+	dev->_conTop = 0;
+	for (int page=0; page<dev->_pages; page++) {
+		memset(dev->_page[page]._segs, 0, 128);
+	}
+	ssd1306_show_buffer(dev);
+	ssd1306_start_line(dev, 0);
+	return ESP_OK;
+}
+
+// Pages are shown in order again, the console lines stay in the buffer until they are redrawn
+void ssd1306_console_disable(SSD1306_t * dev)
+{
+	if (dev->_conEnable == false) return;
+	dev->_conEnable = false;
+	dev->_conTop = 0;
+	ssd1306_start_line(dev, 0);
+}
+
+// Add a line at the bottom of the console, the top line scrolls out
+void ssd1306_console_print(SSD1306_t * dev, const char * text, int text_len, bool invert)
+{
+	if (dev->_conEnable == false) return;
+	uint8_t line[128];
+	memset(line, invert ? 0xFF : 0x00, sizeof(line));
+	ssd1306_render_text(dev, line, text, text_len, invert);
+
+	// The oldest line is overwritten and becomes the newest, sent right away even in deferred mode
+	int page = dev->_conTop;
+	ssd1306_send_image(dev, page, 0, line, dev->_width);
+	memcpy(dev->_page[page]._segs, line, 128);
+	if (dev->_front != NULL) memcpy(dev->_front[page]._segs, line, 128);
+	ssd1306_clear_dirty(&dev->_page[page]);
+	dev->_conTop = (page + 1) % dev->_pages;
+
+	// The line has to be in GRAM before it scrolls into view
+	ssd1306_wait_idle(dev);
+	int row = dev->_conTop * 8;
+	ESP_LOGD(__FUNCTION__, "page=%d start line=%d", page, row);
+	ssd1306_start_line(dev, row);
+}
+
+// Move the columns start..end of every page one pixel up or down, the row that leaves comes back on the other side.
+// Four columns are shifted at once as the bytes of a 32 bit word, a byte holds 8 rows of one column.
+static void ssd1306_wrap_vertical(SSD1306_t * dev, int start, int end, bool up)
+{
+	int last = dev->_pages - 1;
+	uint32_t words[8];
+	int step;
+	for (int seg=start; seg<=end; seg+=step) {
+		step = (end - seg >= 3) ? 4 : 1;
+		for (int page=0; page<=last; page++) {
+			words[page] = 0;
+			memcpy(&words[page], &dev->_page[page]._segs[seg], step);
+		}
+		for (int page=0; page<=last; page++) {
+			uint32_t wk;
+			if (up) {
+				// Bit 0 (top row) of the page below becomes bit 7
+				uint32_t below = words[(page == last) ? 0 : page + 1];
+				wk = ((words[page] >> 1) & 0x7F7F7F7F) | ((below & 0x01010101) << 7);
+			} else {
+				// Bit 7 (bottom row) of the page above becomes bit 0
+				uint32_t above = words[(page == 0) ? last : page - 1];
+				wk = ((words[page] << 1) & 0xFEFEFEFE) | ((above & 0x80808080) >> 7);
+			}
+			memcpy(&dev->_page[page]._segs[seg], &wk, step);
+		}
 	}
 }
 
@@ -355,282 +788,335 @@ void ssd1306_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll)
 // delay < 0 : no display
 void ssd1306_wrap_arround(SSD1306_t * dev, ssd1306_scroll_type_t scroll, int start, int end, int8_t delay)
 {
-	if (scroll == SCROLL_RIGHT) {
-		int _start = start; // 0 to 7
-		int _end = end; // 0 to 7
-		if (_end >= dev->_pages) _end = dev->_pages - 1;
-		uint8_t wk;
-		//for (int page=0;page<dev->_pages;page++) {
-		for (int page=_start;page<=_end;page++) {
-			wk = dev->_page[page]._segs[127];
-			for (int seg=127;seg>0;seg--) {
-				dev->_page[page]._segs[seg] = dev->_page[page]._segs[seg-1];
-			}
-			dev->_page[page]._segs[0] = wk;
-		}
-
-	} else if (scroll == SCROLL_LEFT) {
+	if (scroll == SCROLL_RIGHT || scroll == SCROLL_LEFT) {
 		int _start = start; // 0 to 7
 		int _end = end; // 0 to 7
 		if (_end >= dev->_pages) _end = dev->_pages - 1;
-		uint8_t wk;
-		//for (int page=0;page<dev->_pages;page++) {
 		for (int page=_start;page<=_end;page++) {
-			wk = dev->_page[page]._segs[0];
-			for (int seg=0;seg<127;seg++) {
-				dev->_page[page]._segs[seg] = dev->_page[page]._segs[seg+1];
+			uint8_t * segs = dev->_page[page]._segs;
+			uint8_t wk;
+			if (scroll == SCROLL_RIGHT) {
+				wk = segs[127];
+				memmove(&segs[1], &segs[0], 127);
+				segs[0] = wk;
+			} else {
+				wk = segs[0];
+				memmove(&segs[0], &segs[1], 127);
+				segs[127] = wk;
 			}
-			dev->_page[page]._segs[127] = wk;
+			ssd1306_mark_dirty(dev, page, 0, dev->_width);
 		}
 
-	} else if (scroll == SCROLL_UP) {
+	} else if (scroll == SCROLL_UP || scroll == SCROLL_DOWN) {
 		int _start = start; // 0 to {width-1}
 		int _end = end; // 0 to {width-1}
 		if (_end >= dev->_width) _end = dev->_width - 1;
-		uint8_t wk0;
-		uint8_t wk1;
-		uint8_t wk2;
-		uint8_t save[128];
-		// Save pages 0
-		for (int seg=0;seg<128;seg++) {
-			save[seg] = dev->_page[0]._segs[seg];
-		}
-		// Page0 to Page6
-		for (int page=0;page<dev->_pages-1;page++) {
-			//for (int seg=0;seg<128;seg++) {
-			for (int seg=_start;seg<=_end;seg++) {
-				wk0 = dev->_page[page]._segs[seg];
-				wk1 = dev->_page[page+1]._segs[seg];
-				if (dev->_flip) wk0 = ssd1306_rotate_byte(wk0);
-				if (dev->_flip) wk1 = ssd1306_rotate_byte(wk1);
-				if (seg == 0) {
-					ESP_LOGD(__FUNCTION__, "b page=%d wk0=%02x wk1=%02x", page, wk0, wk1);
-				}
-				wk0 = wk0 >> 1;
-				wk1 = wk1 & 0x01;
-				wk1 = wk1 << 7;
-				wk2 = wk0 | wk1;
-				if (seg == 0) {
-					ESP_LOGD(__FUNCTION__, "a page=%d wk0=%02x wk1=%02x wk2=%02x", page, wk0, wk1, wk2);
-				}
-				if (dev->_flip) wk2 = ssd1306_rotate_byte(wk2);
-				dev->_page[page]._segs[seg] = wk2;
-			}
-		}
-		// Page7
-		int pages = dev->_pages-1;
-		//for (int seg=0;seg<128;seg++) {
-		for (int seg=_start;seg<=_end;seg++) {
-			wk0 = dev->_page[pages]._segs[seg];
-			wk1 = save[seg];
-			if (dev->_flip) wk0 = ssd1306_rotate_byte(wk0);
-			if (dev->_flip) wk1 = ssd1306_rotate_byte(wk1);
-			wk0 = wk0 >> 1;
-			wk1 = wk1 & 0x01;
-			wk1 = wk1 << 7;
-			wk2 = wk0 | wk1;
-			if (dev->_flip) wk2 = ssd1306_rotate_byte(wk2);
-			dev->_page[pages]._segs[seg] = wk2;
+		ssd1306_wrap_vertical(dev, _start, _end, scroll == SCROLL_UP);
+		for (int page=0;page<dev->_pages;page++) {
+			ssd1306_mark_dirty(dev, page, _start, _end - _start + 1);
 		}
 
-	} else if (scroll == SCROLL_DOWN) {
-		int _start = start; // 0 to {width-1}
-		int _end = end; // 0 to {width-1}
-		if (_end >= dev->_width) _end = dev->_width - 1;
-		uint8_t wk0;
-		uint8_t wk1;
-		uint8_t wk2;
+	} else if (scroll == PAGE_SCROLL_DOWN || scroll == PAGE_SCROLL_UP) {
+		int last = dev->_pages - 1;
 		uint8_t save[128];
-		// Save pages 7
-		int pages = dev->_pages-1;
-		for (int seg=0;seg<128;seg++) {
-			save[seg] = dev->_page[pages]._segs[seg];
-		}
-		// Page7 to Page1
-		for (int page=pages;page>0;page--) {
-			//for (int seg=0;seg<128;seg++) {
-			for (int seg=_start;seg<=_end;seg++) {
-				wk0 = dev->_page[page]._segs[seg];
-				wk1 = dev->_page[page-1]._segs[seg];
-				if (dev->_flip) wk0 = ssd1306_rotate_byte(wk0);
-				if (dev->_flip) wk1 = ssd1306_rotate_byte(wk1);
-				if (seg == 0) {
-					ESP_LOGD(__FUNCTION__, "b page=%d wk0=%02x wk1=%02x", page, wk0, wk1);
-				}
-				wk0 = wk0 << 1;
-				wk1 = wk1 & 0x80;
-				wk1 = wk1 >> 7;
-				wk2 = wk0 | wk1;
-				if (seg == 0) {
-					ESP_LOGD(__FUNCTION__, "a page=%d wk0=%02x wk1=%02x wk2=%02x", page, wk0, wk1, wk2);
-				}
-				if (dev->_flip) wk2 = ssd1306_rotate_byte(wk2);
-				dev->_page[page]._segs[seg] = wk2;
+		if (scroll == PAGE_SCROLL_DOWN) {
+			// Page7 to Page1, page 7 comes back as page 0
+			memcpy(save, dev->_page[last]._segs, 128);
+			for (int page=last;page>0;page--) {
+				memcpy(dev->_page[page]._segs, dev->_page[page-1]._segs, 128);
 			}
-		}
-		// Page0
-		//for (int seg=0;seg<128;seg++) {
-		for (int seg=_start;seg<=_end;seg++) {
-			wk0 = dev->_page[0]._segs[seg];
-			wk1 = save[seg];
-			if (dev->_flip) wk0 = ssd1306_rotate_byte(wk0);
-			if (dev->_flip) wk1 = ssd1306_rotate_byte(wk1);
-			wk0 = wk0 << 1;
-			wk1 = wk1 & 0x80;
-			wk1 = wk1 >> 7;
-			wk2 = wk0 | wk1;
-			if (dev->_flip) wk2 = ssd1306_rotate_byte(wk2);
-			dev->_page[0]._segs[seg] = wk2;
-		}
-
-	} else if (scroll == PAGE_SCROLL_DOWN) {
-		uint8_t save[128];
-		// Save pages 7
-		for (int seg=0;seg<128;seg++) {
-			save[seg] = dev->_page[dev->_pages-1]._segs[seg];
-		}
-		// Page7 to Page1
-		for (int page=dev->_pages-1;page>0;page--) {
-			for (int seg=0;seg<128;seg++) {
-				dev->_page[page]._segs[seg] = dev->_page[page-1]._segs[seg];
+			memcpy(dev->_page[0]._segs, save, 128);
+		} else {
+			// Page0 to Page6, page 0 comes back as page 7
+			memcpy(save, dev->_page[0]._segs, 128);
+			for (int page=0;page<last;page++) {
+				memcpy(dev->_page[page]._segs, dev->_page[page+1]._segs, 128);
 			}
+			memcpy(dev->_page[last]._segs, save, 128);
 		}
-		// Store  pages 0
-		for (int seg=0;seg<128;seg++) {
-			dev->_page[0]._segs[seg] = save[seg];
+		for (int page=0;page<dev->_pages;page++) {
+			ssd1306_mark_dirty(dev, page, 0, dev->_width);
 		}
+	}
 
-	} else if (scroll == PAGE_SCROLL_UP) {
-		uint8_t save[128];
-		// Save pages 0
-		for (int seg=0;seg<128;seg++) {
-			save[seg] = dev->_page[0]._segs[seg];
-		}
-		// Page0 to Page6
-		for (int page=0;page<dev->_pages-1;page++) {
-			for (int seg=0;seg<128;seg++) {
-				dev->_page[page]._segs[seg] = dev->_page[page+1]._segs[seg];
-			}
-		}
-		// Store  pages 7
-		for (int seg=0;seg<128;seg++) {
-			dev->_page[dev->_pages-1]._segs[seg] = save[seg];
-		}
+	if (delay < 0 || dev->_deferred) return;
+	if (delay == 0) {
+		// Only the changed spans, or one frame in burst mode
+		ssd1306_swap_and_flush(dev);
+		return;
+	}
+	for (int page=0;page<dev->_pages;page++) {
+		ssd1306_display_image(dev, page, 0, dev->_page[page]._segs, 128);
+		vTaskDelay(delay);
 	}
+}
 
-	if (delay >= 0) {
-		for (int page=0;page<dev->_pages;page++) {
-			if (dev->_address == SPI_ADDRESS) {
-				spi_display_image(dev, page, 0, dev->_page[page]._segs, 128);
-			} else {
-				i2c_display_image(dev, page, 0, dev->_page[page]._segs, 128);
-			}
-			if (delay) vTaskDelay(delay);
+// Merge 8 vertical pixels into the column at (xpos, ypos..ypos+7), ypos may be negative
+static inline void ssd1306_blit_column(SSD1306_t * dev, int xpos, int ypos, uint8_t bits, uint8_t mask, ssd1306_rop_t rop)
+{
+	int page = ypos >> 3;
+	int shift = ypos & 7;
+	uint16_t _bits = bits << shift;
+	uint16_t _mask = mask << shift;
+	for (int i=0; i<2; i++, page++, _bits >>= 8, _mask >>= 8) {
+		uint8_t m = _mask;
+		if (m == 0 || page < 0 || page >= dev->_pages) continue;
+		uint8_t b = _bits;
+		uint8_t * segs = &dev->_page[page]._segs[xpos];
+		uint8_t wk;
+		if (rop == SSD1306_ROP_OR) {
+			wk = *segs | (b & m);
+		} else if (rop == SSD1306_ROP_XOR) {
+			wk = *segs ^ (b & m);
+		} else {
+			wk = (*segs & ~m) | (b & m);
 		}
+		if (wk == *segs) continue;
+		*segs = wk;
+		ssd1306_extend_dirty(&dev->_page[page], xpos, xpos);
 	}
+}
 
+// Transpose 8 bitmap rows (MSB is the leftmost pixel) into 8 columns (LSB is the top pixel)
+static void ssd1306_transpose8(const uint8_t * rows, int stride, int count, uint8_t * columns)
+{
+	uint32_t lo = 0;
+	uint32_t hi = 0;
+	for (int i=0; i<count; i++) {
+		if (i < 4) {
+			lo |= (uint32_t)rows[i * stride] << (i * 8);
+		} else {
+			hi |= (uint32_t)rows[i * stride] << ((i - 4) * 8);
+		}
+	}
+	// Hacker's Delight transpose8, split in 32 bit halves
+	uint32_t t;
+	t = (lo ^ (lo >> 7)) & 0x00AA00AA; lo = lo ^ t ^ (t << 7);
+	t = (hi ^ (hi >> 7)) & 0x00AA00AA; hi = hi ^ t ^ (t << 7);
+	t = (lo ^ (lo >> 14)) & 0x0000CCCC; lo = lo ^ t ^ (t << 14);
+	t = (hi ^ (hi >> 14)) & 0x0000CCCC; hi = hi ^ t ^ (t << 14);
+	t = (lo ^ (hi << 4)) & 0xF0F0F0F0; lo = lo ^ t; hi = hi ^ (t >> 4);
+	// Byte n of the result holds the pixels of bit n, bit 7 is the leftmost column
+	for (int i=0; i<4; i++) {
+		columns[3 - i] = hi >> (i * 8);
+		columns[7 - i] = lo >> (i * 8);
+	}
 }
 
-void _ssd1306_bitmaps(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, bool invert)
+// Blit a bitmap in GDDRAM layout (one byte per column and page, LSB on top) to internal buffer
+// Pages of the source are width bytes apart. Clipped to the screen. Not show it.
+void _ssd1306_blit_columns(SSD1306_t * dev, int xpos, int ypos, const uint8_t * columns, int width, int height, ssd1306_rop_t rop, bool invert)
 {
-	if ( (width % 8) != 0) {
-		ESP_LOGE(__FUNCTION__, "width must be a multiple of 8");
-		return;
+	int first = (xpos < 0) ? -xpos : 0;
+	int last = width;
+	if (xpos + last > dev->_width) last = dev->_width - xpos;
+	for (int page=0; page*8<height; page++) {
+		int _ypos = ypos + page * 8;
+		if (_ypos <= -8 || _ypos >= dev->_pages * 8) continue;
+		uint8_t mask = (height - page * 8 >= 8) ? 0xFF : (1 << (height - page * 8)) - 1;
+		const uint8_t * src = &columns[page * width];
+		for (int col=first; col<last; col++) {
+			uint8_t bits = invert ? ~src[col] : src[col];
+			ssd1306_blit_column(dev, xpos + col, _ypos, bits, mask, rop);
+		}
 	}
-	int _width = width / 8;
-	uint8_t wk0;
-	uint8_t wk1;
-	uint8_t wk2;
-	uint8_t page = (ypos / 8);
-	uint8_t _seg = xpos;
-	uint8_t dstBits = (ypos % 8);
-	ESP_LOGD(__FUNCTION__, "_width=%d ypos=%d page=%d dstBits=%d", _width, ypos, page, dstBits);
-	int offset = 0;
-	for(int _height=0;_height<height;_height++) {
-		for (int index=0;index<_width;index++) {
-			for (int srcBits=7; srcBits>=0; srcBits--) {
-				wk0 = dev->_page[page]._segs[_seg];
-				if (dev->_flip) wk0 = ssd1306_rotate_byte(wk0);
-
-				wk1 = bitmap[index+offset];
-				if (invert) wk1 = ~wk1;
-
-				//wk2 = ssd1306_copy_bit(bitmap[index+offset], srcBits, wk0, dstBits);
-				wk2 = ssd1306_copy_bit(wk1, srcBits, wk0, dstBits);
-				if (dev->_flip) wk2 = ssd1306_rotate_byte(wk2);
-
-				ESP_LOGD(__FUNCTION__, "index=%d offset=%d wk1=0x%x page=%d _seg=%d, wk2=%02x", index, offset, wk1, page, _seg, wk2);
-				if (_seg >= 128) {
-					ESP_LOGW(__FUNCTION__, "segment is out of range");
-					break;
-				}
-				if (page >= dev->_pages) {
-					ESP_LOGW(__FUNCTION__, "page is out of range");
-					break;
-				}
-				dev->_page[page]._segs[_seg] = wk2;
-				_seg++;
+}
+
+// Blit a row major bitmap (MSB is the leftmost pixel, rows padded to whole bytes) to internal buffer
+// Any width and position, clipped to the screen. Not show it.
+void _ssd1306_blit(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, ssd1306_rop_t rop, bool invert)
+{
+	int stride = (width + 7) / 8;
+	uint8_t columns[8];
+	for (int row=0; row<height; row+=8) {
+		int _ypos = ypos + row;
+		if (_ypos <= -8 || _ypos >= dev->_pages * 8) continue;
+		int count = (height - row >= 8) ? 8 : height - row;
+		uint8_t mask = (count == 8) ? 0xFF : (1 << count) - 1;
+		for (int index=0; index<stride; index++) {
+			int _xpos = xpos + index * 8;
+			if (_xpos <= -8 || _xpos >= dev->_width) continue;
+			ssd1306_transpose8(&bitmap[row * stride + index], stride, count, columns);
+			for (int col=0; col<8; col++) {
+				if (index * 8 + col >= width) break;
+				if (_xpos + col < 0 || _xpos + col >= dev->_width) continue;
+				uint8_t bits = invert ? ~columns[col] : columns[col];
+				ssd1306_blit_column(dev, _xpos + col, _ypos, bits, mask, rop);
 			}
 		}
-		//vTaskDelay(1);
-		offset = offset + _width;
-		dstBits++;
-		_seg = xpos;
-		if (dstBits == 8) {
-			page++;
-			dstBits=0;
-		}
 	}
+}
 
-#if 0
-	for (int _seg=ypos;_seg<ypos+width;_seg++) {
-		ssd1306_dump_page(dev, page-1, _seg);
-	}
-	for (int _seg=ypos;_seg<ypos+width;_seg++) {
-		ssd1306_dump_page(dev, page, _seg);
-	}
-#endif
-	//ssd1306_show_buffer(dev);
+void _ssd1306_bitmaps(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, bool invert)
+{
+	_ssd1306_blit(dev, xpos, ypos, bitmap, width, height, SSD1306_ROP_COPY, invert);
 }
 
 
 void ssd1306_bitmaps(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, bool invert)
 {
 	_ssd1306_bitmaps(dev, xpos, ypos, bitmap, width, height, invert);
-	
-	// Calculate the range of pages and segments to update
-	int start_page = ypos / 8;
+	ssd1306_display_region(dev, xpos, ypos, width, height);
+}
+
+// Send a rectangle of the internal buffer, clipped to the screen
+void ssd1306_display_region(SSD1306_t * dev, int xpos, int ypos, int width, int height)
+{
+	// Calculate the range of pages and segments to update, clipped to the screen
+	int start_page = (ypos < 0) ? 0 : ypos / 8;
 	int end_page = (ypos + height - 1) / 8;
-	int start_seg = xpos;
+	if (end_page >= dev->_pages) end_page = dev->_pages - 1;
+	int start_seg = (xpos < 0) ? 0 : xpos;
 	int end_seg = xpos + width - 1;
+	if (end_seg >= dev->_width) end_seg = dev->_width - 1;
+	if (ypos + height <= 0 || start_seg > end_seg) return;
 
 	// Update only the modified pages and segments
 	for (int page = start_page; page <= end_page; page++) {
-		int seg_start = (page == start_page) ? start_seg : 0;
-		int seg_end = (page == end_page) ? end_seg : 127;
-		int seg_width = seg_end - seg_start + 1;
-		ssd1306_display_image(dev, page, seg_start, &dev->_page[page]._segs[seg_start], seg_width);
+		ssd1306_display_image(dev, page, start_seg, &dev->_page[page]._segs[start_seg], end_seg - start_seg + 1);
 	}
 }
 
 
-// Set pixel to internal buffer. Not show it.
+// Set pixel to internal buffer, ignored outside the screen. Not show it.
 void _ssd1306_pixel(SSD1306_t * dev, int xpos, int ypos, bool invert)
 {
-	uint8_t _page = (ypos / 8);
-	uint8_t _bits = (ypos % 8);
-	uint8_t _seg = xpos;
-	uint8_t wk0 = dev->_page[_page]._segs[_seg];
-	uint8_t wk1 = 1 << _bits;
-	ESP_LOGD(__FUNCTION__, "ypos=%d _page=%d _bits=%d wk0=0x%02x wk1=0x%02x", ypos, _page, _bits, wk0, wk1);
-	if (invert) {
-		wk0 = wk0 & ~wk1;
-	} else {
-		wk0 = wk0 | wk1;
+	if (xpos < 0 || xpos >= dev->_width || ypos < 0 || ypos >= dev->_pages * 8) return;
+	PAGE_t * page = &dev->_page[ypos >> 3];
+	uint8_t bit = 1 << (ypos & 7);
+	uint8_t wk = invert ? (page->_segs[xpos] & ~bit) : (page->_segs[xpos] | bit);
+	if (page->_segs[xpos] == wk) return;
+	page->_segs[xpos] = wk;
+	ssd1306_extend_dirty(page, xpos, xpos);
+}
+
+// Set or clear the mask bits of the columns start..end of a page, one byte per column.
+// Only the columns that actually changed are marked dirty.
+static void ssd1306_fill_span(SSD1306_t * dev, int page, int start, int end, uint8_t mask, bool invert)
+{
+	uint8_t * segs = dev->_page[page]._segs;
+	int first = -1;
+	int last = -1;
+	for (int seg=start; seg<=end; seg++) {
+		uint8_t wk = invert ? (segs[seg] & ~mask) : (segs[seg] | mask);
+		if (segs[seg] == wk) continue;
+		segs[seg] = wk;
+		if (first < 0) first = seg;
+		last = seg;
+	}
+	if (first >= 0) ssd1306_extend_dirty(&dev->_page[page], first, last);
+}
+
+// Fill a rectangle to internal buffer, clipped to the screen. Not show it.
+// Every page it covers is one masked span, whatever the height.
+void _ssd1306_fill_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, bool invert)
+{
+	int x1 = (xpos < 0) ? 0 : xpos;
+	int x2 = xpos + width - 1;
+	if (x2 >= dev->_width) x2 = dev->_width - 1;
+	int y1 = (ypos < 0) ? 0 : ypos;
+	int y2 = ypos + height - 1;
+	if (y2 >= dev->_pages * 8) y2 = dev->_pages * 8 - 1;
+	if (x1 > x2 || y1 > y2) return;
+	for (int page=y1/8; page<=y2/8; page++) {
+		uint8_t mask = 0xFF;
+		if (page == y1 / 8) mask &= 0xFF << (y1 % 8);
+		if (page == y2 / 8) mask &= 0xFF >> (7 - y2 % 8);
+		ssd1306_fill_span(dev, page, x1, x2, mask, invert);
+	}
+}
+
+// Horizontal line of width pixels starting at (xpos, ypos). Not show it.
+void _ssd1306_hline(SSD1306_t * dev, int xpos, int ypos, int width, bool invert)
+{
+	_ssd1306_fill_rect(dev, xpos, ypos, width, 1, invert);
+}
+
+// Vertical line of height pixels starting at (xpos, ypos). Not show it.
+void _ssd1306_vline(SSD1306_t * dev, int xpos, int ypos, int height, bool invert)
+{
+	_ssd1306_fill_rect(dev, xpos, ypos, 1, height, invert);
+}
+
+// Rectangle outline to internal buffer. Not show it.
+void _ssd1306_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, bool invert)
+{
+	if (width <= 0 || height <= 0) return;
+	_ssd1306_hline(dev, xpos, ypos, width, invert);
+	_ssd1306_hline(dev, xpos, ypos + height - 1, width, invert);
+	_ssd1306_vline(dev, xpos, ypos + 1, height - 2, invert);
+	_ssd1306_vline(dev, xpos + width - 1, ypos + 1, height - 2, invert);
+}
+
+// Half height of a circle of radius r at dx columns from its center.
+// Called with dx counting up, so the previous result is a start value that only shrinks.
+static int ssd1306_circle_span(int r, int dx, int dy)
+{
+	while (dy > 0 && dx * dx + dy * dy > r * r + r) dy--;
+	return dy;
+}
+
+// Filled circle to internal buffer, one vertical span per column. Not show it.
+void _ssd1306_fill_circle(SSD1306_t * dev, int x0, int y0, int r, bool invert)
+{
+	if (r < 0) return;
+	int dy = r;
+	for (int dx=0; dx<=r; dx++) {
+		dy = ssd1306_circle_span(r, dx, dy);
+		_ssd1306_vline(dev, x0 - dx, y0 - dy, 2 * dy + 1, invert);
+		if (dx > 0) _ssd1306_vline(dev, x0 + dx, y0 - dy, 2 * dy + 1, invert);
+	}
+}
+
+static int ssd1306_round_radius(int width, int height, int r)
+{
+	if (r > width / 2) r = width / 2;
+	if (r > height / 2) r = height / 2;
+	return (r < 0) ? 0 : r;
+}
+
+// Filled rectangle with rounded corners of radius r. Not show it.
+void _ssd1306_fill_round_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, int r, bool invert)
+{
+	if (width <= 0 || height <= 0) return;
+	r = ssd1306_round_radius(width, height, r);
+	_ssd1306_fill_rect(dev, xpos + r, ypos, width - 2 * r, height, invert);
+	// Corner columns, r - dy rows are cut off at the top and the bottom
+	int dy = r;
+	for (int dx=1; dx<=r; dx++) {
+		dy = ssd1306_circle_span(r, dx, dy);
+		int cut = r - dy;
+		_ssd1306_vline(dev, xpos + r - dx, ypos + cut, height - 2 * cut, invert);
+		_ssd1306_vline(dev, xpos + width - 1 - r + dx, ypos + cut, height - 2 * cut, invert);
+	}
+}
+
+// Rectangle outline with rounded corners of radius r. Not show it.
+void _ssd1306_round_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, int r, bool invert)
+{
+	if (width <= 0 || height <= 0) return;
+	r = ssd1306_round_radius(width, height, r);
+	int x1 = xpos + r;
+	int x2 = xpos + width - 1 - r;
+	int y1 = ypos + r;
+	int y2 = ypos + height - 1 - r;
+	_ssd1306_hline(dev, x1, ypos, x2 - x1 + 1, invert);
+	_ssd1306_hline(dev, x1, ypos + height - 1, x2 - x1 + 1, invert);
+	_ssd1306_vline(dev, xpos, y1, y2 - y1 + 1, invert);
+	_ssd1306_vline(dev, xpos + width - 1, y1, y2 - y1 + 1, invert);
+	// Corner arcs, one quadrant of the _ssd1306_circle() walk each
+	int x = 0;
+	int y = -r;
+	int err = 2 - 2 * r;
+	int old_err;
+	while (y < 0) {
+		_ssd1306_pixel(dev, x1 - x, y1 + y, invert);
+		_ssd1306_pixel(dev, x2 + x, y1 + y, invert);
+		_ssd1306_pixel(dev, x1 - x, y2 - y, invert);
+		_ssd1306_pixel(dev, x2 + x, y2 - y, invert);
+		if ((old_err = err) <= x) err += ++x * 2 + 1;
+		if (old_err > y || err > x) err += ++y * 2 + 1;
 	}
-	if (dev->_flip) wk0 = ssd1306_rotate_byte(wk0);
-	ESP_LOGD(__FUNCTION__, "wk0=0x%02x wk1=0x%02x", wk0, wk1);
-	dev->_page[_page]._segs[_seg] = wk0;
 }
 
 // Set line to internal buffer. Not show it.
@@ -641,6 +1127,16 @@ void _ssd1306_line(SSD1306_t * dev, int x1, int y1, int x2, int y2,  bool invert
 	int sx,sy;
 	int E;
 
+	/* straight lines are spans */
+	if ( y1 == y2 ) {
+		_ssd1306_hline(dev, (x1 < x2) ? x1 : x2, y1, abs(x2 - x1) + 1, invert);
+		return;
+	}
+	if ( x1 == x2 ) {
+		_ssd1306_vline(dev, x1, (y1 < y2) ? y1 : y2, abs(y2 - y1) + 1, invert);
+		return;
+	}
+
 	/* distance between two points */
 	dx = ( x2 > x1 ) ? x2 - x1 : x1 - x2;
 	dy = ( y2 > y1 ) ? y2 - y1 : y1 - y2;
@@ -701,8 +1197,8 @@ void _ssd1306_circle(SSD1306_t * dev, int x0, int y0, int r, bool invert)
 // Draw cursor
 void _ssd1306_cursor(SSD1306_t * dev, int x0, int y0, int r, bool invert)
 {
-	_ssd1306_line(dev, x0-r, y0, x0+r, y0, invert);
-	_ssd1306_line(dev, x0, y0-r, x0, y0+r, invert);
+	_ssd1306_hline(dev, x0-r, y0, 2*r+1, invert);
+	_ssd1306_vline(dev, x0, y0-r, 2*r+1, invert);
 }
 
 void ssd1306_invert(uint8_t *buf, size_t blen)
@@ -746,39 +1242,138 @@ uint8_t ssd1306_copy_bit(uint8_t src, int srcBits, uint8_t dst, int dstBits)
 // Rotate 8-bit data
 // 0x12-->0x48
 uint8_t ssd1306_rotate_byte(uint8_t ch1) {
-	uint8_t ch2 = 0;
-	for (int j=0;j<8;j++) {
-		ch2 = (ch2 << 1) + (ch1 & 0x01);
-		ch1 = ch1 >> 1;
-	}
-	return ch2;
+	return ssd1306_rev8[ch1];
 }
 
 
+// Display off keeps GRAM, the panel draws almost no current
+void ssd1306_display_power(SSD1306_t * dev, bool on)
+{
+	uint8_t command = on ? OLED_CMD_DISPLAY_ON : OLED_CMD_DISPLAY_OFF;
+	dev->_ops->write_cmds(dev, &command, 1);
+}
+
+// Clear a pixel row and the rows above it on the same page, then send the whole page.
+// Rows count from the top of the screen, the console may show the pages in another order.
+static void ssd1306_wipe_row(SSD1306_t * dev, int row)
+{
+	int page = row / 8;
+	if (dev->_conEnable) page = (page + dev->_conTop) % dev->_pages;
+	uint8_t keep = 0xFF << (row % 8 + 1);
+	// Wipe what is on the screen, the back buffer may already hold the next frame
+	PAGE_t * shown = (dev->_front != NULL) ? &dev->_front[page] : &dev->_page[page];
+	for (int seg=0; seg<dev->_width; seg++) {
+		shown->_segs[seg] &= keep;
+	}
+	ssd1306_send_image(dev, page, 0, shown->_segs, dev->_width);
+	if (shown != &dev->_page[page]) memcpy(dev->_page[page]._segs, shown->_segs, 128);
+	ssd1306_clear_dirty(&dev->_page[page]);
+}
+
+// Clear the screen row by row, top to bottom. Blocks for pages * 8 page writes.
 void ssd1306_fadeout(SSD1306_t * dev)
 {
-	void (*func)(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width);
-	if (dev->_address == SPI_ADDRESS) {
-		func = spi_display_image;
+	for (int row=0; row<dev->_pages*8; row++) {
+		ssd1306_wipe_row(dev, row);
+	}
+	ssd1306_wait_idle(dev);
+}
+
+static void ssd1306_fade_step(SSD1306_t * dev)
+{
+	if (!dev->_fadeBusy) return; // A tick left over from the previous transition
+	dev->_fadeStep++;
+	if (dev->_fadeType == SSD1306_FADE_CONTRAST) {
+		int contrast = dev->_fadeFrom + (dev->_fadeTo - dev->_fadeFrom) * dev->_fadeStep / dev->_fadeSteps;
+		if (contrast != dev->_contrast) ssd1306_contrast(dev, contrast);
 	} else {
-		func = i2c_display_image;
+		ssd1306_wipe_row(dev, dev->_fadeStep - 1);
 	}
+	if (dev->_fadeStep < dev->_fadeSteps) return;
+	esp_timer_stop(dev->_fadeTimer);
+	ssd1306_wait_idle(dev);
+	ESP_LOGD(__FUNCTION__, "type=%d done after %d steps", dev->_fadeType, dev->_fadeSteps);
+	dev->_fadeBusy = false;
+	if (dev->_fadeDone != NULL) dev->_fadeDone(dev->_fadeArg);
+}
 
-	uint8_t image[1];
-	for(int page=0; page<dev->_pages; page++) {
-		image[0] = 0xFF;
-		for(int line=0; line<8; line++) {
-			if (dev->_flip) {
-				image[0] = image[0] >> 1;
-			} else {
-				image[0] = image[0] << 1;
-			}
-			for(int seg=0; seg<128; seg++) {
-				(*func)(dev, page, seg, image, 1);
-				dev->_page[page]._segs[seg] = image[0];
-			}
+// Bus writes block, so they run here and not in the esp_timer task shared with other timers.
+// Every tick is one step, steps delayed by a slow bus are caught up.
+static void ssd1306_fade_task(void * arg)
+{
+	SSD1306_t * dev = arg;
+	for (;;) {
+		ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+		ssd1306_fade_step(dev);
+	}
+}
+
+static void ssd1306_fade_tick(void * arg)
+{
+	SSD1306_t * dev = arg;
+	xTaskNotifyGive(dev->_fadeTask);
+}
+
+// Run a transition in the background, done(arg) is called from the fade task at the end.
+// The esp_timer callback only wakes the fade task, the bus writes are made there.
+// A contrast ramp sends one 2 byte command per step, at most one step per contrast level
+// and every SSD1306_FADE_PERIOD_MS. A wipe sends a whole page per pixel row: 64 page writes
+// of 128 bytes plus addressing on a 128x64 panel, about 8.6 kB on I2C. The caller must keep
+// other bus traffic away until done() is called.
+esp_err_t ssd1306_fade_start(SSD1306_t * dev, ssd1306_fade_type_t type, int contrast, int duration_ms, ssd1306_fade_done_t done, void * arg)
+{
+	if (dev->_fadeBusy) return ESP_ERR_INVALID_STATE;
+	if (type != SSD1306_FADE_CONTRAST && type != SSD1306_FADE_WIPE) return ESP_ERR_INVALID_ARG;
+	if (dev->_fadeTask == NULL) {
+		if (xTaskCreate(ssd1306_fade_task, "ssd1306_fade", SSD1306_FADE_TASK_STACK, dev, SSD1306_FADE_TASK_PRIORITY, &dev->_fadeTask) != pdPASS) {
+			dev->_fadeTask = NULL;
+			return ESP_ERR_NO_MEM;
 		}
 	}
+	if (dev->_fadeTimer == NULL) {
+		esp_timer_create_args_t timer_args = {
+			.callback = ssd1306_fade_tick,
+			.arg = dev,
+			.dispatch_method = ESP_TIMER_TASK,
+			.name = "ssd1306_fade",
+		};
+		esp_err_t err = esp_timer_create(&timer_args, &dev->_fadeTimer);
+		if (err != ESP_OK) return err;
+	}
+	if (contrast < 0) contrast = 0;
+	if (contrast > 0xFF) contrast = 0xFF;
+	if (duration_ms < 0) duration_ms = 0;
+
+	int steps;
+	if (type == SSD1306_FADE_CONTRAST) {
+		steps = duration_ms / SSD1306_FADE_PERIOD_MS;
+		int levels = abs(contrast - dev->_contrast);
+		if (steps > levels) steps = levels;
+		if (steps < 1) steps = 1;
+	} else {
+		steps = dev->_pages * 8;
+	}
+	int64_t period_us = (int64_t)duration_ms * 1000 / steps;
+	if (period_us < 1000) period_us = 1000;
+
+	dev->_fadeType = type;
+	dev->_fadeFrom = dev->_contrast;
+	dev->_fadeTo = contrast;
+	dev->_fadeStep = 0;
+	dev->_fadeSteps = steps;
+	dev->_fadeDone = done;
+	dev->_fadeArg = arg;
+	ulTaskNotifyValueClear(dev->_fadeTask, UINT32_MAX); // Ticks left over from the previous transition
+	dev->_fadeBusy = true;
+	ESP_LOGD(__FUNCTION__, "type=%d contrast=%d->%d steps=%d period=%lldus", type, dev->_fadeFrom, contrast, steps, period_us);
+	esp_err_t err = esp_timer_start_periodic(dev->_fadeTimer, period_us);
+	if (err != ESP_OK) dev->_fadeBusy = false;
+	return err;
+}
+
+bool ssd1306_fade_busy(SSD1306_t * dev)
+{
+	return dev->_fadeBusy;
 }
 
 // Rotate character image
@@ -818,7 +1413,8 @@ void ssd1306_display_rotate_text(SSD1306_t * dev, int seg, const char * text, in
 	int _page = dev->_pages-1;
 	for (uint8_t i = 0; i < _text_len; i++) {
 		memcpy(image, font8x8_basic_tr[(uint8_t)text[i]], 8);
-		ssd1306_rotate_image(image, dev->_flip);
+		// The panel flips, the buffer is always upright
+		ssd1306_rotate_image(image, false);
 		ESP_LOGD(__FUNCTION__, "_page=%d seg=%d", _page, seg);
 		if (invert) ssd1306_invert(image, 8);
 		ssd1306_display_image(dev, _page, seg, image, 8);
@@ -1,11 +1,31 @@
 #ifndef MAIN_SSD1306_H_
 #define MAIN_SSD1306_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_idf_version.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+// Host build, the mock transport in ssd1306_mock.c stands in for the bus drivers
+typedef int i2c_port_t;
+typedef struct spi_device_t * spi_device_handle_t;
+typedef struct spi_transaction_t spi_transaction_t;
+#define SSD1306_I2C_MASTER 0
+#else
 #include "driver/spi_master.h"
 #if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0))
 #include "driver/i2c_master.h"
+#define SSD1306_I2C_MASTER 1
 #else
 #include "driver/i2c.h"
+#define SSD1306_I2C_MASTER 0
+#endif
 #endif
 
 // Following definitions are bollowed from 
@@ -53,6 +73,7 @@ Usage:
 #define OLED_CMD_SET_SEGMENT_REMAP_1    0xA1    
 #define OLED_CMD_SET_MUX_RATIO          0xA8    // follow with 0x3F = 64 MUX
 #define OLED_CMD_SET_COM_SCAN_MODE      0xC8    
+#define OLED_CMD_SET_COM_SCAN_NORMAL    0xC0    // scan from COM0, upside down when flipped
 #define OLED_CMD_SET_DISPLAY_OFFSET     0xD3    // follow with 0x00
 #define OLED_CMD_SET_COM_PIN_MAP        0xDA    // follow with 0x12
 #define OLED_CMD_NOP                    0xE3    // NOP
@@ -76,6 +97,12 @@ Usage:
 #define I2C_ADDRESS 0x3C
 #define SPI_ADDRESS 0xFF
 
+// Shortest step of a contrast ramp
+#define SSD1306_FADE_PERIOD_MS 20
+// Task that sends the transition steps, the esp_timer only wakes it
+#define SSD1306_FADE_TASK_PRIORITY 3
+#define SSD1306_FADE_TASK_STACK 3072
+
 typedef enum {
 	SCROLL_RIGHT = 1,
 	SCROLL_LEFT = 2,
@@ -86,13 +113,38 @@ typedef enum {
 	SCROLL_STOP = 7
 } ssd1306_scroll_type_t;
 
+// Raster operations of the blit functions
+typedef enum {
+	SSD1306_ROP_COPY = 0, // Replace the destination pixels
+	SSD1306_ROP_OR = 1, // Set pixels that are set in the source
+	SSD1306_ROP_XOR = 2 // Toggle pixels that are set in the source
+} ssd1306_rop_t;
+
+// Transitions run by ssd1306_fade_start()
+typedef enum {
+	SSD1306_FADE_CONTRAST = 0, // Ramp the contrast to a target, the buffer is not touched
+	SSD1306_FADE_WIPE = 1 // Clear the screen one pixel row at a time, top to bottom
+} ssd1306_fade_type_t;
+
+// Called from the fade task when a transition has finished
+typedef void (*ssd1306_fade_done_t)(void * arg);
+
+// Called when an asynchronous flush is on the panel, possibly from an interrupt.
+// Returns true if it woke a task of higher priority (FreeRTOS FromISR convention).
+typedef bool (*ssd1306_done_cb_t)(void * arg);
+
 typedef struct {
 	bool _valid; // Not using it anymore
 	int _segLen; // Not using it anymore
 	uint8_t _segs[128];
+	int _dirtyStart; // First segment changed since the last flush
+	int _dirtyEnd; // Last segment changed since the last flush, clean if _dirtyEnd < _dirtyStart
 } PAGE_t;
 
+typedef struct ssd1306_transport_t ssd1306_transport_t;
+
 typedef struct {
+	const ssd1306_transport_t * _ops; // Bus operations, set when the panel is added to a bus
 	int _address;
 	int _width;
 	int _height;
@@ -102,16 +154,72 @@ typedef struct {
 	int _scStart;
 	int _scEnd;
 	int _scDirection;
+	bool _conEnable; // Console mode, GRAM is a ring of lines scrolled with the display start line
+	int _conTop; // Page shown on the top line of the console, the next one to be overwritten
 	PAGE_t _page[8];
 	bool _flip;
+	int _contrast; // Contrast last sent to the panel
+	esp_timer_handle_t _fadeTimer; // Paces the running transition, created by the first one
+	TaskHandle_t _fadeTask; // Sends the steps on the bus, created by the first transition
+	volatile bool _fadeBusy;
+	int _fadeType;
+	int _fadeFrom;
+	int _fadeTo;
+	int _fadeStep;
+	int _fadeSteps;
+	ssd1306_fade_done_t _fadeDone;
+	void * _fadeArg;
+	bool _deferred; // Draw into internal buffer only, send with ssd1306_flush()
+	PAGE_t * _front; // Published frame streamed to the panel, NULL unless a back buffer is enabled
+	bool _burst; // Send full frames in one transfer using horizontal addressing
+	bool _batch; // Page writes of a frame are under way, the transport may hold them back until wait()
+	int _addrMode; // Memory addressing mode the panel is currently in
+	int64_t _frameUs; // Duration of the last frame transfer
+	int64_t _frameStart; // Start of the frame an asynchronous flush is waiting for
+	ssd1306_done_cb_t _doneCb; // Callback of that flush
+	void * _doneArg;
+	volatile bool _doneArmed; // The transport calls _doneCb when its queue drains
+	int64_t _sliceStart; // First page write of the frame ssd1306_flush_page() is sending, 0 when in sync
+	int64_t _fpsStart;
+	int _fpsFrames;
+	float _fps;
 	i2c_port_t _i2c_num;
+	int _i2c_clk_hz;
 	spi_device_handle_t _spi_device_handle;
-#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0))
+	uint8_t * _xfer_buf; // Preallocated DMA capable transfer buffer, owned by the transport
+	int _xfer_used; // Bytes of _xfer_buf held by queued transactions
+	spi_transaction_t * _spi_trans; // SPI transaction slots, in use while queued
+	int _spi_queued;
+#if CONFIG_IDF_TARGET_LINUX
+	struct ssd1306_mock_t * _mock; // Emulated panel and bus counters of the mock transport
+#endif
+#if SSD1306_I2C_MASTER
 	i2c_master_bus_handle_t _i2c_bus_handle;
 	i2c_master_dev_handle_t _i2c_dev_handle;
+	bool _i2c_async; // Transmits are queued and return right away
+	volatile int _xfer_queued; // Queued I2C transactions not done yet
+	volatile bool _xfer_error; // A queued transaction failed, logged by the next wait
+#elif !CONFIG_IDF_TARGET_LINUX
+	uint8_t * _link_buf; // Storage of the legacy I2C command link, its data is in _xfer_buf
+	i2c_cmd_handle_t _link_cmd; // Open command link, NULL if nothing is pending
+	int _link_trans; // Transactions in the open link
 #endif
 } SSD1306_t;
 
+// Bus operations of a transport. Every interface (new and legacy I2C, SPI, the
+// linux mock) provides one table, the drawing code never checks which one it uses.
+// Writes may be queued, wait() returns once everything written so far is sent.
+// While _batch is set, write_region() may even be held back and combined until wait().
+struct ssd1306_transport_t {
+	void (*init)(SSD1306_t * dev, int width, int height);
+	void (*write_cmds)(SSD1306_t * dev, const uint8_t * commands, int len); // Command bytes, sent as one transfer
+	void (*write_data)(SSD1306_t * dev, const uint8_t * data, int len); // GDDRAM bytes from the current address
+	void (*write_region)(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width); // Columns of one page
+	void (*flush)(SSD1306_t * dev, const PAGE_t * pages); // A whole frame, in one transfer if the interface can
+	void (*wait)(SSD1306_t * dev);
+	void (*notify)(SSD1306_t * dev); // Call _doneCb once queued writes are done, NULL if the transport can not tell
+};
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -122,11 +230,26 @@ int ssd1306_get_width(SSD1306_t * dev);
 int ssd1306_get_height(SSD1306_t * dev);
 int ssd1306_get_pages(SSD1306_t * dev);
 void ssd1306_show_buffer(SSD1306_t * dev);
+void ssd1306_set_deferred(SSD1306_t * dev, bool deferred);
+void ssd1306_mark_dirty(SSD1306_t * dev, int page, int seg, int width);
+int ssd1306_flush(SSD1306_t * dev);
+int ssd1306_flush_async(SSD1306_t * dev, ssd1306_done_cb_t done, void * arg);
+int ssd1306_get_dirty(SSD1306_t * dev, int page);
+int ssd1306_flush_page(SSD1306_t * dev, int page);
+esp_err_t ssd1306_enable_back_buffer(SSD1306_t * dev);
+void ssd1306_disable_back_buffer(SSD1306_t * dev);
+void ssd1306_swap_buffers(SSD1306_t * dev);
+int ssd1306_swap_and_flush(SSD1306_t * dev);
+void ssd1306_set_burst(SSD1306_t * dev, bool burst);
+float ssd1306_get_fps(SSD1306_t * dev);
+int64_t ssd1306_get_frame_time(SSD1306_t * dev);
 void ssd1306_set_buffer(SSD1306_t * dev, const uint8_t * buffer);
 void ssd1306_get_buffer(SSD1306_t * dev, uint8_t * buffer);
+void ssd1306_get_shown_buffer(SSD1306_t * dev, uint8_t * buffer);
 void ssd1306_set_page(SSD1306_t * dev, int page, const uint8_t * buffer);
 void ssd1306_get_page(SSD1306_t * dev, int page, uint8_t * buffer);
 void ssd1306_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width);
+int ssd1306_render_text(SSD1306_t * dev, uint8_t * line, const char * text, int text_len, bool invert);
 void ssd1306_display_text(SSD1306_t * dev, int page, const char * text, int text_len, bool invert);
 void ssd1306_display_text_box1(SSD1306_t * dev, int page, int seg, const char * text, int box_width, int text_len, bool invert, int delay);
 void ssd1306_display_text_box2(SSD1306_t * dev, int page, int seg, const char * text, int box_width, int text_len, bool invert, int delay);
@@ -134,17 +257,34 @@ void ssd1306_display_text_x3(SSD1306_t * dev, int page, const char * text, int t
 void ssd1306_clear_screen(SSD1306_t * dev, bool invert);
 void ssd1306_clear_line(SSD1306_t * dev, int page, bool invert);
 void ssd1306_contrast(SSD1306_t * dev, int contrast);
+void ssd1306_display_power(SSD1306_t * dev, bool on);
+esp_err_t ssd1306_fade_start(SSD1306_t * dev, ssd1306_fade_type_t type, int contrast, int duration_ms, ssd1306_fade_done_t done, void * arg);
+bool ssd1306_fade_busy(SSD1306_t * dev);
 void ssd1306_software_scroll(SSD1306_t * dev, int start, int end);
 void ssd1306_scroll_text(SSD1306_t * dev, const char * text, int text_len, bool invert);
 void ssd1306_scroll_clear(SSD1306_t * dev);
 void ssd1306_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll);
+esp_err_t ssd1306_hardware_scroll_region(SSD1306_t * dev, ssd1306_scroll_type_t scroll, int start, int end, int frames);
+esp_err_t ssd1306_console_enable(SSD1306_t * dev);
+void ssd1306_console_disable(SSD1306_t * dev);
+void ssd1306_console_print(SSD1306_t * dev, const char * text, int text_len, bool invert);
 void ssd1306_wrap_arround(SSD1306_t * dev, ssd1306_scroll_type_t scroll, int start, int end, int8_t delay);
+void _ssd1306_blit(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, ssd1306_rop_t rop, bool invert);
+void _ssd1306_blit_columns(SSD1306_t * dev, int xpos, int ypos, const uint8_t * columns, int width, int height, ssd1306_rop_t rop, bool invert);
 void _ssd1306_bitmaps(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, bool invert);
 void ssd1306_bitmaps(SSD1306_t * dev, int xpos, int ypos, const uint8_t * bitmap, int width, int height, bool invert);
+void ssd1306_display_region(SSD1306_t * dev, int xpos, int ypos, int width, int height);
 void _ssd1306_pixel(SSD1306_t * dev, int xpos, int ypos, bool invert);
 void _ssd1306_line(SSD1306_t * dev, int x1, int y1, int x2, int y2,  bool invert);
 void _ssd1306_circle(SSD1306_t * dev, int x0, int y0, int r, bool invert);
 void _ssd1306_cursor(SSD1306_t * dev, int x0, int y0, int r, bool invert);
+void _ssd1306_hline(SSD1306_t * dev, int xpos, int ypos, int width, bool invert);
+void _ssd1306_vline(SSD1306_t * dev, int xpos, int ypos, int height, bool invert);
+void _ssd1306_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, bool invert);
+void _ssd1306_fill_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, bool invert);
+void _ssd1306_fill_circle(SSD1306_t * dev, int x0, int y0, int r, bool invert);
+void _ssd1306_round_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, int r, bool invert);
+void _ssd1306_fill_round_rect(SSD1306_t * dev, int xpos, int ypos, int width, int height, int r, bool invert);
 void ssd1306_invert(uint8_t *buf, size_t blen);
 void ssd1306_flip(uint8_t *buf, size_t blen);
 uint8_t ssd1306_copy_bit(uint8_t src, int srcBits, uint8_t dst, int dstBits);
@@ -159,8 +299,9 @@ void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset);
 void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t i2c_address);
 void i2c_init(SSD1306_t * dev, int width, int height);
 void i2c_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width);
-void i2c_contrast(SSD1306_t * dev, int contrast);
-void i2c_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll);
+void i2c_display_frame(SSD1306_t * dev, const PAGE_t * pages);
+void i2c_write_commands(SSD1306_t * dev, const uint8_t * commands, int len);
+void i2c_write_data(SSD1306_t * dev, const uint8_t * data, int len);
 
 void spi_clock_speed(int speed);
 void spi_master_init(SSD1306_t * dev, int16_t mosi, int16_t sclk, int16_t cs, int16_t dc, int16_t reset);
@@ -171,8 +312,26 @@ bool spi_master_write_command(SSD1306_t * dev, uint8_t Command );
 bool spi_master_write_data(SSD1306_t * dev, const uint8_t* Data, size_t DataLength );
 void spi_init(SSD1306_t * dev, int width, int height);
 void spi_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width);
-void spi_contrast(SSD1306_t * dev, int contrast);
-void spi_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll);
+void spi_display_frame(SSD1306_t * dev, const PAGE_t * pages);
+void spi_wait_idle(SSD1306_t * dev);
+
+#if CONFIG_IDF_TARGET_LINUX
+// Bus traffic seen by the mock transport
+typedef struct {
+	uint32_t transactions;
+	uint32_t bytes; // Everything on the bus except the I2C address, control bytes included
+	uint32_t cmd_bytes; // Command bytes and their arguments
+	uint32_t data_bytes; // GDDRAM bytes
+} ssd1306_bus_stats_t;
+
+void ssd1306_mock_delete(SSD1306_t * dev);
+void ssd1306_mock_reset_stats(SSD1306_t * dev);
+void ssd1306_mock_get_stats(SSD1306_t * dev, ssd1306_bus_stats_t * stats);
+bool ssd1306_mock_get_pixel(SSD1306_t * dev, int xpos, int ypos);
+const uint8_t * ssd1306_mock_get_gram(SSD1306_t * dev, int page);
+int ssd1306_mock_get_contrast(SSD1306_t * dev);
+esp_err_t ssd1306_mock_dump_pbm(SSD1306_t * dev, const char * path);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "ssd1306_font.h"
+#include "font8x8_atlas.h"
+
+// Glyph tables by scale, every glyph of a table has the same size
+static const uint8_t * const font_atlas[SSD1306_FONT_SCALE_MAX + 1] = {
+	NULL,
+	&font8x8_x1[0][0],
+	&font8x8_x2[0][0],
+	&font8x8_x3[0][0],
+	&font8x8_x4[0][0],
+};
+
+// Blank columns between proportional glyphs
+static const uint8_t font_spacing[SSD1306_FONT_SCALE_MAX] = { 0 };
+
+static inline int font_scale(int scale)
+{
+	if (scale < 1) return 1;
+	if (scale > SSD1306_FONT_SCALE_MAX) return SSD1306_FONT_SCALE_MAX;
+	return scale;
+}
+
+// Glyph in GDDRAM layout, scale pages of 8 * scale columns, not flipped or inverted
+const uint8_t * ssd1306_font_glyph(char ch, int scale)
+{
+	int _scale = font_scale(scale);
+	return font_atlas[_scale] + ((uint8_t)ch & 0x7F) * 8 * _scale * _scale;
+}
+
+// Pixel width of text, including the spacing after the last proportional glyph
+int ssd1306_font_text_width(const char * text, int text_len, int scale, bool proportional)
+{
+	int _scale = font_scale(scale);
+	if (!proportional) return text_len * 8 * _scale;
+	int width = 0;
+	for (int i = 0; i < text_len; i++) {
+		width = width + (font8x8_prop[(uint8_t)text[i] & 0x7F][1] + 1) * _scale;
+	}
+	return width;
+}
+
+// Draw text to internal buffer with its top left corner at (xpos, ypos). Not show it.
+// Returns the width drawn, so the next text can continue at xpos plus the result.
+int _ssd1306_font_text(SSD1306_t * dev, int xpos, int ypos, const char * text, int text_len, int scale, bool proportional, bool invert)
+{
+	int _scale = font_scale(scale);
+	int glyph_width = 8 * _scale;
+	int _xpos = xpos;
+	for (int i = 0; i < text_len; i++) {
+		if (_xpos >= dev->_width) break;
+		uint8_t code = (uint8_t)text[i] & 0x7F;
+		const uint8_t * glyph = font_atlas[_scale] + code * glyph_width * _scale;
+		if (!proportional) {
+			_ssd1306_blit_columns(dev, _xpos, ypos, glyph, glyph_width, glyph_width, SSD1306_ROP_COPY, invert);
+			_xpos = _xpos + glyph_width;
+			continue;
+		}
+		int first = font8x8_prop[code][0] * _scale;
+		int width = font8x8_prop[code][1] * _scale;
+		// Pages of the trimmed glyph are not contiguous, blit them one by one
+		for (int page = 0; page < _scale; page++) {
+			_ssd1306_blit_columns(dev, _xpos, ypos + page * 8, &glyph[page * glyph_width + first], width, 8, SSD1306_ROP_COPY, invert);
+			_ssd1306_blit_columns(dev, _xpos + width, ypos + page * 8, font_spacing, _scale, 8, SSD1306_ROP_COPY, invert);
+		}
+		_xpos = _xpos + width + _scale;
+	}
+	ESP_LOGD(__FUNCTION__, "xpos=%d ypos=%d scale=%d width=%d", xpos, ypos, _scale, _xpos - xpos);
+	return _xpos - xpos;
+}
+
+// Draw text and send the area it covers
+int ssd1306_font_text(SSD1306_t * dev, int xpos, int ypos, const char * text, int text_len, int scale, bool proportional, bool invert)
+{
+	int width = _ssd1306_font_text(dev, xpos, ypos, text, text_len, scale, proportional, invert);
+	ssd1306_display_region(dev, xpos, ypos, width, 8 * font_scale(scale));
+	return width;
+}
@@ -0,0 +1,28 @@
+#ifndef MAIN_SSD1306_FONT_H_
+#define MAIN_SSD1306_FONT_H_
+
+#include "ssd1306.h"
+
+// Scaled text from the glyph atlases generated by gen_font_atlas.py.
+// Text is drawn at any pixel position through the blit engine, so it does not
+// have to be aligned to a page. Scale 1 is the 8x8 font, 2 to 4 are stretched.
+// Proportional text trims the empty columns of every glyph and adds one blank
+// column (scaled) between glyphs.
+
+#define SSD1306_FONT_SCALE_MAX 4
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+const uint8_t * ssd1306_font_glyph(char ch, int scale);
+int ssd1306_font_text_width(const char * text, int text_len, int scale, bool proportional);
+int _ssd1306_font_text(SSD1306_t * dev, int xpos, int ypos, const char * text, int text_len, int scale, bool proportional, bool invert);
+int ssd1306_font_text(SSD1306_t * dev, int xpos, int ypos, const char * text, int text_len, int scale, bool proportional, bool invert);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_SSD1306_FONT_H_ */
@@ -4,6 +4,7 @@
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "driver/i2c.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 
 #include "ssd1306.h"
@@ -18,9 +19,88 @@
 #define I2C_NUM I2C_NUM_0 // if spi is selected
 #endif
 
-#define I2C_MASTER_FREQ_HZ 400000 // I2C clock of SSD1306 can run at 400 kHz max.
+#if CONFIG_I2C_CLOCK_SPEED
+#define I2C_MASTER_FREQ_HZ CONFIG_I2C_CLOCK_SPEED
+#else
+#define I2C_MASTER_FREQ_HZ 400000
+#endif
+#define I2C_FALLBACK_FREQ_HZ 400000 // I2C clock of SSD1306 is specified for 400 kHz max.
 #define I2C_TICKS_TO_WAIT 100	  // Maximum ticks to wait before issuing a timeout.
 
+// Page writes combined into one command link, each is start, address and one write of control bytes and data
+#define I2C_LINK_TRANS 8
+#define I2C_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(I2C_LINK_TRANS)
+// Column and page address commands (each with a single command control byte) followed by the data control byte
+#define I2C_REGION_HEADER_SIZE 11
+#define I2C_FRAME_HEADER_SIZE 17
+#define I2C_LINK_DATA_SIZE (I2C_LINK_TRANS * (I2C_REGION_HEADER_SIZE + 128))
+
+static const ssd1306_transport_t i2c_transport;
+
+// Every panel has its own command link and the bytes it points to, allocated when the panel is
+// added, so panels drawn from different tasks or on different ports never share a pending link.
+// No transfer allocates. The link data is _xfer_buf, _xfer_used bytes of it are in the open link.
+static void i2c_alloc_link(SSD1306_t * dev)
+{
+	if (dev->_link_buf == NULL) {
+		dev->_link_buf = heap_caps_malloc(I2C_LINK_SIZE, MALLOC_CAP_INTERNAL);
+	}
+	if (dev->_xfer_buf == NULL) {
+		dev->_xfer_buf = heap_caps_malloc(I2C_LINK_DATA_SIZE, MALLOC_CAP_INTERNAL);
+	}
+	if (dev->_link_buf == NULL || dev->_xfer_buf == NULL) {
+		ESP_LOGE(TAG, "Could not allocate command link");
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	dev->_link_cmd = NULL;
+	dev->_link_trans = 0;
+	dev->_xfer_used = 0;
+}
+
+// Close the open link without sending it
+static void i2c_link_delete(SSD1306_t * dev)
+{
+	i2c_cmd_link_delete_static(dev->_link_cmd);
+	dev->_link_cmd = NULL;
+	dev->_xfer_used = 0;
+	dev->_link_trans = 0;
+}
+
+// Send the pending link and close it
+static esp_err_t i2c_link_run(SSD1306_t * dev)
+{
+	if (dev->_link_cmd == NULL) return ESP_OK;
+	i2c_master_stop(dev->_link_cmd);
+	esp_err_t res = i2c_master_cmd_begin(dev->_i2c_num, dev->_link_cmd, I2C_TICKS_TO_WAIT);
+	i2c_link_delete(dev);
+	return res;
+}
+
+// Space for a transaction of up to len bytes, sends the pending link first if it is full
+static uint8_t * i2c_link_reserve(SSD1306_t * dev, int len)
+{
+	if (dev->_link_cmd != NULL && (dev->_link_trans == I2C_LINK_TRANS || dev->_xfer_used + len > I2C_LINK_DATA_SIZE)) {
+		esp_err_t res = i2c_link_run(dev);
+		if (res != ESP_OK) {
+			ESP_LOGE(TAG, "Image command failed. code: 0x%.2X", res);
+		}
+	}
+	if (dev->_link_cmd == NULL) {
+		dev->_link_cmd = i2c_cmd_link_create_static(dev->_link_buf, I2C_LINK_SIZE);
+	}
+	return &dev->_xfer_buf[dev->_xfer_used];
+}
+
+// Append the reserved bytes as one transaction to the panel
+static void i2c_link_write(SSD1306_t * dev, const uint8_t * out_buf, int out_len)
+{
+	i2c_master_start(dev->_link_cmd);
+	i2c_master_write_byte(dev->_link_cmd, (dev->_address << 1) | I2C_MASTER_WRITE, true);
+	i2c_master_write(dev->_link_cmd, out_buf, out_len, true);
+	dev->_xfer_used = dev->_xfer_used + out_len;
+	dev->_link_trans++;
+}
+
 void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset)
 {
 	ESP_LOGI(TAG, "Legacy i2c driver is used");
@@ -44,9 +124,12 @@ void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset)
 		gpio_set_level(reset, 1);
 	}
 
+	dev->_ops = &i2c_transport;
 	dev->_address = I2C_ADDRESS;
 	dev->_flip = false;
 	dev->_i2c_num = I2C_NUM;
+	dev->_i2c_clk_hz = I2C_MASTER_FREQ_HZ;
+	i2c_alloc_link(dev);
 }
 
 void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t i2c_address)
@@ -75,9 +158,12 @@ void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t
 		gpio_set_level(reset, 1);
 	}
 
+	dev->_ops = &i2c_transport;
 	dev->_address = i2c_address;
 	dev->_flip = false;
 	dev->_i2c_num = i2c_num;
+	dev->_i2c_clk_hz = I2C_MASTER_FREQ_HZ;
+	i2c_alloc_link(dev);
 }
 
 void i2c_init(SSD1306_t * dev, int width, int height) {
@@ -86,58 +172,71 @@ void i2c_init(SSD1306_t * dev, int width, int height) {
 	dev->_pages = 8;
 	if (dev->_height == 32) dev->_pages = 4;
 	
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (dev->_address << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, OLED_CONTROL_BYTE_CMD_STREAM, true);
-	i2c_master_write_byte(cmd, OLED_CMD_DISPLAY_OFF, true);				// AE
-	i2c_master_write_byte(cmd, OLED_CMD_SET_MUX_RATIO, true);			// A8
-	if (dev->_height == 64) i2c_master_write_byte(cmd, 0x3F, true);
-	if (dev->_height == 32) i2c_master_write_byte(cmd, 0x1F, true);
-	i2c_master_write_byte(cmd, OLED_CMD_SET_DISPLAY_OFFSET, true);		// D3
-	i2c_master_write_byte(cmd, 0x00, true);
-	//i2c_master_write_byte(cmd, OLED_CONTROL_BYTE_DATA_STREAM, true);	// 40
-	i2c_master_write_byte(cmd, OLED_CMD_SET_DISPLAY_START_LINE, true);	// 40
-	//i2c_master_write_byte(cmd, OLED_CMD_SET_SEGMENT_REMAP, true);		// A1
+	uint8_t *out_buf = i2c_link_reserve(dev, 27);
+	int out_index = 0;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_STREAM;
+	out_buf[out_index++] = OLED_CMD_DISPLAY_OFF;				// AE
+	out_buf[out_index++] = OLED_CMD_SET_MUX_RATIO;			 // A8
+	if (dev->_height == 64) out_buf[out_index++] = 0x3F;
+	if (dev->_height == 32) out_buf[out_index++] = 0x1F;
+	out_buf[out_index++] = OLED_CMD_SET_DISPLAY_OFFSET;		 // D3
+	out_buf[out_index++] = 0x00;
+	//out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;	// 40
+	out_buf[out_index++] = OLED_CMD_SET_DISPLAY_START_LINE;	// 40
+	//out_buf[out_index++] = OLED_CMD_SET_SEGMENT_REMAP;		// A1
+	// Flip is done by the panel, the internal buffer is always upright
 	if (dev->_flip) {
-		i2c_master_write_byte(cmd, OLED_CMD_SET_SEGMENT_REMAP_0, true); // A0
+		out_buf[out_index++] = OLED_CMD_SET_SEGMENT_REMAP_0; // A0
+		out_buf[out_index++] = OLED_CMD_SET_COM_SCAN_NORMAL;	// C0
 	} else {
-		i2c_master_write_byte(cmd, OLED_CMD_SET_SEGMENT_REMAP_1, true);	// A1
+		out_buf[out_index++] = OLED_CMD_SET_SEGMENT_REMAP_1;	// A1
+		out_buf[out_index++] = OLED_CMD_SET_COM_SCAN_MODE;		// C8
 	}
-	i2c_master_write_byte(cmd, OLED_CMD_SET_COM_SCAN_MODE, true);		// C8
-	i2c_master_write_byte(cmd, OLED_CMD_SET_DISPLAY_CLK_DIV, true);		// D5
-	i2c_master_write_byte(cmd, 0x80, true);
-	i2c_master_write_byte(cmd, OLED_CMD_SET_COM_PIN_MAP, true);			// DA
-	if (dev->_height == 64) i2c_master_write_byte(cmd, 0x12, true);
-	if (dev->_height == 32) i2c_master_write_byte(cmd, 0x02, true);
-	i2c_master_write_byte(cmd, OLED_CMD_SET_CONTRAST, true);			// 81
-	i2c_master_write_byte(cmd, 0xFF, true);
-	i2c_master_write_byte(cmd, OLED_CMD_DISPLAY_RAM, true);				// A4
-	i2c_master_write_byte(cmd, OLED_CMD_SET_VCOMH_DESELCT, true);		// DB
-	i2c_master_write_byte(cmd, 0x40, true);
-	i2c_master_write_byte(cmd, OLED_CMD_SET_MEMORY_ADDR_MODE, true);	// 20
-	//i2c_master_write_byte(cmd, OLED_CMD_SET_HORI_ADDR_MODE, true);	// 00
-	i2c_master_write_byte(cmd, OLED_CMD_SET_PAGE_ADDR_MODE, true);		// 02
+	out_buf[out_index++] = OLED_CMD_SET_DISPLAY_CLK_DIV;		// D5
+	out_buf[out_index++] = 0x80;
+	out_buf[out_index++] = OLED_CMD_SET_COM_PIN_MAP;			// DA
+	if (dev->_height == 64) out_buf[out_index++] = 0x12;
+	if (dev->_height == 32) out_buf[out_index++] = 0x02;
+	out_buf[out_index++] = OLED_CMD_SET_CONTRAST;			// 81
+	out_buf[out_index++] = 0xFF;
+	out_buf[out_index++] = OLED_CMD_DISPLAY_RAM;				// A4
+	out_buf[out_index++] = OLED_CMD_SET_VCOMH_DESELCT;		// DB
+	out_buf[out_index++] = 0x40;
+	out_buf[out_index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;	// 20
+	//out_buf[out_index++] = OLED_CMD_SET_HORI_ADDR_MODE;	// 00
+	out_buf[out_index++] = OLED_CMD_SET_PAGE_ADDR_MODE;		// 02
 	// Set Lower Column Start Address for Page Addressing Mode
-	i2c_master_write_byte(cmd, 0x00, true);
+	out_buf[out_index++] = 0x00;
 	// Set Higher Column Start Address for Page Addressing Mode
-	i2c_master_write_byte(cmd, 0x10, true);
-	i2c_master_write_byte(cmd, OLED_CMD_SET_CHARGE_PUMP, true);			// 8D
-	i2c_master_write_byte(cmd, 0x14, true);
-	i2c_master_write_byte(cmd, OLED_CMD_DEACTIVE_SCROLL, true);			// 2E
-	i2c_master_write_byte(cmd, OLED_CMD_DISPLAY_NORMAL, true);			// A6
-	i2c_master_write_byte(cmd, OLED_CMD_DISPLAY_ON, true);				// AF
-
-	i2c_master_stop(cmd);
-
-	esp_err_t res = i2c_master_cmd_begin(dev->_i2c_num, cmd, I2C_TICKS_TO_WAIT);
+	out_buf[out_index++] = 0x10;
+	out_buf[out_index++] = OLED_CMD_SET_CHARGE_PUMP;			// 8D
+	out_buf[out_index++] = 0x14;
+	out_buf[out_index++] = OLED_CMD_DEACTIVE_SCROLL;			// 2E
+	out_buf[out_index++] = OLED_CMD_DISPLAY_NORMAL;			// A6
+	out_buf[out_index++] = OLED_CMD_DISPLAY_ON;				// AF
+	i2c_link_write(dev, out_buf, out_index);
+	i2c_master_stop(dev->_link_cmd);
+
+	dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
+
+	esp_err_t res = i2c_master_cmd_begin(dev->_i2c_num, dev->_link_cmd, I2C_TICKS_TO_WAIT);
+	if (res != ESP_OK && dev->_i2c_clk_hz > I2C_FALLBACK_FREQ_HZ) {
+		// The panel did not acknowledge, stretch the SCL period to the specified clock
+		ESP_LOGW(TAG, "No response at %d Hz, falling back to %d Hz", dev->_i2c_clk_hz, I2C_FALLBACK_FREQ_HZ);
+		int high_period, low_period;
+		i2c_get_period(dev->_i2c_num, &high_period, &low_period);
+		high_period = high_period * dev->_i2c_clk_hz / I2C_FALLBACK_FREQ_HZ;
+		low_period = low_period * dev->_i2c_clk_hz / I2C_FALLBACK_FREQ_HZ;
+		ESP_ERROR_CHECK(i2c_set_period(dev->_i2c_num, high_period, low_period));
+		dev->_i2c_clk_hz = I2C_FALLBACK_FREQ_HZ;
+		res = i2c_master_cmd_begin(dev->_i2c_num, dev->_link_cmd, I2C_TICKS_TO_WAIT);
+	}
 	if (res == ESP_OK) {
-		ESP_LOGI(TAG, "OLED configured successfully");
+		ESP_LOGI(TAG, "OLED configured successfully at %d Hz", dev->_i2c_clk_hz);
 	} else {
 		ESP_LOGE(TAG, "OLED configuration failed. code: 0x%.2X", res);
 	}
-	i2c_cmd_link_delete(cmd);
+	i2c_link_delete(dev);
 }
 
 
@@ -149,142 +248,118 @@ void i2c_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * image
 	uint8_t columLow = _seg & 0x0F;
 	uint8_t columHigh = (_seg >> 4) & 0x0F;
 
-	int _page = page;
-	if (dev->_flip) {
-		_page = (dev->_pages - page) - 1;
+	if (width > 128) width = 128;
+
+	// Address setup and data go out in one transaction, the commands use single command control bytes
+	uint8_t *out_buf = i2c_link_reserve(dev, I2C_REGION_HEADER_SIZE + width);
+	int out_index = 0;
+	if (dev->_addrMode != OLED_CMD_SET_PAGE_ADDR_MODE) {
+		// Back from a full frame transfer
+		out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+		out_buf[out_index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;	// 20
+		out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+		out_buf[out_index++] = OLED_CMD_SET_PAGE_ADDR_MODE;		// 02
+		dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
 	}
-
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (dev->_address << 1) | I2C_MASTER_WRITE, true);
-
-	i2c_master_write_byte(cmd, OLED_CONTROL_BYTE_CMD_STREAM, true);
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
 	// Set Lower Column Start Address for Page Addressing Mode
-	i2c_master_write_byte(cmd, (0x00 + columLow), true);
+	out_buf[out_index++] = (0x00 + columLow);
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
 	// Set Higher Column Start Address for Page Addressing Mode
-	i2c_master_write_byte(cmd, (0x10 + columHigh), true);
+	out_buf[out_index++] = (0x10 + columHigh);
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
 	// Set Page Start Address for Page Addressing Mode
-	i2c_master_write_byte(cmd, 0xB0 | _page, true);
-
-	i2c_master_stop(cmd);
-	esp_err_t res = i2c_master_cmd_begin(dev->_i2c_num, cmd, I2C_TICKS_TO_WAIT);
+	out_buf[out_index++] = 0xB0 | page;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;
+	memcpy(&out_buf[out_index], images, width);
+	i2c_link_write(dev, out_buf, out_index + width);
+
+	// Page writes of a frame go out together on wait()
+	if (dev->_batch) return;
+	esp_err_t res = i2c_link_run(dev);
 	if (res != ESP_OK) {
 		ESP_LOGE(TAG, "Image command failed. code: 0x%.2X", res);
 	}
-	i2c_cmd_link_delete(cmd);
-
-	cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (dev->_address << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, OLED_CONTROL_BYTE_DATA_STREAM, true);
-	i2c_master_write(cmd, images, width, true);
-	i2c_master_stop(cmd);
-
-	res = i2c_master_cmd_begin(dev->_i2c_num, cmd, I2C_TICKS_TO_WAIT);
-	if (res != ESP_OK) {
-		ESP_LOGE(TAG, "Image command failed. code: 0x%.2X", res);
-	}
-	i2c_cmd_link_delete(cmd);
 }
 
-void i2c_contrast(SSD1306_t * dev, int contrast) {
-	int _contrast = contrast;
-	if (contrast < 0x0) _contrast = 0;
-	if (contrast > 0xFF) _contrast = 0xFF;
-
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-	i2c_master_write_byte(cmd, (dev->_address << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, OLED_CONTROL_BYTE_CMD_STREAM, true); // 00
-	i2c_master_write_byte(cmd, OLED_CMD_SET_CONTRAST, true); // 81
-	i2c_master_write_byte(cmd, _contrast, true);
-	i2c_master_stop(cmd);
+// Stream all pages in one transaction using horizontal addressing
+void i2c_display_frame(SSD1306_t * dev, const PAGE_t * pages) {
+	uint8_t *out_buf = i2c_link_reserve(dev, I2C_FRAME_HEADER_SIZE + dev->_pages * dev->_width);
+	int out_index = 0;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;	// 20
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_HORI_ADDR_MODE;		// 00
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_COLUMN_RANGE;		// 21
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = CONFIG_OFFSETX;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = CONFIG_OFFSETX + dev->_width - 1;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_PAGE_RANGE;			// 22
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = 0x00;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = dev->_pages - 1;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;
+	dev->_addrMode = OLED_CMD_SET_HORI_ADDR_MODE;
+
+	for (int page=0; page<dev->_pages; page++) {
+		memcpy(&out_buf[out_index], pages[page]._segs, dev->_width);
+		out_index = out_index + dev->_width;
+	}
+	i2c_link_write(dev, out_buf, out_index);
 
-	esp_err_t res = i2c_master_cmd_begin(dev->_i2c_num, cmd, I2C_TICKS_TO_WAIT);
+	esp_err_t res = i2c_link_run(dev);
 	if (res != ESP_OK) {
-		ESP_LOGE(TAG, "Contrast command failed. code: 0x%.2X", res);
+		ESP_LOGE(TAG, "Frame command failed. code: 0x%.2X", res);
 	}
-	i2c_cmd_link_delete(cmd);
 }
 
-
-void i2c_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll) {
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-	i2c_master_start(cmd);
-
-	i2c_master_write_byte(cmd, (dev->_address << 1) | I2C_MASTER_WRITE, true);
-	i2c_master_write_byte(cmd, OLED_CONTROL_BYTE_CMD_STREAM, true); // 00
-
-	if (scroll == SCROLL_RIGHT) {
-		i2c_master_write_byte(cmd, OLED_CMD_HORIZONTAL_RIGHT, true); // 26
-		i2c_master_write_byte(cmd, 0x00, true); // Dummy byte
-		i2c_master_write_byte(cmd, 0x00, true); // Define start page address
-		i2c_master_write_byte(cmd, 0x07, true); // Frame frequency
-		i2c_master_write_byte(cmd, 0x07, true); // Define end page address
-		i2c_master_write_byte(cmd, 0x00, true); //
-		i2c_master_write_byte(cmd, 0xFF, true); //
-		i2c_master_write_byte(cmd, OLED_CMD_ACTIVE_SCROLL, true); // 2F
-	} 
-
-	if (scroll == SCROLL_LEFT) {
-		i2c_master_write_byte(cmd, OLED_CMD_HORIZONTAL_LEFT, true); // 27
-		i2c_master_write_byte(cmd, 0x00, true); // Dummy byte
-		i2c_master_write_byte(cmd, 0x00, true); // Define start page address
-		i2c_master_write_byte(cmd, 0x07, true); // Frame frequency
-		i2c_master_write_byte(cmd, 0x07, true); // Define end page address
-		i2c_master_write_byte(cmd, 0x00, true); //
-		i2c_master_write_byte(cmd, 0xFF, true); //
-		i2c_master_write_byte(cmd, OLED_CMD_ACTIVE_SCROLL, true); // 2F
-	} 
-
-	if (scroll == SCROLL_DOWN) {
-		i2c_master_write_byte(cmd, OLED_CMD_CONTINUOUS_SCROLL, true); // 29
-		i2c_master_write_byte(cmd, 0x00, true); // Dummy byte
-		i2c_master_write_byte(cmd, 0x00, true); // Define start page address
-		i2c_master_write_byte(cmd, 0x07, true); // Frame frequency
-		//i2c_master_write_byte(cmd, 0x01, true); // Define end page address
-		i2c_master_write_byte(cmd, 0x00, true); // Define end page address
-		i2c_master_write_byte(cmd, 0x3F, true); // Vertical scrolling offset
-
-		i2c_master_write_byte(cmd, OLED_CMD_VERTICAL, true); // A3
-		i2c_master_write_byte(cmd, 0x00, true);
-		if (dev->_height == 64)
-		//i2c_master_write_byte(cmd, 0x7F, true);
-		i2c_master_write_byte(cmd, 0x40, true);
-		if (dev->_height == 32)
-		i2c_master_write_byte(cmd, 0x20, true);
-		i2c_master_write_byte(cmd, OLED_CMD_ACTIVE_SCROLL, true); // 2F
+// Control byte and bytes in transactions of at most one link, after anything pending
+static esp_err_t i2c_write_stream(SSD1306_t * dev, uint8_t control, const uint8_t * bytes, int len) {
+	while (len > 0) {
+		int chunk = (len > I2C_LINK_DATA_SIZE - 1) ? I2C_LINK_DATA_SIZE - 1 : len;
+		uint8_t *out_buf = i2c_link_reserve(dev, chunk + 1);
+		out_buf[0] = control;
+		memcpy(&out_buf[1], bytes, chunk);
+		i2c_link_write(dev, out_buf, chunk + 1);
+		bytes = bytes + chunk;
+		len = len - chunk;
 	}
+	return i2c_link_run(dev);
+}
 
-	if (scroll == SCROLL_UP) {
-		i2c_master_write_byte(cmd, OLED_CMD_CONTINUOUS_SCROLL, true); // 29
-		i2c_master_write_byte(cmd, 0x00, true); // Dummy byte
-		i2c_master_write_byte(cmd, 0x00, true); // Define start page address
-		i2c_master_write_byte(cmd, 0x07, true); // Frame frequency
-		//i2c_master_write_byte(cmd, 0x01, true); // Define end page address
-		i2c_master_write_byte(cmd, 0x00, true); // Define end page address
-		i2c_master_write_byte(cmd, 0x01, true); // Vertical scrolling offset
-
-		i2c_master_write_byte(cmd, OLED_CMD_VERTICAL, true); // A3
-		i2c_master_write_byte(cmd, 0x00, true);
-		if (dev->_height == 64)
-		//i2c_master_write_byte(cmd, 0x7F, true);
-		i2c_master_write_byte(cmd, 0x40, true);
-		if (dev->_height == 32)
-		i2c_master_write_byte(cmd, 0x20, true);
-		i2c_master_write_byte(cmd, OLED_CMD_ACTIVE_SCROLL, true); // 2F
+void i2c_write_commands(SSD1306_t * dev, const uint8_t * commands, int len) {
+	esp_err_t res = i2c_write_stream(dev, OLED_CONTROL_BYTE_CMD_STREAM, commands, len); // 00
+	if (res != ESP_OK) {
+		ESP_LOGE(TAG, "Commands failed. code: 0x%.2X", res);
 	}
+}
 
-	if (scroll == SCROLL_STOP) {
-		i2c_master_write_byte(cmd, OLED_CMD_DEACTIVE_SCROLL, true); // 2E
+// GDDRAM bytes from the current address
+void i2c_write_data(SSD1306_t * dev, const uint8_t * data, int len) {
+	esp_err_t res = i2c_write_stream(dev, OLED_CONTROL_BYTE_DATA_STREAM, data, len); // 40
+	if (res != ESP_OK) {
+		ESP_LOGE(TAG, "Data failed. code: 0x%.2X", res);
 	}
+}
 
-	i2c_master_stop(cmd);
-
-	esp_err_t res = i2c_master_cmd_begin(dev->_i2c_num, cmd, I2C_TICKS_TO_WAIT);
+// Send the page writes held back for the frame, i2c_master_cmd_begin() returns after the transfer
+static void i2c_wait_idle(SSD1306_t * dev) {
+	esp_err_t res = i2c_link_run(dev);
 	if (res != ESP_OK) {
-		ESP_LOGE(TAG, "Scroll command failed. code: 0x%.2X", res);
+		ESP_LOGE(TAG, "Image command failed. code: 0x%.2X", res);
 	}
-	i2c_cmd_link_delete(cmd);
 }
 
+static const ssd1306_transport_t i2c_transport = {
+	.init = i2c_init,
+	.write_cmds = i2c_write_commands,
+	.write_data = i2c_write_data,
+	.write_region = i2c_display_image,
+	.flush = i2c_display_frame,
+	.wait = i2c_wait_idle,
+	.notify = NULL,
+};
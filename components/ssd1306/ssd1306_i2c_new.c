@@ -4,7 +4,9 @@
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "driver/i2c_master.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "ssd1306.h"
 
@@ -18,9 +20,178 @@
 #define I2C_NUM I2C_NUM_0 // if spi is selected
 #endif
 
-#define I2C_MASTER_FREQ_HZ 400000 // I2C clock of SSD1306 can run at 400 kHz max.
+#if CONFIG_I2C_CLOCK_SPEED
+#define I2C_MASTER_FREQ_HZ CONFIG_I2C_CLOCK_SPEED
+#else
+#define I2C_MASTER_FREQ_HZ 400000
+#endif
+#define I2C_FALLBACK_FREQ_HZ 400000 // I2C clock of SSD1306 is specified for 400 kHz max.
 #define I2C_TICKS_TO_WAIT 100	  // Maximum ticks to wait before issuing a timeout.
 
+// Queued transactions per bus, 0 makes every transmit block until it is done
+#if CONFIG_I2C_TRANS_QUEUE_DEPTH
+#define I2C_TRANS_QUEUE_DEPTH CONFIG_I2C_TRANS_QUEUE_DEPTH
+#else
+#define I2C_TRANS_QUEUE_DEPTH 0
+#endif
+
+// Addressing mode, column range and page range commands (each with a single command control byte) followed by the data control byte
+#define I2C_FRAME_HEADER_SIZE 17
+#define I2C_XFER_BUFFER_SIZE (I2C_FRAME_HEADER_SIZE + 8 * 128)
+#define I2C_CMD_CHUNK_SIZE 32 // Command bytes per transaction
+
+static const ssd1306_transport_t i2c_transport;
+
+// Guards _xfer_queued and _doneArmed against the transaction done interrupt
+static portMUX_TYPE i2c_done_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void i2c_alloc_xfer_buffer(SSD1306_t * dev)
+{
+	if (dev->_xfer_buf != NULL) return;
+	dev->_xfer_buf = heap_caps_malloc(I2C_XFER_BUFFER_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+	if (dev->_xfer_buf == NULL) {
+		ESP_LOGE(TAG, "Could not allocate transfer buffer");
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+}
+
+// Transaction done interrupt of a queued transmit. Calls the flush callback when the last one is done.
+static bool i2c_trans_done(i2c_master_dev_handle_t i2c_dev, const i2c_master_event_data_t * evt_data, void * arg)
+{
+	SSD1306_t * dev = arg;
+	bool fire = false;
+	portENTER_CRITICAL_ISR(&i2c_done_lock);
+	if (evt_data->event != I2C_EVENT_DONE) dev->_xfer_error = true;
+	if (dev->_xfer_queued > 0) dev->_xfer_queued--;
+	if (dev->_xfer_queued == 0 && dev->_doneArmed) {
+		dev->_doneArmed = false;
+		fire = true;
+	}
+	portEXIT_CRITICAL_ISR(&i2c_done_lock);
+	if (!fire) return false;
+	dev->_frameUs = esp_timer_get_time() - dev->_frameStart;
+	return dev->_doneCb(dev->_doneArg);
+}
+
+static esp_err_t i2c_add_panel(SSD1306_t * dev, i2c_master_bus_handle_t bus_handle, uint16_t i2c_address, int clk_hz)
+{
+	i2c_device_config_t dev_cfg = {
+		.dev_addr_length = I2C_ADDR_BIT_LEN_7,
+		.device_address = i2c_address,
+		.scl_speed_hz = clk_hz,
+	};
+	i2c_master_dev_handle_t i2c_dev_handle;
+	esp_err_t res = i2c_master_bus_add_device(bus_handle, &dev_cfg, &i2c_dev_handle);
+	if (res != ESP_OK) return res;
+	dev->_i2c_dev_handle = i2c_dev_handle;
+	dev->_i2c_clk_hz = clk_hz;
+	// With a transaction queue the bus driver works asynchronously, completion comes from the callback
+	dev->_i2c_async = (I2C_TRANS_QUEUE_DEPTH > 0);
+	if (dev->_i2c_async) {
+		i2c_master_event_callbacks_t cbs = {
+			.on_trans_done = i2c_trans_done,
+		};
+		res = i2c_master_register_event_callbacks(i2c_dev_handle, &cbs, dev);
+	}
+	return res;
+}
+
+// Add the panel again at the specified bus clock if it runs faster. Nothing may be queued.
+static bool i2c_fall_back(SSD1306_t * dev)
+{
+	if (dev->_i2c_clk_hz <= I2C_FALLBACK_FREQ_HZ) return false;
+	ESP_LOGW(TAG, "No response at %d Hz, falling back to %d Hz", dev->_i2c_clk_hz, I2C_FALLBACK_FREQ_HZ);
+	ESP_ERROR_CHECK(i2c_master_bus_rm_device(dev->_i2c_dev_handle));
+	ESP_ERROR_CHECK(i2c_add_panel(dev, dev->_i2c_bus_handle, dev->_address, I2C_FALLBACK_FREQ_HZ));
+	return true;
+}
+
+// Wait until every queued transaction is done and release the transfer buffer.
+// Returns the error of a failed transaction since the last call, later transactions use the fallback clock.
+static esp_err_t i2c_drain(SSD1306_t * dev)
+{
+	esp_err_t res = ESP_OK;
+	if (dev->_i2c_async) {
+		res = i2c_master_bus_wait_all_done(dev->_i2c_bus_handle, -1);
+	}
+	bool fire = false;
+	portENTER_CRITICAL(&i2c_done_lock);
+	// A transaction that never reported back is not waited for again
+	dev->_xfer_queued = 0;
+	if (dev->_doneArmed) {
+		dev->_doneArmed = false;
+		fire = true;
+	}
+	portEXIT_CRITICAL(&i2c_done_lock);
+	if (dev->_xfer_error) {
+		dev->_xfer_error = false;
+		if (res == ESP_OK) res = ESP_FAIL;
+	}
+	if (res != ESP_OK) {
+		ESP_LOGE(TAG, "Queued write to device [0x%02x at %d] failed: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
+		if (dev->_i2c_async) i2c_fall_back(dev);
+	}
+	dev->_xfer_used = 0;
+	if (fire) dev->_doneCb(dev->_doneArg);
+	return res;
+}
+
+// Space for len bytes in the transfer buffer. Queued transactions send from it,
+// their bytes stay untouched until they are done, waits if the buffer or the queue is full.
+static uint8_t * i2c_reserve(SSD1306_t * dev, int len)
+{
+	if (!dev->_i2c_async) {
+		dev->_xfer_used = 0;
+	} else if (dev->_xfer_used + len > I2C_XFER_BUFFER_SIZE || dev->_xfer_queued >= I2C_TRANS_QUEUE_DEPTH) {
+		i2c_drain(dev);
+	}
+	uint8_t * out_buf = dev->_xfer_buf + dev->_xfer_used;
+	dev->_xfer_used = dev->_xfer_used + len;
+	return out_buf;
+}
+
+// Transmit to the panel, dropping back to the specified bus clock once if the panel does not acknowledge.
+// Queued transmits return right away, their errors are reported by i2c_drain().
+static esp_err_t i2c_transmit(SSD1306_t * dev, const uint8_t * out_buf, size_t out_len)
+{
+	esp_err_t res;
+	if (dev->_i2c_async) {
+		portENTER_CRITICAL(&i2c_done_lock);
+		dev->_xfer_queued++;
+		portEXIT_CRITICAL(&i2c_done_lock);
+		res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, out_len, I2C_TICKS_TO_WAIT);
+		if (res != ESP_OK) {
+			portENTER_CRITICAL(&i2c_done_lock);
+			dev->_xfer_queued--;
+			portEXIT_CRITICAL(&i2c_done_lock);
+			ESP_LOGE(TAG, "Could not queue write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
+		}
+		return res;
+	}
+	res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, out_len, I2C_TICKS_TO_WAIT);
+	if (res != ESP_OK && i2c_fall_back(dev)) {
+		res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, out_len, I2C_TICKS_TO_WAIT);
+	}
+	if (res != ESP_OK)
+		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
+	return res;
+}
+
+// Transmit and wait until the panel has it. A queued transmit only sees a missing acknowledge
+// in i2c_drain(), it is sent once more if that dropped the bus clock.
+static esp_err_t i2c_transmit_wait(SSD1306_t * dev, const uint8_t * out_buf, size_t out_len)
+{
+	int clk_hz = dev->_i2c_clk_hz;
+	esp_err_t res = i2c_transmit(dev, out_buf, out_len);
+	if (!dev->_i2c_async) return res;
+	if (res == ESP_OK) res = i2c_drain(dev);
+	if (res != ESP_OK && dev->_i2c_clk_hz != clk_hz) {
+		res = i2c_transmit(dev, out_buf, out_len);
+		if (res == ESP_OK) res = i2c_drain(dev);
+	}
+	return res;
+}
+
 void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset)
 {
 	ESP_LOGI(TAG, "New i2c driver is used");
@@ -30,18 +201,14 @@ void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset)
 		.i2c_port = I2C_NUM,
 		.scl_io_num = scl,
 		.sda_io_num = sda,
+		.trans_queue_depth = I2C_TRANS_QUEUE_DEPTH,
 		.flags.enable_internal_pullup = true,
 	};
 	i2c_master_bus_handle_t i2c_bus_handle;
 	ESP_ERROR_CHECK(i2c_new_master_bus(&i2c_mst_config, &i2c_bus_handle));
 
-	i2c_device_config_t dev_cfg = {
-		.dev_addr_length = I2C_ADDR_BIT_LEN_7,
-		.device_address = I2C_ADDRESS,
-		.scl_speed_hz = I2C_MASTER_FREQ_HZ,
-	};
-	i2c_master_dev_handle_t i2c_dev_handle;
-	ESP_ERROR_CHECK(i2c_master_bus_add_device(i2c_bus_handle, &dev_cfg, &i2c_dev_handle));
+	dev->_i2c_bus_handle = i2c_bus_handle;
+	ESP_ERROR_CHECK(i2c_add_panel(dev, i2c_bus_handle, I2C_ADDRESS, I2C_MASTER_FREQ_HZ));
 
 	if (reset >= 0) {
 		//gpio_pad_select_gpio(reset);
@@ -52,11 +219,11 @@ void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset)
 		gpio_set_level(reset, 1);
 	}
 
+	dev->_ops = &i2c_transport;
 	dev->_address = I2C_ADDRESS;
 	dev->_flip = false;
 	dev->_i2c_num = I2C_NUM;
-	dev->_i2c_bus_handle = i2c_bus_handle;
-	dev->_i2c_dev_handle = i2c_dev_handle;
+	i2c_alloc_xfer_buffer(dev);
 }
 
 void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t i2c_address)
@@ -76,13 +243,7 @@ void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t
 	ESP_ERROR_CHECK(i2c_new_master_bus(&i2c_mst_config, &i2c_bus_handle));
 #endif
 
-	i2c_device_config_t dev_cfg = {
-		.dev_addr_length = I2C_ADDR_BIT_LEN_7,
-		.device_address = i2c_address,
-		.scl_speed_hz = I2C_MASTER_FREQ_HZ,
-	};
-	i2c_master_dev_handle_t i2c_dev_handle;
-	ESP_ERROR_CHECK(i2c_master_bus_add_device(dev->_i2c_bus_handle, &dev_cfg, &i2c_dev_handle));
+	ESP_ERROR_CHECK(i2c_add_panel(dev, dev->_i2c_bus_handle, i2c_address, I2C_MASTER_FREQ_HZ));
 
 	if (reset >= 0) {
 		//gpio_pad_select_gpio(reset);
@@ -93,10 +254,11 @@ void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t
 		gpio_set_level(reset, 1);
 	}
 
+	dev->_ops = &i2c_transport;
 	dev->_address = i2c_address;
 	dev->_flip = false;
 	dev->_i2c_num = i2c_num;
-	dev->_i2c_dev_handle = i2c_dev_handle;
+	i2c_alloc_xfer_buffer(dev);
 }
 
 void i2c_init(SSD1306_t * dev, int width, int height) {
@@ -105,7 +267,7 @@ void i2c_init(SSD1306_t * dev, int width, int height) {
 	dev->_pages = 8;
 	if (dev->_height == 32) dev->_pages = 4;
 	
-	uint8_t out_buf[27];
+	uint8_t *out_buf = i2c_reserve(dev, 27);
 	int out_index = 0;
 	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_STREAM;
 	out_buf[out_index++] = OLED_CMD_DISPLAY_OFF;				// AE
@@ -117,12 +279,14 @@ void i2c_init(SSD1306_t * dev, int width, int height) {
 	//out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;	// 40
 	out_buf[out_index++] = OLED_CMD_SET_DISPLAY_START_LINE;	// 40
 	//out_buf[out_index++] = OLED_CMD_SET_SEGMENT_REMAP;		// A1
+	// Flip is done by the panel, the internal buffer is always upright
 	if (dev->_flip) {
 		out_buf[out_index++] = OLED_CMD_SET_SEGMENT_REMAP_0; // A0
+		out_buf[out_index++] = OLED_CMD_SET_COM_SCAN_NORMAL;	// C0
 	} else {
 		out_buf[out_index++] = OLED_CMD_SET_SEGMENT_REMAP_1;	// A1
+		out_buf[out_index++] = OLED_CMD_SET_COM_SCAN_MODE;		// C8
 	}
-	out_buf[out_index++] = OLED_CMD_SET_COM_SCAN_MODE;		// C8
 	out_buf[out_index++] = OLED_CMD_SET_DISPLAY_CLK_DIV;		// D5
 	out_buf[out_index++] = 0x80;
 	out_buf[out_index++] = OLED_CMD_SET_COM_PIN_MAP;			// DA
@@ -146,12 +310,12 @@ void i2c_init(SSD1306_t * dev, int width, int height) {
 	out_buf[out_index++] = OLED_CMD_DISPLAY_NORMAL;			// A6
 	out_buf[out_index++] = OLED_CMD_DISPLAY_ON;				// AF
 
-	esp_err_t res;
-	res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, out_index, I2C_TICKS_TO_WAIT);
+	dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
+
+	// Sent synchronously, so a panel that does not take the configured clock is caught here
+	esp_err_t res = i2c_transmit_wait(dev, out_buf, out_index);
 	if (res == ESP_OK) {
-		ESP_LOGI(TAG, "OLED configured successfully");
-	} else {
-		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
+		ESP_LOGI(TAG, "OLED configured successfully at %d Hz", dev->_i2c_clk_hz);
 	}
 }
 
@@ -164,128 +328,114 @@ void i2c_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * image
 	uint8_t columLow = _seg & 0x0F;
 	uint8_t columHigh = (_seg >> 4) & 0x0F;
 
-	int _page = page;
-	if (dev->_flip) {
-		_page = (dev->_pages - page) - 1;
-	}
+	if (width > 128) width = 128;
 
-	uint8_t *out_buf;
-	out_buf = malloc(width < 4 ? 4 : width + 1);
-	if (out_buf == NULL) {
-		ESP_LOGE(TAG, "malloc fail");
-		return;
-	}
+	// Address setup and data go out in one transaction, the commands use single command control bytes
+	uint8_t *out_buf = i2c_reserve(dev, 11 + width);
 	int out_index = 0;
-	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_STREAM;
+	if (dev->_addrMode != OLED_CMD_SET_PAGE_ADDR_MODE) {
+		// Back from a full frame transfer
+		out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+		out_buf[out_index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;	// 20
+		out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+		out_buf[out_index++] = OLED_CMD_SET_PAGE_ADDR_MODE;		// 02
+		dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
+	}
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
 	// Set Lower Column Start Address for Page Addressing Mode
 	out_buf[out_index++] = (0x00 + columLow);
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
 	// Set Higher Column Start Address for Page Addressing Mode
 	out_buf[out_index++] = (0x10 + columHigh);
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
 	// Set Page Start Address for Page Addressing Mode
-	out_buf[out_index++] = 0xB0 | _page;
-
-	esp_err_t res;
-	res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, out_index, I2C_TICKS_TO_WAIT);
-	if (res != ESP_OK)
-		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
-
-	out_buf[0] = OLED_CONTROL_BYTE_DATA_STREAM;
-	memcpy(&out_buf[1], images, width);
+	out_buf[out_index++] = 0xB0 | page;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;
+	memcpy(&out_buf[out_index], images, width);
 
-	res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, width + 1, I2C_TICKS_TO_WAIT);
-	if (res != ESP_OK)
-		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
-	free(out_buf);
+	i2c_transmit(dev, out_buf, out_index + width);
 }
 
-void i2c_contrast(SSD1306_t * dev, int contrast) {
-	uint8_t _contrast = contrast;
-	if (contrast < 0x0) _contrast = 0;
-	if (contrast > 0xFF) _contrast = 0xFF;
-
-	uint8_t out_buf[3];
+// Stream all pages in one transaction using horizontal addressing
+void i2c_display_frame(SSD1306_t * dev, const PAGE_t * pages) {
+	uint8_t *out_buf = i2c_reserve(dev, I2C_FRAME_HEADER_SIZE + dev->_pages * dev->_width);
 	int out_index = 0;
-	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_STREAM; // 00
-	out_buf[out_index++] = OLED_CMD_SET_CONTRAST; // 81
-	out_buf[out_index++] = _contrast;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;	// 20
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_HORI_ADDR_MODE;		// 00
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_COLUMN_RANGE;		// 21
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = CONFIG_OFFSETX;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = CONFIG_OFFSETX + dev->_width - 1;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = OLED_CMD_SET_PAGE_RANGE;			// 22
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = 0x00;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+	out_buf[out_index++] = dev->_pages - 1;
+	out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;
+	dev->_addrMode = OLED_CMD_SET_HORI_ADDR_MODE;
+
+	for (int page=0; page<dev->_pages; page++) {
+		memcpy(&out_buf[out_index], pages[page]._segs, dev->_width);
+		out_index = out_index + dev->_width;
+	}
 
-	esp_err_t res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, 3, I2C_TICKS_TO_WAIT);
-	if (res != ESP_OK)
-		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
+	i2c_transmit(dev, out_buf, out_index);
 }
 
-
-void i2c_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll) {
-	uint8_t out_buf[11];
-	int out_index = 0;
-	out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_STREAM; // 00
-
-	if (scroll == SCROLL_RIGHT) {
-		out_buf[out_index++] = OLED_CMD_HORIZONTAL_RIGHT; // 26
-		out_buf[out_index++] = 0x00; // Dummy byte
-		out_buf[out_index++] = 0x00; // Define start page address
-		out_buf[out_index++] = 0x07; // Frame frequency
-		out_buf[out_index++] = 0x07; // Define end page address
-		out_buf[out_index++] = 0x00; //
-		out_buf[out_index++] = 0xFF; //
-		out_buf[out_index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
-	} 
-
-	if (scroll == SCROLL_LEFT) {
-		out_buf[out_index++] = OLED_CMD_HORIZONTAL_LEFT; // 27
-		out_buf[out_index++] = 0x00; // Dummy byte
-		out_buf[out_index++] = 0x00; // Define start page address
-		out_buf[out_index++] = 0x07; // Frame frequency
-		out_buf[out_index++] = 0x07; // Define end page address
-		out_buf[out_index++] = 0x00; //
-		out_buf[out_index++] = 0xFF; //
-		out_buf[out_index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
-	} 
-
-	if (scroll == SCROLL_DOWN) {
-		out_buf[out_index++] = OLED_CMD_CONTINUOUS_SCROLL; // 29
-		out_buf[out_index++] = 0x00; // Dummy byte
-		out_buf[out_index++] = 0x00; // Define start page address
-		out_buf[out_index++] = 0x07; // Frame frequency
-		//out_buf[out_index++] = 0x01; // Define end page address
-		out_buf[out_index++] = 0x00; // Define end page address
-		out_buf[out_index++] = 0x3F; // Vertical scrolling offset
-
-		out_buf[out_index++] = OLED_CMD_VERTICAL; // A3
-		out_buf[out_index++] = 0x00;
-		if (dev->_height == 64)
-		//out_buf[out_index++] = 0x7F;
-		out_buf[out_index++] = 0x40;
-		if (dev->_height == 32)
-		out_buf[out_index++] = 0x20;
-		out_buf[out_index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
+// Commands in one transaction, longer sequences are split
+void i2c_write_commands(SSD1306_t * dev, const uint8_t * commands, int len) {
+	while (len > 0) {
+		int chunk = (len > I2C_CMD_CHUNK_SIZE) ? I2C_CMD_CHUNK_SIZE : len;
+		uint8_t *out_buf = i2c_reserve(dev, chunk + 1);
+		out_buf[0] = OLED_CONTROL_BYTE_CMD_STREAM; // 00
+		memcpy(&out_buf[1], commands, chunk);
+		i2c_transmit(dev, out_buf, chunk + 1);
+		commands = commands + chunk;
+		len = len - chunk;
 	}
+}
 
-	if (scroll == SCROLL_UP) {
-		out_buf[out_index++] = OLED_CMD_CONTINUOUS_SCROLL; // 29
-		out_buf[out_index++] = 0x00; // Dummy byte
-		out_buf[out_index++] = 0x00; // Define start page address
-		out_buf[out_index++] = 0x07; // Frame frequency
-		//out_buf[out_index++] = 0x01; // Define end page address
-		out_buf[out_index++] = 0x00; // Define end page address
-		out_buf[out_index++] = 0x01; // Vertical scrolling offset
-
-		out_buf[out_index++] = OLED_CMD_VERTICAL; // A3
-		out_buf[out_index++] = 0x00;
-		if (dev->_height == 64)
-		//out_buf[out_index++] = 0x7F;
-		out_buf[out_index++] = 0x40;
-		if (dev->_height == 32)
-		out_buf[out_index++] = 0x20;
-		out_buf[out_index++] = OLED_CMD_ACTIVE_SCROLL; // 2F
+// GDDRAM bytes from the current address, through the transfer buffer
+void i2c_write_data(SSD1306_t * dev, const uint8_t * data, int len) {
+	while (len > 0) {
+		int chunk = (len > I2C_XFER_BUFFER_SIZE - 1) ? I2C_XFER_BUFFER_SIZE - 1 : len;
+		uint8_t *out_buf = i2c_reserve(dev, chunk + 1);
+		out_buf[0] = OLED_CONTROL_BYTE_DATA_STREAM; // 40
+		memcpy(&out_buf[1], data, chunk);
+		i2c_transmit(dev, out_buf, chunk + 1);
+		data = data + chunk;
+		len = len - chunk;
 	}
+}
 
-	if (scroll == SCROLL_STOP) {
-		out_buf[out_index++] = OLED_CMD_DEACTIVE_SCROLL; // 2E
-	}
+static void i2c_wait_idle(SSD1306_t * dev) {
+	i2c_drain(dev);
+}
 
-	esp_err_t res = i2c_master_transmit(dev->_i2c_dev_handle, out_buf, out_index, I2C_TICKS_TO_WAIT);
-	if (res != ESP_OK)
-		ESP_LOGE(TAG, "Could not write to device [0x%02x at %d]: %d (%s)", dev->_address, dev->_i2c_num, res, esp_err_to_name(res));
+// Call the flush callback now if nothing is queued, else from the interrupt of the last transaction
+static void i2c_notify_done(SSD1306_t * dev) {
+	bool fire = false;
+	portENTER_CRITICAL(&i2c_done_lock);
+	if (dev->_xfer_queued == 0) {
+		fire = true;
+	} else {
+		dev->_doneArmed = true;
+	}
+	portEXIT_CRITICAL(&i2c_done_lock);
+	if (fire) dev->_doneCb(dev->_doneArg);
 }
 
+static const ssd1306_transport_t i2c_transport = {
+	.init = i2c_init,
+	.write_cmds = i2c_write_commands,
+	.write_data = i2c_write_data,
+	.write_region = i2c_display_image,
+	.flush = i2c_display_frame,
+	.wait = i2c_wait_idle,
+	.notify = i2c_notify_done,
+};
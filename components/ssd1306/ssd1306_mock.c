@@ -0,0 +1,580 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+
+#include "ssd1306.h"
+
+// Mock transport for the linux target.
+// The i2c_* and spi_* functions build the same byte streams as ssd1306_i2c_new.c
+// and ssd1306_spi.c and feed them to a small SSD1306 command interpreter, so GRAM,
+// addressing modes and bus statistics behave like the real panel.
+// Every device gets its own emulated panel and counters when it is added to a bus.
+
+#define TAG "SSD1306"
+
+#if CONFIG_I2C_CLOCK_SPEED
+#define I2C_MASTER_FREQ_HZ CONFIG_I2C_CLOCK_SPEED
+#else
+#define I2C_MASTER_FREQ_HZ 400000
+#endif
+
+#define MOCK_COLUMNS 128
+#define MOCK_PAGES 8
+#define MOCK_CMD_CHUNK_SIZE 32 // Command bytes per I2C transaction, as in ssd1306_i2c_new.c
+
+static const ssd1306_transport_t mock_i2c_transport;
+static const ssd1306_transport_t mock_spi_transport;
+
+typedef struct ssd1306_mock_t {
+	uint8_t gram[MOCK_PAGES][MOCK_COLUMNS];
+	int addrMode;
+	int column; // Column pointer
+	int page; // Page pointer
+	int columnStart;
+	int columnEnd;
+	int pageStart;
+	int pageEnd;
+	int startLine;
+	int contrast;
+	int mux;
+	bool segRemap; // A1: column 127 is on the left
+	bool comRemap; // C8: scan from COM[N-1] to COM0
+	bool displayOn;
+	bool inverted;
+	bool scrolling;
+	// Command being assembled, arguments may arrive in separate control blocks
+	uint8_t command[8];
+	int commandLen;
+	int commandArgs;
+	ssd1306_bus_stats_t stats;
+} mock_panel_t;
+
+// Power-on state of the panel, GRAM is blank
+static const mock_panel_t mock_reset_state = {
+	.addrMode = OLED_CMD_SET_PAGE_ADDR_MODE,
+	.columnEnd = MOCK_COLUMNS - 1,
+	.pageEnd = MOCK_PAGES - 1,
+	.contrast = 0x7F,
+	.mux = 63,
+};
+
+// Give the device its own panel, kept when it is added again like GRAM of a real panel
+static void mock_attach(SSD1306_t * dev)
+{
+	if (dev->_mock != NULL) return;
+	dev->_mock = malloc(sizeof(mock_panel_t));
+	if (dev->_mock == NULL) {
+		ESP_LOGE(TAG, "Could not allocate the mock panel");
+		abort();
+	}
+	*dev->_mock = mock_reset_state;
+}
+
+// Number of argument bytes following a command
+static int mock_command_args(uint8_t command)
+{
+	switch (command) {
+		case OLED_CMD_SET_MEMORY_ADDR_MODE:
+		case OLED_CMD_SET_CONTRAST:
+		case OLED_CMD_SET_CHARGE_PUMP:
+		case OLED_CMD_SET_MUX_RATIO:
+		case OLED_CMD_SET_DISPLAY_OFFSET:
+		case OLED_CMD_SET_DISPLAY_CLK_DIV:
+		case OLED_CMD_SET_PRECHARGE:
+		case OLED_CMD_SET_COM_PIN_MAP:
+		case OLED_CMD_SET_VCOMH_DESELCT:
+			return 1;
+		case OLED_CMD_SET_COLUMN_RANGE:
+		case OLED_CMD_SET_PAGE_RANGE:
+		case OLED_CMD_VERTICAL:
+			return 2;
+		case OLED_CMD_CONTINUOUS_SCROLL:
+		case 0x2A:
+			return 5;
+		case OLED_CMD_HORIZONTAL_RIGHT:
+		case OLED_CMD_HORIZONTAL_LEFT:
+			return 6;
+		default:
+			return 0;
+	}
+}
+
+static void mock_execute(mock_panel_t * panel, const uint8_t * command)
+{
+	uint8_t op = command[0];
+	if (op <= 0x0F) {
+		panel->column = (panel->column & 0xF0) | op;
+	} else if (op <= 0x1F) {
+		panel->column = (panel->column & 0x0F) | ((op & 0x0F) << 4);
+	} else if (op >= 0x40 && op <= 0x7F) {
+		panel->startLine = op & 0x3F;
+	} else if (op >= 0xB0 && op <= 0xB7) {
+		panel->page = op & 0x07;
+	} else {
+		switch (op) {
+			case OLED_CMD_SET_MEMORY_ADDR_MODE:
+				panel->addrMode = command[1] & 0x03;
+				break;
+			case OLED_CMD_SET_COLUMN_RANGE:
+				panel->columnStart = panel->column = command[1] & 0x7F;
+				panel->columnEnd = command[2] & 0x7F;
+				break;
+			case OLED_CMD_SET_PAGE_RANGE:
+				panel->pageStart = panel->page = command[1] & 0x07;
+				panel->pageEnd = command[2] & 0x07;
+				break;
+			case OLED_CMD_SET_CONTRAST:
+				panel->contrast = command[1];
+				break;
+			case OLED_CMD_SET_MUX_RATIO:
+				panel->mux = command[1] & 0x3F;
+				break;
+			case OLED_CMD_SET_SEGMENT_REMAP_0:
+			case OLED_CMD_SET_SEGMENT_REMAP_1:
+				panel->segRemap = op & 0x01;
+				break;
+			case OLED_CMD_SET_COM_SCAN_NORMAL:
+			case OLED_CMD_SET_COM_SCAN_MODE:
+				panel->comRemap = (op == OLED_CMD_SET_COM_SCAN_MODE);
+				break;
+			case OLED_CMD_DISPLAY_OFF:
+			case OLED_CMD_DISPLAY_ON:
+				panel->displayOn = (op == OLED_CMD_DISPLAY_ON);
+				break;
+			case OLED_CMD_DISPLAY_NORMAL:
+			case OLED_CMD_DISPLAY_INVERTED:
+				panel->inverted = (op == OLED_CMD_DISPLAY_INVERTED);
+				break;
+			case OLED_CMD_ACTIVE_SCROLL:
+			case OLED_CMD_DEACTIVE_SCROLL:
+				panel->scrolling = (op == OLED_CMD_ACTIVE_SCROLL);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+static void mock_command_byte(mock_panel_t * panel, uint8_t value)
+{
+	panel->stats.cmd_bytes++;
+	if (panel->commandLen == 0) {
+		panel->commandArgs = mock_command_args(value);
+	}
+	panel->command[panel->commandLen++] = value;
+	if (panel->commandLen > panel->commandArgs) {
+		mock_execute(panel, panel->command);
+		panel->commandLen = 0;
+	}
+}
+
+static void mock_data_byte(mock_panel_t * panel, uint8_t value)
+{
+	panel->stats.data_bytes++;
+	if (panel->column < MOCK_COLUMNS) panel->gram[panel->page][panel->column] = value;
+	if (panel->addrMode == OLED_CMD_SET_PAGE_ADDR_MODE) {
+		// Column wraps within the page
+		panel->column = (panel->column + 1) & 0x7F;
+		return;
+	}
+	if (panel->addrMode == OLED_CMD_SET_VERT_ADDR_MODE) {
+		if (panel->page++ < panel->pageEnd) return;
+		panel->page = panel->pageStart;
+		panel->column = (panel->column < panel->columnEnd) ? panel->column + 1 : panel->columnStart;
+		return;
+	}
+	if (panel->column++ < panel->columnEnd) return;
+	panel->column = panel->columnStart;
+	panel->page = (panel->page < panel->pageEnd) ? panel->page + 1 : panel->pageStart;
+}
+
+// One I2C write: control byte, then one byte (Co set) or the rest of the transaction
+static void mock_i2c_write(SSD1306_t * dev, const uint8_t * buf, size_t len)
+{
+	mock_panel_t * panel = dev->_mock;
+	panel->stats.transactions++;
+	panel->stats.bytes += len;
+	size_t index = 0;
+	while (index < len) {
+		uint8_t control = buf[index++];
+		bool data = control & 0x40;
+		size_t end = (control & 0x80) ? index + 1 : len;
+		if (end > len) end = len;
+		for (; index < end; index++) {
+			if (data) {
+				mock_data_byte(panel, buf[index]);
+			} else {
+				mock_command_byte(panel, buf[index]);
+			}
+		}
+	}
+}
+
+// One SPI transaction, D/C selects commands or data for all of it
+static void mock_spi_write(SSD1306_t * dev, int dc, const uint8_t * buf, size_t len)
+{
+	mock_panel_t * panel = dev->_mock;
+	if (len == 0) return;
+	panel->stats.transactions++;
+	panel->stats.bytes += len;
+	for (size_t index = 0; index < len; index++) {
+		if (dc) {
+			mock_data_byte(panel, buf[index]);
+		} else {
+			mock_command_byte(panel, buf[index]);
+		}
+	}
+}
+
+// Panel setup shared by both interfaces, same sequence as the real transports
+static int mock_init_commands(SSD1306_t * dev, uint8_t * commands)
+{
+	int index = 0;
+	commands[index++] = OLED_CMD_DISPLAY_OFF;
+	commands[index++] = OLED_CMD_SET_MUX_RATIO;
+	commands[index++] = (dev->_height == 32) ? 0x1F : 0x3F;
+	commands[index++] = OLED_CMD_SET_DISPLAY_OFFSET;
+	commands[index++] = 0x00;
+	commands[index++] = OLED_CMD_SET_DISPLAY_START_LINE;
+	commands[index++] = dev->_flip ? OLED_CMD_SET_SEGMENT_REMAP_0 : OLED_CMD_SET_SEGMENT_REMAP_1;
+	commands[index++] = dev->_flip ? OLED_CMD_SET_COM_SCAN_NORMAL : OLED_CMD_SET_COM_SCAN_MODE;
+	commands[index++] = OLED_CMD_SET_DISPLAY_CLK_DIV;
+	commands[index++] = 0x80;
+	commands[index++] = OLED_CMD_SET_COM_PIN_MAP;
+	commands[index++] = (dev->_height == 32) ? 0x02 : 0x12;
+	commands[index++] = OLED_CMD_SET_CONTRAST;
+	commands[index++] = 0xFF;
+	commands[index++] = OLED_CMD_DISPLAY_RAM;
+	commands[index++] = OLED_CMD_SET_VCOMH_DESELCT;
+	commands[index++] = 0x40;
+	commands[index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;
+	commands[index++] = OLED_CMD_SET_PAGE_ADDR_MODE;
+	commands[index++] = 0x00;
+	commands[index++] = 0x10;
+	commands[index++] = OLED_CMD_SET_CHARGE_PUMP;
+	commands[index++] = 0x14;
+	commands[index++] = OLED_CMD_DEACTIVE_SCROLL;
+	commands[index++] = OLED_CMD_DISPLAY_NORMAL;
+	commands[index++] = OLED_CMD_DISPLAY_ON;
+	return index;
+}
+
+static void mock_panel_init(SSD1306_t * dev, int width, int height)
+{
+	dev->_width = width;
+	dev->_height = height;
+	dev->_pages = 8;
+	if (dev->_height == 32) dev->_pages = 4;
+	dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
+}
+
+// Page addressing commands for an image write, the mode is restored after a full frame
+static int mock_image_commands(SSD1306_t * dev, int page, int seg, uint8_t * commands)
+{
+	int _seg = seg + CONFIG_OFFSETX;
+	int index = 0;
+	if (dev->_addrMode != OLED_CMD_SET_PAGE_ADDR_MODE) {
+		commands[index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;
+		commands[index++] = OLED_CMD_SET_PAGE_ADDR_MODE;
+		dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
+	}
+	commands[index++] = 0x00 + (_seg & 0x0F);
+	commands[index++] = 0x10 + ((_seg >> 4) & 0x0F);
+	commands[index++] = 0xB0 | page;
+	return index;
+}
+
+static int mock_frame_commands(SSD1306_t * dev, uint8_t * commands)
+{
+	int index = 0;
+	commands[index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;
+	commands[index++] = OLED_CMD_SET_HORI_ADDR_MODE;
+	commands[index++] = OLED_CMD_SET_COLUMN_RANGE;
+	commands[index++] = CONFIG_OFFSETX;
+	commands[index++] = CONFIG_OFFSETX + dev->_width - 1;
+	commands[index++] = OLED_CMD_SET_PAGE_RANGE;
+	commands[index++] = 0x00;
+	commands[index++] = dev->_pages - 1;
+	dev->_addrMode = OLED_CMD_SET_HORI_ADDR_MODE;
+	return index;
+}
+
+// Frame data in transfer order
+static int mock_frame_data(SSD1306_t * dev, const PAGE_t * pages, uint8_t * data)
+{
+	int index = 0;
+	for (int page=0; page<dev->_pages; page++) {
+		memcpy(&data[index], pages[page]._segs, dev->_width);
+		index = index + dev->_width;
+	}
+	return index;
+}
+
+// I2C, framed like ssd1306_i2c_new.c
+
+void i2c_master_init(SSD1306_t * dev, int16_t sda, int16_t scl, int16_t reset)
+{
+	mock_attach(dev);
+	dev->_ops = &mock_i2c_transport;
+	dev->_address = I2C_ADDRESS;
+	dev->_flip = false;
+	dev->_i2c_num = 0;
+	dev->_i2c_clk_hz = I2C_MASTER_FREQ_HZ;
+	ESP_LOGI(TAG, "Mock I2C transport");
+}
+
+void i2c_device_add(SSD1306_t * dev, i2c_port_t i2c_num, int16_t reset, uint16_t i2c_address)
+{
+	mock_attach(dev);
+	dev->_ops = &mock_i2c_transport;
+	dev->_address = i2c_address;
+	dev->_flip = false;
+	dev->_i2c_num = i2c_num;
+	dev->_i2c_clk_hz = I2C_MASTER_FREQ_HZ;
+}
+
+void i2c_init(SSD1306_t * dev, int width, int height)
+{
+	mock_panel_init(dev, width, height);
+	uint8_t out_buf[32];
+	out_buf[0] = OLED_CONTROL_BYTE_CMD_STREAM;
+	int len = mock_init_commands(dev, &out_buf[1]);
+	mock_i2c_write(dev, out_buf, len + 1);
+}
+
+void i2c_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width)
+{
+	if (page >= dev->_pages) return;
+	if (seg >= dev->_width) return;
+	if (width > 128) width = 128;
+
+	uint8_t commands[8];
+	int len = mock_image_commands(dev, page, seg, commands);
+	uint8_t out_buf[16 + 128];
+	int out_index = 0;
+	for (int i=0; i<len; i++) {
+		out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+		out_buf[out_index++] = commands[i];
+	}
+	out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;
+	memcpy(&out_buf[out_index], images, width);
+	mock_i2c_write(dev, out_buf, out_index + width);
+}
+
+void i2c_display_frame(SSD1306_t * dev, const PAGE_t * pages)
+{
+	uint8_t commands[8];
+	int len = mock_frame_commands(dev, commands);
+	uint8_t out_buf[17 + 8 * 128];
+	int out_index = 0;
+	for (int i=0; i<len; i++) {
+		out_buf[out_index++] = OLED_CONTROL_BYTE_CMD_SINGLE;
+		out_buf[out_index++] = commands[i];
+	}
+	out_buf[out_index++] = OLED_CONTROL_BYTE_DATA_STREAM;
+	out_index = out_index + mock_frame_data(dev, pages, &out_buf[out_index]);
+	mock_i2c_write(dev, out_buf, out_index);
+}
+
+void i2c_write_commands(SSD1306_t * dev, const uint8_t * commands, int len)
+{
+	uint8_t out_buf[MOCK_CMD_CHUNK_SIZE + 1];
+	out_buf[0] = OLED_CONTROL_BYTE_CMD_STREAM;
+	while (len > 0) {
+		int chunk = (len > MOCK_CMD_CHUNK_SIZE) ? MOCK_CMD_CHUNK_SIZE : len;
+		memcpy(&out_buf[1], commands, chunk);
+		mock_i2c_write(dev, out_buf, chunk + 1);
+		commands = commands + chunk;
+		len = len - chunk;
+	}
+}
+
+void i2c_write_data(SSD1306_t * dev, const uint8_t * data, int len)
+{
+	uint8_t out_buf[1 + 8 * 128];
+	out_buf[0] = OLED_CONTROL_BYTE_DATA_STREAM;
+	while (len > 0) {
+		int chunk = (len > 8 * 128) ? 8 * 128 : len;
+		memcpy(&out_buf[1], data, chunk);
+		mock_i2c_write(dev, out_buf, chunk + 1);
+		data = data + chunk;
+		len = len - chunk;
+	}
+}
+
+static void mock_wait_idle(SSD1306_t * dev)
+{
+}
+
+static const ssd1306_transport_t mock_i2c_transport = {
+	.init = i2c_init,
+	.write_cmds = i2c_write_commands,
+	.write_data = i2c_write_data,
+	.write_region = i2c_display_image,
+	.flush = i2c_display_frame,
+	.wait = mock_wait_idle,
+	.notify = NULL,
+};
+
+// SPI, one transaction per D/C change like ssd1306_spi.c
+
+void spi_clock_speed(int speed)
+{
+}
+
+void spi_master_init(SSD1306_t * dev, int16_t mosi, int16_t sclk, int16_t cs, int16_t dc, int16_t reset)
+{
+	spi_device_add(dev, cs, dc, reset);
+	ESP_LOGI(TAG, "Mock SPI transport");
+}
+
+void spi_device_add(SSD1306_t * dev, int16_t cs, int16_t dc, int16_t reset)
+{
+	mock_attach(dev);
+	dev->_ops = &mock_spi_transport;
+	dev->_dc = dc;
+	dev->_address = SPI_ADDRESS;
+	dev->_flip = false;
+}
+
+bool spi_master_write_byte(spi_device_handle_t SPIHandle, const uint8_t* Data, size_t DataLength )
+{
+	return true;
+}
+
+bool spi_master_write_commands(SSD1306_t * dev, const uint8_t * Commands, size_t DataLength )
+{
+	mock_spi_write(dev, 0, Commands, DataLength);
+	return true;
+}
+
+bool spi_master_write_command(SSD1306_t * dev, uint8_t Command )
+{
+	return spi_master_write_commands(dev, &Command, 1);
+}
+
+bool spi_master_write_data(SSD1306_t * dev, const uint8_t* Data, size_t DataLength )
+{
+	mock_spi_write(dev, 1, Data, DataLength);
+	return true;
+}
+
+void spi_init(SSD1306_t * dev, int width, int height)
+{
+	mock_panel_init(dev, width, height);
+	uint8_t commands[32];
+	int len = mock_init_commands(dev, commands);
+	spi_master_write_commands(dev, commands, len);
+}
+
+void spi_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * images, int width)
+{
+	if (page >= dev->_pages) return;
+	if (seg >= dev->_width) return;
+	uint8_t commands[8];
+	int len = mock_image_commands(dev, page, seg, commands);
+	spi_master_write_commands(dev, commands, len);
+	spi_master_write_data(dev, images, width);
+}
+
+void spi_display_frame(SSD1306_t * dev, const PAGE_t * pages)
+{
+	uint8_t commands[8];
+	int len = mock_frame_commands(dev, commands);
+	spi_master_write_commands(dev, commands, len);
+	uint8_t data[8 * 128];
+	len = mock_frame_data(dev, pages, data);
+	spi_master_write_data(dev, data, len);
+}
+
+void spi_wait_idle(SSD1306_t * dev)
+{
+}
+
+static void mock_spi_write_cmds(SSD1306_t * dev, const uint8_t * commands, int len)
+{
+	spi_master_write_commands(dev, commands, len);
+}
+
+static void mock_spi_write_data(SSD1306_t * dev, const uint8_t * data, int len)
+{
+	spi_master_write_data(dev, data, len);
+}
+
+static const ssd1306_transport_t mock_spi_transport = {
+	.init = spi_init,
+	.write_cmds = mock_spi_write_cmds,
+	.write_data = mock_spi_write_data,
+	.write_region = spi_display_image,
+	.flush = spi_display_frame,
+	.wait = spi_wait_idle,
+	.notify = NULL,
+};
+
+
+// Inspection, every call takes the device whose panel is looked at
+
+// Free the emulated panel, the device has to be added to a bus again before it is used
+void ssd1306_mock_delete(SSD1306_t * dev)
+{
+	free(dev->_mock);
+	dev->_mock = NULL;
+}
+
+void ssd1306_mock_reset_stats(SSD1306_t * dev)
+{
+	memset(&dev->_mock->stats, 0, sizeof(ssd1306_bus_stats_t));
+}
+
+void ssd1306_mock_get_stats(SSD1306_t * dev, ssd1306_bus_stats_t * stats)
+{
+	*stats = dev->_mock->stats;
+}
+
+// Pixel as seen on the panel, with segment remap, COM scan direction and start line applied.
+// Modules are wired so that A1 and C8 show GRAM upright.
+bool ssd1306_mock_get_pixel(SSD1306_t * dev, int xpos, int ypos)
+{
+	const mock_panel_t * panel = dev->_mock;
+	int rows = panel->mux + 1;
+	if (xpos < 0 || xpos >= MOCK_COLUMNS || ypos < 0 || ypos >= rows) return false;
+	if (!panel->displayOn) return false;
+	int column = panel->segRemap ? xpos : MOCK_COLUMNS - 1 - xpos;
+	int com = panel->comRemap ? ypos : rows - 1 - ypos;
+	int row = (com + panel->startLine) % 64;
+	bool on = (panel->gram[row / 8][column] >> (row % 8)) & 0x01;
+	return on != panel->inverted;
+}
+
+const uint8_t * ssd1306_mock_get_gram(SSD1306_t * dev, int page)
+{
+	if (page < 0 || page >= MOCK_PAGES) return NULL;
+	return dev->_mock->gram[page];
+}
+
+int ssd1306_mock_get_contrast(SSD1306_t * dev)
+{
+	return dev->_mock->contrast;
+}
+
+// Write what the panel shows as a plain PBM image
+esp_err_t ssd1306_mock_dump_pbm(SSD1306_t * dev, const char * path)
+{
+	FILE * fp = fopen(path, "w");
+	if (fp == NULL) {
+		ESP_LOGE(TAG, "Could not open %s", path);
+		return ESP_FAIL;
+	}
+	int rows = dev->_mock->mux + 1;
+	fprintf(fp, "P1\n%d %d\n", MOCK_COLUMNS, rows);
+	for (int ypos=0; ypos<rows; ypos++) {
+		for (int xpos=0; xpos<MOCK_COLUMNS; xpos++) {
+			fputc(ssd1306_mock_get_pixel(dev, xpos, ypos) ? '1' : '0', fp);
+			fputc((xpos == MOCK_COLUMNS - 1) ? '\n' : ' ', fp);
+		}
+	}
+	fclose(fp);
+	return ESP_OK;
+}
@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ssd1306_sched.h"
+
+void ssd1306_sched_init(ssd1306_sched_t * sched, int max_fps)
+{
+	memset(sched, 0, sizeof(ssd1306_sched_t));
+	sched->_fps = (max_fps < 1) ? 1 : max_fps;
+}
+
+esp_err_t ssd1306_sched_add(ssd1306_sched_t * sched, SSD1306_t * dev)
+{
+	if (sched->_count == SSD1306_SCHED_PANELS) return ESP_ERR_NO_MEM;
+	sched->_panels[sched->_count] = dev;
+	sched->_nextPage[sched->_count] = 0;
+	sched->_count++;
+	int frame = dev->_pages * (dev->_width + SSD1306_SCHED_SLICE_OVERHEAD);
+	if (frame > sched->_frame) sched->_frame = frame;
+	sched->_tokens = sched->_frame;
+	return ESP_OK;
+}
+
+// Next dirty page of a panel, starting at the page after its last slice. -1 if it is in sync.
+static int sched_dirty_page(ssd1306_sched_t * sched, int panel)
+{
+	SSD1306_t * dev = sched->_panels[panel];
+	for (int i = 0; i < dev->_pages; i++) {
+		int page = (sched->_nextPage[panel] + i) % dev->_pages;
+		if (ssd1306_get_dirty(dev, page) > 0) return page;
+	}
+	return -1;
+}
+
+// Send dirty pages of all panels in turn until they are in sync or the budget is spent.
+// Returns the bytes still waiting, the next run goes on where this one stopped.
+int ssd1306_sched_run(ssd1306_sched_t * sched)
+{
+	if (sched->_count == 0) return 0;
+	int64_t now = esp_timer_get_time();
+	if (sched->_last != 0) {
+		int64_t refill = (now - sched->_last) * sched->_fps * sched->_frame / 1000000;
+		if (refill > sched->_frame - sched->_tokens) refill = sched->_frame - sched->_tokens;
+		sched->_tokens = sched->_tokens + refill;
+	}
+	sched->_last = now;
+
+	int sent = 0;
+	int clean = 0; // Panels in a row without a dirty page
+	while (clean < sched->_count) {
+		int panel = sched->_next;
+		int page = sched_dirty_page(sched, panel);
+		if (page < 0) {
+			clean++;
+			sched->_next = (panel + 1) % sched->_count;
+			continue;
+		}
+		SSD1306_t * dev = sched->_panels[panel];
+		// A slice never costs more than a full budget, so waiting always helps
+		int cost = ssd1306_get_dirty(dev, page) + SSD1306_SCHED_SLICE_OVERHEAD;
+		if (cost > sched->_tokens) break;
+		sched->_tokens = sched->_tokens - cost;
+		sent = sent + ssd1306_flush_page(dev, page);
+		sched->_nextPage[panel] = (page + 1) % dev->_pages;
+		sched->_next = (panel + 1) % sched->_count;
+		clean = 0;
+	}
+
+	int waiting = 0;
+	for (int panel = 0; panel < sched->_count; panel++) {
+		SSD1306_t * dev = sched->_panels[panel];
+		for (int page = 0; page < dev->_pages; page++) {
+			waiting = waiting + ssd1306_get_dirty(dev, page);
+		}
+	}
+	ESP_LOGD(__FUNCTION__, "sent=%d waiting=%d tokens=%d", sent, waiting, sched->_tokens);
+	return waiting;
+}
@@ -0,0 +1,39 @@
+#ifndef MAIN_SSD1306_SCHED_H_
+#define MAIN_SSD1306_SCHED_H_
+
+#include "ssd1306.h"
+
+// Flush scheduler for several panels on one bus. Every run sends the dirty
+// span of one page per panel in turn, so no panel waits for a whole frame of
+// another one, and stops once the shared byte budget is spent. The budget is
+// max_fps full frames of the largest panel per second, whatever the number of
+// panels, and the bus is released after every page for other devices.
+
+#define SSD1306_SCHED_PANELS 4
+#define SSD1306_SCHED_SLICE_OVERHEAD 11 // Address setup bytes counted per page write
+
+typedef struct {
+	SSD1306_t * _panels[SSD1306_SCHED_PANELS];
+	int _nextPage[SSD1306_SCHED_PANELS]; // Page the next slice of a panel starts looking at
+	int _count;
+	int _next; // Panel of the next slice
+	int _fps;
+	int _frame; // Bytes of a full frame of the largest panel, also the most the budget holds
+	int _tokens; // Bytes that may be sent now
+	int64_t _last; // Time of the last refill
+} ssd1306_sched_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+void ssd1306_sched_init(ssd1306_sched_t * sched, int max_fps);
+esp_err_t ssd1306_sched_add(ssd1306_sched_t * sched, SSD1306_t * dev);
+int ssd1306_sched_run(ssd1306_sched_t * sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_SSD1306_SCHED_H_ */
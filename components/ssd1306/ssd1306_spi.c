@@ -4,6 +4,8 @@
 #include "freertos/task.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "esp_heap_caps.h"
+#include "esp_attr.h"
 #include "esp_log.h"
 
 #include "ssd1306.h"
@@ -24,6 +26,109 @@
 
 int clock_speed_hz = SPI_DEFAULT_FREQUENCY;
 
+#define SPI_XFER_BUFFER_SIZE (8 * 128)
+#define SPI_QUEUE_SIZE 8 // Transactions in flight, an image write uses two
+#define SPI_TXDATA_SIZE 4 // Transfers up to this size are stored in the transaction itself
+#define SPI_DMA_ALIGN 4 // spi_master copies DMA buffers that are not word aligned in address and length
+#define SPI_ALIGN_UP(n) (((n) + SPI_DMA_ALIGN - 1) & ~(SPI_DMA_ALIGN - 1))
+
+// The D/C pin and level travel in the user field of each transaction, see spi_pre_transfer_callback()
+#define SPI_TRANS_USER(dc, mode) ((void *)(intptr_t)(((dc) << 1) | (mode)))
+
+static const ssd1306_transport_t spi_transport;
+
+static void spi_alloc_xfer_buffer(SSD1306_t * dev)
+{
+	if (dev->_xfer_buf == NULL) {
+		dev->_xfer_buf = heap_caps_malloc(SPI_XFER_BUFFER_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+	}
+	if (dev->_spi_trans == NULL) {
+		dev->_spi_trans = heap_caps_calloc(SPI_QUEUE_SIZE, sizeof(spi_transaction_t), MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+	}
+	if (dev->_xfer_buf == NULL || dev->_spi_trans == NULL) {
+		ESP_LOGE(TAG, "Could not allocate transfer buffer");
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	dev->_spi_queued = 0;
+	dev->_xfer_used = 0;
+}
+
+// Runs in interrupt context right before a transaction starts
+static void IRAM_ATTR spi_pre_transfer_callback(spi_transaction_t *t)
+{
+	int user = (int)(intptr_t)t->user;
+	gpio_set_level(user >> 1, user & 1);
+}
+
+// Wait until every queued transaction is done, the transfer buffer is free afterwards
+void spi_wait_idle(SSD1306_t * dev)
+{
+	spi_transaction_t * t;
+	while (dev->_spi_queued > 0) {
+		esp_err_t ret = spi_device_get_trans_result(dev->_spi_device_handle, &t, portMAX_DELAY);
+		if (ret != ESP_OK) {
+			ESP_LOGE(TAG, "spi_device_get_trans_result=%d", ret);
+			break;
+		}
+		dev->_spi_queued--;
+	}
+	dev->_spi_queued = 0;
+	dev->_xfer_used = 0;
+}
+
+// Reserve transaction slots and transfer buffer space, waiting for the queue to drain if either is short.
+// Reservations are rounded up to whole words so every reserved buffer starts word aligned
+static uint8_t * spi_reserve(SSD1306_t * dev, int slots, int length)
+{
+	length = SPI_ALIGN_UP(length);
+	if (dev->_spi_queued + slots > SPI_QUEUE_SIZE || dev->_xfer_used + length > SPI_XFER_BUFFER_SIZE) {
+		spi_wait_idle(dev);
+	}
+	uint8_t * buf = &dev->_xfer_buf[dev->_xfer_used];
+	dev->_xfer_used = dev->_xfer_used + length;
+	return buf;
+}
+
+// Queue a transfer from reserved transfer buffer space without waiting for it
+static void spi_queue_trans(SSD1306_t * dev, int mode, const uint8_t * data, size_t length)
+{
+	spi_transaction_t * t = &dev->_spi_trans[dev->_spi_queued];
+	memset(t, 0, sizeof(spi_transaction_t));
+	t->length = length * 8;
+	t->tx_buffer = data;
+	t->user = SPI_TRANS_USER(dev->_dc, mode);
+	esp_err_t ret = spi_device_queue_trans(dev->_spi_device_handle, t, portMAX_DELAY);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "spi_device_queue_trans=%d", ret);
+		return;
+	}
+	dev->_spi_queued++;
+}
+
+// Send a short transfer by polling, cheaper than an interrupt driven transaction for a few bytes
+static bool spi_poll_trans(SSD1306_t * dev, int mode, const uint8_t * data, size_t length)
+{
+	if (length == 0) return true;
+	// Polling and queued transactions can not be mixed
+	spi_wait_idle(dev);
+	spi_transaction_t t;
+	memset(&t, 0, sizeof(spi_transaction_t));
+	t.length = length * 8;
+	t.user = SPI_TRANS_USER(dev->_dc, mode);
+	if (length <= SPI_TXDATA_SIZE) {
+		t.flags = SPI_TRANS_USE_TXDATA;
+		memcpy(t.tx_data, data, length);
+	} else {
+		t.tx_buffer = data;
+	}
+	esp_err_t ret = spi_device_polling_transmit(dev->_spi_device_handle, &t);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "spi_device_polling_transmit=%d", ret);
+		return false;
+	}
+	return true;
+}
+
 void spi_clock_speed(int speed) {
 	ESP_LOGI(TAG, "SPI clock speed=%d MHz", speed/1000000);
 	clock_speed_hz = speed;
@@ -55,7 +160,7 @@ void spi_master_init(SSD1306_t * dev, int16_t mosi, int16_t sclk, int16_t cs, in
 		.sclk_io_num = sclk,
 		.quadwp_io_num = -1,
 		.quadhd_io_num = -1,
-		.max_transfer_sz = 0,
+		.max_transfer_sz = SPI_XFER_BUFFER_SIZE,
 		.flags = 0
 	};
 
@@ -69,17 +174,20 @@ void spi_master_init(SSD1306_t * dev, int16_t mosi, int16_t sclk, int16_t cs, in
 	//devcfg.clock_speed_hz = SPI_DEFAULT_FREQUENCY;
 	devcfg.clock_speed_hz = clock_speed_hz;
 	devcfg.spics_io_num = cs;
-	devcfg.queue_size = 1;
+	devcfg.queue_size = SPI_QUEUE_SIZE;
+	devcfg.pre_cb = spi_pre_transfer_callback;
 
 	spi_device_handle_t spi_device_handle;
 	ret = spi_bus_add_device( HOST_ID, &devcfg, &spi_device_handle);
 	ESP_LOGI(TAG, "spi_bus_add_device=%d",ret);
 	assert(ret==ESP_OK);
 
+	dev->_ops = &spi_transport;
 	dev->_dc = dc;
 	dev->_address = SPI_ADDRESS;
 	dev->_flip = false;
 	dev->_spi_device_handle = spi_device_handle;
+	spi_alloc_xfer_buffer(dev);
 }
 
 void spi_device_add(SSD1306_t * dev, int16_t cs, int16_t dc, int16_t reset)
@@ -110,7 +218,7 @@ void spi_device_add(SSD1306_t * dev, int16_t cs, int16_t dc, int16_t reset)
 		.sclk_io_num = sclk,
 		.quadwp_io_num = -1,
 		.quadhd_io_num = -1,
-		.max_transfer_sz = 0,
+		.max_transfer_sz = SPI_XFER_BUFFER_SIZE,
 		.flags = 0
 	};
 
@@ -125,17 +233,20 @@ void spi_device_add(SSD1306_t * dev, int16_t cs, int16_t dc, int16_t reset)
 	//devcfg.clock_speed_hz = SPI_DEFAULT_FREQUENCY;
 	devcfg.clock_speed_hz = clock_speed_hz;
 	devcfg.spics_io_num = cs;
-	devcfg.queue_size = 1;
+	devcfg.queue_size = SPI_QUEUE_SIZE;
+	devcfg.pre_cb = spi_pre_transfer_callback;
 
 	spi_device_handle_t spi_device_handle;
 	ret = spi_bus_add_device( HOST_ID, &devcfg, &spi_device_handle);
 	ESP_LOGI(TAG, "spi_bus_add_device=%d",ret);
 	assert(ret==ESP_OK);
 
+	dev->_ops = &spi_transport;
 	dev->_dc = dc;
 	dev->_address = SPI_ADDRESS;
 	dev->_flip = false;
 	dev->_spi_device_handle = spi_device_handle;
+	spi_alloc_xfer_buffer(dev);
 }
 
 
@@ -155,21 +266,17 @@ bool spi_master_write_byte(const spi_device_handle_t SPIHandle, const uint8_t* D
 
 bool spi_master_write_commands(SSD1306_t * dev, const uint8_t * Commands, size_t DataLength )
 {
-	gpio_set_level( dev->_dc, SPI_COMMAND_MODE );
-	return spi_master_write_byte( dev->_spi_device_handle, Commands, DataLength );
+	return spi_poll_trans( dev, SPI_COMMAND_MODE, Commands, DataLength );
 }
 
 bool spi_master_write_command(SSD1306_t * dev, uint8_t Command )
 {
-	static uint8_t CommandByte = 0;
-	CommandByte = Command;
-	return spi_master_write_commands( dev, &CommandByte, 1 );
+	return spi_poll_trans( dev, SPI_COMMAND_MODE, &Command, 1 );
 }
 
 bool spi_master_write_data(SSD1306_t * dev, const uint8_t* Data, size_t DataLength )
 {
-	gpio_set_level( dev->_dc, SPI_DATA_MODE );
-	return spi_master_write_byte( dev->_spi_device_handle, Data, DataLength );
+	return spi_poll_trans( dev, SPI_DATA_MODE, Data, DataLength );
 }
 
 
@@ -180,42 +287,48 @@ void spi_init(SSD1306_t * dev, int width, int height)
 	dev->_pages = 8;
 	if (dev->_height == 32) dev->_pages = 4;
 
-	spi_master_write_command(dev, OLED_CMD_DISPLAY_OFF);			// AE
-	spi_master_write_command(dev, OLED_CMD_SET_MUX_RATIO);			// A8
-	if (dev->_height == 64) spi_master_write_command(dev, 0x3F);
-	if (dev->_height == 32) spi_master_write_command(dev, 0x1F);
-	spi_master_write_command(dev, OLED_CMD_SET_DISPLAY_OFFSET);		// D3
-	spi_master_write_command(dev, 0x00);
-	spi_master_write_command(dev, OLED_CONTROL_BYTE_DATA_STREAM);	// 40
+	// Whole init sequence in one command transfer
+	uint8_t commands[32];
+	int index = 0;
+	commands[index++] = OLED_CMD_DISPLAY_OFF;			// AE
+	commands[index++] = OLED_CMD_SET_MUX_RATIO;			// A8
+	if (dev->_height == 64) commands[index++] = 0x3F;
+	if (dev->_height == 32) commands[index++] = 0x1F;
+	commands[index++] = OLED_CMD_SET_DISPLAY_OFFSET;	// D3
+	commands[index++] = 0x00;
+	commands[index++] = OLED_CONTROL_BYTE_DATA_STREAM;	// 40
+	// Flip is done by the panel, the internal buffer is always upright
 	if (dev->_flip) {
-		spi_master_write_command(dev, OLED_CMD_SET_SEGMENT_REMAP_0);	// A0
+		commands[index++] = OLED_CMD_SET_SEGMENT_REMAP_0;	// A0
+		commands[index++] = OLED_CMD_SET_COM_SCAN_NORMAL;	// C0
 	} else {
-		spi_master_write_command(dev, OLED_CMD_SET_SEGMENT_REMAP_1);	// A1
+		commands[index++] = OLED_CMD_SET_SEGMENT_REMAP_1;	// A1
+		commands[index++] = OLED_CMD_SET_COM_SCAN_MODE;		// C8
 	}
-	//spi_master_write_command(dev, OLED_CMD_SET_SEGMENT_REMAP);		// A1
-	spi_master_write_command(dev, OLED_CMD_SET_COM_SCAN_MODE);		// C8
-	spi_master_write_command(dev, OLED_CMD_SET_DISPLAY_CLK_DIV);	// D5
-	spi_master_write_command(dev, 0x80);
-	spi_master_write_command(dev, OLED_CMD_SET_COM_PIN_MAP);		// DA
-	if (dev->_height == 64) spi_master_write_command(dev, 0x12);
-	if (dev->_height == 32) spi_master_write_command(dev, 0x02);
-	spi_master_write_command(dev, OLED_CMD_SET_CONTRAST);			// 81
-	spi_master_write_command(dev, 0xFF);
-	spi_master_write_command(dev, OLED_CMD_DISPLAY_RAM);			// A4
-	spi_master_write_command(dev, OLED_CMD_SET_VCOMH_DESELCT);		// DB
-	spi_master_write_command(dev, 0x40);
-	spi_master_write_command(dev, OLED_CMD_SET_MEMORY_ADDR_MODE);	// 20
-	//spi_master_write_command(dev, OLED_CMD_SET_HORI_ADDR_MODE);	// 00
-	spi_master_write_command(dev, OLED_CMD_SET_PAGE_ADDR_MODE);		// 02
+	commands[index++] = OLED_CMD_SET_DISPLAY_CLK_DIV;	// D5
+	commands[index++] = 0x80;
+	commands[index++] = OLED_CMD_SET_COM_PIN_MAP;		// DA
+	if (dev->_height == 64) commands[index++] = 0x12;
+	if (dev->_height == 32) commands[index++] = 0x02;
+	commands[index++] = OLED_CMD_SET_CONTRAST;			// 81
+	commands[index++] = 0xFF;
+	commands[index++] = OLED_CMD_DISPLAY_RAM;			// A4
+	commands[index++] = OLED_CMD_SET_VCOMH_DESELCT;		// DB
+	commands[index++] = 0x40;
+	commands[index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;	// 20
+	//commands[index++] = OLED_CMD_SET_HORI_ADDR_MODE;	// 00
+	commands[index++] = OLED_CMD_SET_PAGE_ADDR_MODE;	// 02
 	// Set Lower Column Start Address for Page Addressing Mode
-	spi_master_write_command(dev, 0x00);
+	commands[index++] = 0x00;
 	// Set Higher Column Start Address for Page Addressing Mode
-	spi_master_write_command(dev, 0x10);
-	spi_master_write_command(dev, OLED_CMD_SET_CHARGE_PUMP);		// 8D
-	spi_master_write_command(dev, 0x14);
-	spi_master_write_command(dev, OLED_CMD_DEACTIVE_SCROLL);		// 2E
-	spi_master_write_command(dev, OLED_CMD_DISPLAY_NORMAL);			// A6
-	spi_master_write_command(dev, OLED_CMD_DISPLAY_ON);				// AF
+	commands[index++] = 0x10;
+	commands[index++] = OLED_CMD_SET_CHARGE_PUMP;		// 8D
+	commands[index++] = 0x14;
+	commands[index++] = OLED_CMD_DEACTIVE_SCROLL;		// 2E
+	commands[index++] = OLED_CMD_DISPLAY_NORMAL;		// A6
+	commands[index++] = OLED_CMD_DISPLAY_ON;			// AF
+	spi_master_write_commands(dev, commands, index);
+	dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
 }
 
 
@@ -228,90 +341,79 @@ void spi_display_image(SSD1306_t * dev, int page, int seg, const uint8_t * image
 	uint8_t columLow = _seg & 0x0F;
 	uint8_t columHigh = (_seg >> 4) & 0x0F;
 
-	int _page = page;
-	if (dev->_flip) {
-		_page = (dev->_pages - page) - 1;
+	if (width > dev->_width - seg) width = dev->_width - seg;
+	if (width <= 0) return;
+
+	// Commands and data are copied to the transfer buffer and queued back to back,
+	// the caller's buffer is free on return and the transfer runs in the background.
+	// Both parts start on a word boundary so the SPI driver can DMA them in place
+	uint8_t * commands = spi_reserve(dev, 2, 8 + width);
+	int index = 0;
+	if (dev->_addrMode != OLED_CMD_SET_PAGE_ADDR_MODE) {
+		// Back from a full frame transfer
+		commands[index++] = OLED_CMD_SET_MEMORY_ADDR_MODE;
+		commands[index++] = OLED_CMD_SET_PAGE_ADDR_MODE;
+		dev->_addrMode = OLED_CMD_SET_PAGE_ADDR_MODE;
 	}
-
 	// Set Lower Column Start Address for Page Addressing Mode, Higher Column Start Address for Page Addressing Mode and Page Start Address for Page Addressing Mode
-	uint8_t commands[3] = { 0x00 + columLow, 0x10 + columHigh, 0xB0 | _page };
-	spi_master_write_commands(dev, commands, 3);
-
-	spi_master_write_data(dev, images, width);
-
+	commands[index++] = 0x00 + columLow;
+	commands[index++] = 0x10 + columHigh;
+	commands[index++] = 0xB0 | page;
+	// Pad the command transfer to a whole word, the panel ignores NOPs
+	while (index % SPI_DMA_ALIGN) commands[index++] = OLED_CMD_NOP;
+	uint8_t * data = &commands[index];
+	memcpy(data, images, width);
+	dev->_xfer_used = dev->_xfer_used - (8 - index);
+
+	spi_queue_trans(dev, SPI_COMMAND_MODE, commands, index);
+	spi_queue_trans(dev, SPI_DATA_MODE, data, width);
 }
 
-void spi_contrast(SSD1306_t * dev, int contrast) {
-	int _contrast = contrast;
-	if (contrast < 0x0) _contrast = 0;
-	if (contrast > 0xFF) _contrast = 0xFF;
-
-	spi_master_write_command(dev, OLED_CMD_SET_CONTRAST);			// 81
-	spi_master_write_command(dev, _contrast);
-}
-
-void spi_hardware_scroll(SSD1306_t * dev, ssd1306_scroll_type_t scroll)
+// Stream all pages in one data transfer using horizontal addressing
+void spi_display_frame(SSD1306_t * dev, const PAGE_t * pages)
 {
-
-	if (scroll == SCROLL_RIGHT) {
-		spi_master_write_command(dev, OLED_CMD_HORIZONTAL_RIGHT);	// 26
-		spi_master_write_command(dev, 0x00); // Dummy byte
-		spi_master_write_command(dev, 0x00); // Define start page address
-		spi_master_write_command(dev, 0x07); // Frame frequency
-		spi_master_write_command(dev, 0x07); // Define end page address
-		spi_master_write_command(dev, 0x00); //
-		spi_master_write_command(dev, 0xFF); //
-		spi_master_write_command(dev, OLED_CMD_ACTIVE_SCROLL);		// 2F
-	} 
-
-	if (scroll == SCROLL_LEFT) {
-		spi_master_write_command(dev, OLED_CMD_HORIZONTAL_LEFT);	// 27
-		spi_master_write_command(dev, 0x00); // Dummy byte
-		spi_master_write_command(dev, 0x00); // Define start page address
-		spi_master_write_command(dev, 0x07); // Frame frequency
-		spi_master_write_command(dev, 0x07); // Define end page address
-		spi_master_write_command(dev, 0x00); //
-		spi_master_write_command(dev, 0xFF); //
-		spi_master_write_command(dev, OLED_CMD_ACTIVE_SCROLL);		// 2F
-	} 
-
-	if (scroll == SCROLL_DOWN) {
-		spi_master_write_command(dev, OLED_CMD_CONTINUOUS_SCROLL);	// 29
-		spi_master_write_command(dev, 0x00); // Dummy byte
-		spi_master_write_command(dev, 0x00); // Define start page address
-		spi_master_write_command(dev, 0x07); // Frame frequency
-		//spi_master_write_command(dev, 0x01); // Define end page address
-		spi_master_write_command(dev, 0x00); // Define end page address
-		spi_master_write_command(dev, 0x3F); // Vertical scrolling offset
-
-		spi_master_write_command(dev, OLED_CMD_VERTICAL);			// A3
-		spi_master_write_command(dev, 0x00);
-		if (dev->_height == 64)
-			spi_master_write_command(dev, 0x40);
-		if (dev->_height == 32)
-			spi_master_write_command(dev, 0x20);
-		spi_master_write_command(dev, OLED_CMD_ACTIVE_SCROLL);		// 2F
+	uint8_t commands[8] = {
+		OLED_CMD_SET_MEMORY_ADDR_MODE, OLED_CMD_SET_HORI_ADDR_MODE,
+		OLED_CMD_SET_COLUMN_RANGE, CONFIG_OFFSETX, CONFIG_OFFSETX + dev->_width - 1,
+		OLED_CMD_SET_PAGE_RANGE, 0x00, dev->_pages - 1
+	};
+	spi_master_write_commands(dev, commands, 8);
+	dev->_addrMode = OLED_CMD_SET_HORI_ADDR_MODE;
+
+	// The whole frame goes out as a single DMA transaction
+	uint8_t * data = spi_reserve(dev, 1, dev->_pages * dev->_width);
+	int index = 0;
+	for (int page=0; page<dev->_pages; page++) {
+		memcpy(&data[index], pages[page]._segs, dev->_width);
+		index = index + dev->_width;
 	}
+	spi_queue_trans(dev, SPI_DATA_MODE, data, index);
+}
 
-	if (scroll == SCROLL_UP) {
-		spi_master_write_command(dev, OLED_CMD_CONTINUOUS_SCROLL);	// 29
-		spi_master_write_command(dev, 0x00); // Dummy byte
-		spi_master_write_command(dev, 0x00); // Define start page address
-		spi_master_write_command(dev, 0x07); // Frame frequency
-		//spi_master_write_command(dev, 0x01); // Define end page address
-		spi_master_write_command(dev, 0x00); // Define end page address
-		spi_master_write_command(dev, 0x01); // Vertical scrolling offset
-
-		spi_master_write_command(dev, OLED_CMD_VERTICAL);			// A3
-		spi_master_write_command(dev, 0x00);
-		if (dev->_height == 64)
-			spi_master_write_command(dev, 0x40);
-		if (dev->_height == 32)
-			spi_master_write_command(dev, 0x20);
-		spi_master_write_command(dev, OLED_CMD_ACTIVE_SCROLL);		// 2F
-	}
+static void spi_write_cmds(SSD1306_t * dev, const uint8_t * commands, int len)
+{
+	spi_master_write_commands(dev, commands, len);
+}
 
-	if (scroll == SCROLL_STOP) {
-		spi_master_write_command(dev, OLED_CMD_DEACTIVE_SCROLL);	// 2E
+// GDDRAM bytes from the current address, queued from the transfer buffer
+static void spi_write_data(SSD1306_t * dev, const uint8_t * data, int len)
+{
+	while (len > 0) {
+		int chunk = (len > SPI_XFER_BUFFER_SIZE) ? SPI_XFER_BUFFER_SIZE : len;
+		uint8_t * buf = spi_reserve(dev, 1, chunk);
+		memcpy(buf, data, chunk);
+		spi_queue_trans(dev, SPI_DATA_MODE, buf, chunk);
+		data = data + chunk;
+		len = len - chunk;
 	}
 }
+
+static const ssd1306_transport_t spi_transport = {
+	.init = spi_init,
+	.write_cmds = spi_write_cmds,
+	.write_data = spi_write_data,
+	.write_region = spi_display_image,
+	.flush = spi_display_frame,
+	.wait = spi_wait_idle,
+	.notify = NULL,
+};
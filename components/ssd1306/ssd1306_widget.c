@@ -0,0 +1,125 @@
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "esp_log.h"
+
+#include "ssd1306_widget.h"
+
+// Bar columns in GDDRAM format (bit 0 is the top row), rows 1 to 6 of the page
+#define BAR_EDGE 0x7E
+#define BAR_EMPTY 0x42
+#define BAR_FILLED 0x7E
+
+static const int32_t widget_scale[] = { 1, 10, 100, 1000, 10000 };
+
+static void widget_init(ssd1306_widget_t * widget, ssd1306_widget_type_t type, int page, int seg, int width)
+{
+	memset(widget, 0, sizeof(ssd1306_widget_t));
+	if (seg < 0) seg = 0;
+	if (seg > 127) seg = 127;
+	if (seg + width > 128) width = 128 - seg;
+	if (width < 0) width = 0;
+	widget->_type = type;
+	widget->_page = page;
+	widget->_seg = seg;
+	widget->_width = width;
+}
+
+// The widget area is on the panel, a widget placed off it is never drawn
+static bool widget_on_panel(SSD1306_t * dev, ssd1306_widget_t * widget)
+{
+	if (widget->_page < 0 || widget->_page >= dev->_pages) return false;
+	return widget->_width > 0 && widget->_seg + widget->_width <= dev->_width;
+}
+
+// Draw text into the widget area, blank padded to the widget width
+static void widget_draw_text(SSD1306_t * dev, ssd1306_widget_t * widget, const char * text)
+{
+	if (!widget_on_panel(dev, widget)) return;
+	uint8_t image[128];
+	memset(image, widget->_invert ? 0xFF : 0x00, widget->_width);
+	int len = strlen(text);
+	if (len > widget->_width / 8) len = widget->_width / 8;
+	ssd1306_render_text(dev, image, text, len, widget->_invert);
+	ssd1306_display_image(dev, widget->_page, widget->_seg, image, widget->_width);
+	widget->_drawn = true;
+}
+
+void ssd1306_widget_text_init(ssd1306_widget_t * widget, int page, int seg, int chars, bool invert)
+{
+	widget_init(widget, SSD1306_WIDGET_TEXT, page, seg, chars * 8);
+	widget->_invert = invert;
+}
+
+void ssd1306_widget_number_init(ssd1306_widget_t * widget, int page, int seg, int chars, const char * label, const char * unit, int decimals)
+{
+	widget_init(widget, SSD1306_WIDGET_NUMBER, page, seg, chars * 8);
+	widget->_label = label ? label : "";
+	widget->_unit = unit ? unit : "";
+	if (decimals < 0) decimals = 0;
+	if (decimals > 4) decimals = 4;
+	widget->_decimals = decimals;
+}
+
+void ssd1306_widget_bar_init(ssd1306_widget_t * widget, int page, int seg, int width, int32_t min, int32_t max)
+{
+	widget_init(widget, SSD1306_WIDGET_BAR, page, seg, width);
+	widget->_min = min;
+	widget->_max = (max > min) ? max : min + 1;
+}
+
+// Force a redraw on the next update, e.g. after the screen was cleared
+void ssd1306_widget_invalidate(ssd1306_widget_t * widget)
+{
+	widget->_drawn = false;
+}
+
+// Value as it is displayed, in units of the last shown digit. Equal keys render identically.
+int32_t ssd1306_widget_number_key(const ssd1306_widget_t * widget, float value)
+{
+	return lroundf(value * widget_scale[widget->_decimals]);
+}
+
+bool ssd1306_widget_set_text(SSD1306_t * dev, ssd1306_widget_t * widget, const char * text)
+{
+	if (widget->_drawn && strncmp(widget->_text, text, sizeof(widget->_text) - 1) == 0) return false;
+	strncpy(widget->_text, text, sizeof(widget->_text) - 1);
+	widget->_text[sizeof(widget->_text) - 1] = 0;
+	widget_draw_text(dev, widget, widget->_text);
+	return true;
+}
+
+bool ssd1306_widget_set_number(SSD1306_t * dev, ssd1306_widget_t * widget, float value)
+{
+	int32_t key = ssd1306_widget_number_key(widget, value);
+	if (widget->_drawn && key == widget->_shown) return false;
+	widget->_shown = key;
+	char text[32];
+	snprintf(text, sizeof(text), "%s%.*f%s", widget->_label, widget->_decimals,
+		(double)key / widget_scale[widget->_decimals], widget->_unit);
+	ESP_LOGD(__FUNCTION__, "page=%d text=[%s]", widget->_page, text);
+	widget_draw_text(dev, widget, text);
+	return true;
+}
+
+bool ssd1306_widget_set_bar(SSD1306_t * dev, ssd1306_widget_t * widget, int32_t value)
+{
+	if (widget->_width < 3 || !widget_on_panel(dev, widget)) return false;
+	int inner = widget->_width - 2;
+	if (value < widget->_min) value = widget->_min;
+	if (value > widget->_max) value = widget->_max;
+	// Only a change of the filled length is visible
+	int32_t filled = (int64_t)(value - widget->_min) * inner / (widget->_max - widget->_min);
+	if (widget->_drawn && filled == widget->_shown) return false;
+	widget->_shown = filled;
+
+	uint8_t image[128];
+	image[0] = BAR_EDGE;
+	memset(&image[1], BAR_FILLED, filled);
+	memset(&image[1 + filled], BAR_EMPTY, inner - filled);
+	image[widget->_width - 1] = BAR_EDGE;
+	ssd1306_display_image(dev, widget->_page, widget->_seg, image, widget->_width);
+	widget->_drawn = true;
+	return true;
+}
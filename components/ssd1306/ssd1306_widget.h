@@ -0,0 +1,50 @@
+#ifndef MAIN_SSD1306_WIDGET_H_
+#define MAIN_SSD1306_WIDGET_H_
+
+#include "ssd1306.h"
+
+// Retained widgets remember what they show and only draw when that changes.
+// All drawing goes through ssd1306_display_image(), so in deferred mode a
+// widget update is a RAM write and ssd1306_flush() sends it.
+
+typedef enum {
+	SSD1306_WIDGET_TEXT = 0,
+	SSD1306_WIDGET_NUMBER = 1,
+	SSD1306_WIDGET_BAR = 2
+} ssd1306_widget_type_t;
+
+typedef struct {
+	ssd1306_widget_type_t _type;
+	int _page;
+	int _seg;
+	int _width; // Segments covered, text and numbers are blank padded to it
+	bool _invert;
+	bool _drawn; // False until the first draw or after ssd1306_widget_invalidate()
+	const char * _label; // Number: text in front of the value
+	const char * _unit; // Number: text after the value
+	int _decimals; // Number: digits after the decimal point
+	int32_t _min; // Bar: value of an empty bar
+	int32_t _max; // Bar: value of a full bar
+	int32_t _shown; // Number: value in units of the last digit, bar: filled segments
+	char _text[17]; // Text: content shown
+} ssd1306_widget_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+void ssd1306_widget_text_init(ssd1306_widget_t * widget, int page, int seg, int chars, bool invert);
+void ssd1306_widget_number_init(ssd1306_widget_t * widget, int page, int seg, int chars, const char * label, const char * unit, int decimals);
+void ssd1306_widget_bar_init(ssd1306_widget_t * widget, int page, int seg, int width, int32_t min, int32_t max);
+void ssd1306_widget_invalidate(ssd1306_widget_t * widget);
+int32_t ssd1306_widget_number_key(const ssd1306_widget_t * widget, float value);
+bool ssd1306_widget_set_text(SSD1306_t * dev, ssd1306_widget_t * widget, const char * text);
+bool ssd1306_widget_set_number(SSD1306_t * dev, ssd1306_widget_t * widget, float value);
+bool ssd1306_widget_set_bar(SSD1306_t * dev, ssd1306_widget_t * widget, int32_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAIN_SSD1306_WIDGET_H_ */
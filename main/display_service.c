@@ -0,0 +1,557 @@
+#include "display_service.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "ssd1306.h"
+#include "ssd1306_widget.h"
+#include "ssd1306_font.h"
+#include "ssd1306_sched.h"
+
+#define TAG "Display"
+
+#define DISPLAY_QUEUE_LEN 16
+#define DISPLAY_LINES 8
+#define DISPLAY_LOG_LINES 8 ///< Event log lines kept, one screen
+
+typedef struct {
+    char text[DISPLAY_TEXT_LEN + 1];
+    bool invert;
+    bool pending; ///< Changed since the last render
+} display_line_t;
+
+static SSD1306_t display; ///< Panel and bus, only touched by the display tasks
+#if CONFIG_DISPLAY_DASH
+static SSD1306_t dash; ///< 128x32 dashboard panel on the same bus
+static bool dash_pending; ///< A dashboard value changed since the last render
+#endif
+static ssd1306_sched_t flush_sched; ///< Interleaves the flushes of all panels on the bus
+static QueueHandle_t display_queue = NULL;
+static SemaphoreHandle_t flush_idle = NULL; ///< Given while no task uses the panels or the bus
+static TaskHandle_t flush_task_handle = NULL;
+static display_line_t display_lines[DISPLAY_LINES];
+
+static ssd1306_widget_t display_fields[DISPLAY_FIELD_COUNT]; ///< Only touched by the display task
+static float field_values[DISPLAY_FIELD_COUNT];
+static bool field_pending[DISPLAY_FIELD_COUNT];
+// Last shown value submitted per field, lets display_number() skip the queue for unchanged values.
+// Shared by the producers and the display task, guarded by field_submitted_lock
+static int32_t field_submitted[DISPLAY_FIELD_COUNT];
+static bool field_submitted_valid[DISPLAY_FIELD_COUNT];
+static portMUX_TYPE field_submitted_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Event log ring, also kept while the status screen is shown
+static char log_lines[DISPLAY_LOG_LINES][DISPLAY_TEXT_LEN + 1];
+static int log_next = 0;
+static int log_count = 0;
+static bool console_active = false; ///< Event log on screen, the status screen is not rendered
+static uint8_t fade_target; ///< Contrast the running fade ends at
+
+static void display_task(void *pvParameter);
+static void display_flush_task(void *pvParameter);
+
+static void display_fields_init() {
+    ssd1306_widget_number_init(&display_fields[DISPLAY_FIELD_ANGLE], 0, 0, DISPLAY_TEXT_LEN, "Angle: ", "", 2);
+    ssd1306_widget_number_init(&display_fields[DISPLAY_FIELD_VOLTAGE], 3, 0, DISPLAY_TEXT_LEN, "", "V", 2);
+    ssd1306_widget_bar_init(&display_fields[DISPLAY_FIELD_BATTERY], 4, 0, 128, 0, 100);
+    // Static label, drawn once
+    strlcpy(display_lines[2].text, "Voltage:", sizeof(display_lines[2].text));
+    display_lines[2].pending = true;
+}
+
+static void display_service_cleanup() {
+    if (flush_task_handle != NULL) vTaskDelete(flush_task_handle);
+    if (display_queue != NULL) vQueueDelete(display_queue);
+    if (flush_idle != NULL) vSemaphoreDelete(flush_idle);
+    flush_task_handle = NULL;
+    display_queue = NULL;
+    flush_idle = NULL;
+    ssd1306_disable_back_buffer(&display);
+#if CONFIG_DISPLAY_DASH
+    ssd1306_disable_back_buffer(&dash);
+#endif
+}
+
+#if CONFIG_DISPLAY_DASH
+/**
+ * @brief Add the dashboard panel at its own address on the bus of the main panel.
+ */
+static esp_err_t display_dash_start() {
+#if SSD1306_I2C_MASTER
+    dash._i2c_bus_handle = display._i2c_bus_handle;
+#endif
+    i2c_device_add(&dash, display._i2c_num, -1, CONFIG_DISPLAY_DASH_ADDRESS);
+    dash._flip = display._flip;
+    ssd1306_init(&dash, 128, 32);
+    ssd1306_set_deferred(&dash, true);
+    ssd1306_show_buffer(&dash);
+    esp_err_t err = ssd1306_enable_back_buffer(&dash);
+    if (err != ESP_OK) return err;
+    dash_pending = true;
+    return ssd1306_sched_add(&flush_sched, &dash);
+}
+#endif
+
+/**
+ * @brief Initialize the display and start the display service task.
+ *
+ * The service owns the SSD1306 and the I2C bus. Other tasks only submit
+ * requests through the queue and never block on the bus. Frames are
+ * composed in the back buffer by the display task and sent from the
+ * front buffer by the flush task, so the next frame is rendered while
+ * the previous one is still on the bus. With CONFIG_DISPLAY_DASH a second
+ * 128x32 panel shares the bus and the frame rate budget.
+ */
+esp_err_t display_service_start() {
+    if (display_queue != NULL) return ESP_ERR_INVALID_STATE;
+
+    i2c_master_init(&display, CONFIG_PIN_I2C_SDA, CONFIG_PIN_I2C_SCL, -1);
+    display._flip = true;
+    ssd1306_init(&display, 128, 64);
+    ssd1306_set_deferred(&display, true);
+    ssd1306_contrast(&display, 0xff);
+    // Blank the panel, GRAM content is undefined after power-up
+    ssd1306_show_buffer(&display);
+    esp_err_t err = ssd1306_enable_back_buffer(&display);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate display back buffer");
+        return err;
+    }
+    ssd1306_sched_init(&flush_sched, CONFIG_DISPLAY_MAX_FPS);
+    ssd1306_sched_add(&flush_sched, &display);
+#if CONFIG_DISPLAY_DASH
+    err = display_dash_start();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start dashboard panel");
+        display_service_cleanup();
+        return err;
+    }
+#endif
+    display_fields_init();
+
+    display_queue = xQueueCreate(DISPLAY_QUEUE_LEN, sizeof(display_cmd_t));
+    flush_idle = xSemaphoreCreateBinary();
+    if (display_queue == NULL || flush_idle == NULL) {
+        ESP_LOGE(TAG, "Failed to create display queue");
+        display_service_cleanup();
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreGive(flush_idle);
+    if (xTaskCreate(display_flush_task, "display_flush", 4096, NULL, 3, &flush_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create display flush task");
+        display_service_cleanup();
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(display_task, "display_task", 4096, NULL, 3, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create display task");
+        display_service_cleanup();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Queue a draw request without waiting for the display.
+ *
+ * @return ESP_ERR_TIMEOUT if the queue is full, the request is dropped.
+ */
+esp_err_t display_submit(const display_cmd_t *cmd) {
+    if (display_queue == NULL) return ESP_ERR_INVALID_STATE;
+    if (xQueueSend(display_queue, cmd, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Display queue full, request %d dropped", cmd->type);
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Replace the text of a line, the rest of the line is blanked.
+ */
+esp_err_t display_text(uint8_t page, const char *text, bool invert) {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_TEXT,
+        .page = page,
+        .invert = invert
+    };
+    strlcpy(cmd.text, text, sizeof(cmd.text));
+    return display_submit(&cmd);
+}
+
+esp_err_t display_clear_line(uint8_t page) {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_CLEAR_LINE,
+        .page = page
+    };
+    return display_submit(&cmd);
+}
+
+esp_err_t display_clear() {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_CLEAR
+    };
+    return display_submit(&cmd);
+}
+
+esp_err_t display_contrast(uint8_t contrast) {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_CONTRAST,
+        .value = contrast
+    };
+    return display_submit(&cmd);
+}
+
+/**
+ * @brief Ramp the contrast to a new value in the background.
+ *
+ * The ramp runs from a timer and returns right away. A fade to 0 switches
+ * the panel off at the end, any other fade switches it on first. Frames
+ * wait until the fade is done.
+ */
+esp_err_t display_fade(uint8_t contrast, uint16_t duration_ms) {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_FADE,
+        .value = contrast,
+        .duration = duration_ms
+    };
+    return display_submit(&cmd);
+}
+
+/**
+ * @brief Update a numeric field of the status screen.
+ *
+ * Values that would look the same as the last submitted one are dropped
+ * here, before they reach the queue.
+ */
+esp_err_t display_number(display_field_t field, float value) {
+    if (field >= DISPLAY_FIELD_COUNT) return ESP_ERR_INVALID_ARG;
+    int32_t key = ssd1306_widget_number_key(&display_fields[field], value);
+    // Claim the value before queueing it, a clear handled in between then only costs a redundant redraw
+    portENTER_CRITICAL(&field_submitted_lock);
+    if (field_submitted_valid[field] && field_submitted[field] == key) {
+        portEXIT_CRITICAL(&field_submitted_lock);
+        return ESP_OK;
+    }
+    field_submitted[field] = key;
+    field_submitted_valid[field] = true;
+    portEXIT_CRITICAL(&field_submitted_lock);
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_NUMBER,
+        .field = field,
+        .number = value
+    };
+    esp_err_t err = display_submit(&cmd);
+    if (err != ESP_OK) {
+        portENTER_CRITICAL(&field_submitted_lock);
+        field_submitted_valid[field] = false;
+        portEXIT_CRITICAL(&field_submitted_lock);
+    }
+    return err;
+}
+
+/**
+ * @brief Add a line to the event log, shown at the bottom while the console is on.
+ */
+esp_err_t display_log(const char *text) {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_LOG
+    };
+    strlcpy(cmd.text, text, sizeof(cmd.text));
+    return display_submit(&cmd);
+}
+
+/**
+ * @brief Switch between the event log console and the status screen.
+ *
+ * The console scrolls in hardware, a new log line costs one page write
+ * however many lines are shown. Switching back redraws the status screen.
+ */
+esp_err_t display_console(bool enable) {
+    display_cmd_t cmd = {
+        .type = DISPLAY_CMD_CONSOLE,
+        .value = enable
+    };
+    return display_submit(&cmd);
+}
+
+/**
+ * @brief Copy the frame the main panel shows, for mirrors of the display.
+ *
+ * Never waits for the flush task, so it can be called from any task.
+ *
+ * @param frame DISPLAY_FRAME_SIZE bytes, one per column and page, LSB on top.
+ * @return ESP_ERR_TIMEOUT if the panel is busy (e.g. fading), try again later.
+ */
+esp_err_t display_get_frame(uint8_t *frame) {
+    if (flush_idle == NULL) return ESP_ERR_INVALID_STATE;
+    if (xSemaphoreTake(flush_idle, 0) != pdTRUE) return ESP_ERR_TIMEOUT;
+    ssd1306_get_shown_buffer(&display, frame);
+    xSemaphoreGive(flush_idle);
+    return ESP_OK;
+}
+
+/**
+ * @brief Frames per second the main panel actually receives.
+ *
+ * A frame counts once the flush scheduler has sent every changed page of it,
+ * averaged over one second. 0 until a second of frames has been sent.
+ */
+float display_get_fps() {
+    return ssd1306_get_fps(&display);
+}
+
+static void display_set_line(uint8_t page, const char *text, bool invert) {
+    if (page >= DISPLAY_LINES) return;
+    display_line_t *line = &display_lines[page];
+    // Coalesce: an update that does not change the line is dropped here
+    if (line->invert == invert && strncmp(line->text, text, DISPLAY_TEXT_LEN) == 0) return;
+    strlcpy(line->text, text, sizeof(line->text));
+    line->invert = invert;
+    line->pending = true;
+}
+
+static void display_add_log(const char *text) {
+    strlcpy(log_lines[log_next], text, sizeof(log_lines[log_next]));
+    log_next = (log_next + 1) % DISPLAY_LOG_LINES;
+    if (log_count < DISPLAY_LOG_LINES) log_count++;
+    if (!console_active) return;
+    xSemaphoreTake(flush_idle, portMAX_DELAY);
+    ssd1306_console_print(&display, text, strlen(text), false);
+    xSemaphoreGive(flush_idle);
+}
+
+static void display_set_console(bool enable) {
+    if (enable == console_active) return;
+    // Wait for the bus, the flush task may be sending a frame
+    xSemaphoreTake(flush_idle, portMAX_DELAY);
+    if (enable) {
+        esp_err_t err = ssd1306_console_enable(&display);
+        if (err != ESP_OK) {
+            xSemaphoreGive(flush_idle);
+            ESP_LOGW(TAG, "Console not supported on this panel");
+            return;
+        }
+        // Oldest line first
+        for (int i = 0; i < log_count; i++) {
+            const char *text = log_lines[(log_next - log_count + i + DISPLAY_LOG_LINES) % DISPLAY_LOG_LINES];
+            ssd1306_console_print(&display, text, strlen(text), false);
+        }
+    } else {
+        ssd1306_console_disable(&display);
+    }
+    xSemaphoreGive(flush_idle);
+    console_active = enable;
+    if (enable) return;
+    // The console overwrote the status screen, draw all of it again
+    for (int page = 0; page < DISPLAY_LINES; page++) {
+        display_lines[page].pending = true;
+    }
+    for (int field = 0; field < DISPLAY_FIELD_COUNT; field++) {
+        if (!display_fields[field]._drawn) continue;
+        ssd1306_widget_invalidate(&display_fields[field]);
+        field_pending[field] = true;
+    }
+}
+
+// Runs in the SSD1306 fade task once the ramp is done
+static void display_fade_done(void *arg) {
+    if (fade_target == 0) {
+        ssd1306_display_power(&display, false);
+#if CONFIG_DISPLAY_DASH
+        ssd1306_display_power(&dash, false);
+#endif
+    }
+    xSemaphoreGive(flush_idle);
+}
+
+static void display_start_fade(uint8_t contrast, uint16_t duration_ms) {
+    // The fade owns the bus until display_fade_done() gives it back
+    xSemaphoreTake(flush_idle, portMAX_DELAY);
+    if (contrast > 0) {
+        ssd1306_display_power(&display, true);
+#if CONFIG_DISPLAY_DASH
+        ssd1306_display_power(&dash, true);
+#endif
+    }
+    fade_target = contrast;
+    esp_err_t err = ssd1306_fade_start(&display, SSD1306_FADE_CONTRAST, contrast, duration_ms, display_fade_done, NULL);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start display fade: %s", esp_err_to_name(err));
+        xSemaphoreGive(flush_idle);
+    }
+}
+
+static void display_apply(const display_cmd_t *cmd) {
+    switch (cmd->type) {
+        case DISPLAY_CMD_TEXT:
+            display_set_line(cmd->page, cmd->text, cmd->invert);
+            break;
+        case DISPLAY_CMD_CLEAR_LINE:
+            display_set_line(cmd->page, "", false);
+            break;
+        case DISPLAY_CMD_CLEAR:
+            for (int page = 0; page < DISPLAY_LINES; page++) {
+                display_set_line(page, "", false);
+            }
+            // Fields show up again with their next value
+            portENTER_CRITICAL(&field_submitted_lock);
+            for (int field = 0; field < DISPLAY_FIELD_COUNT; field++) {
+                field_submitted_valid[field] = false;
+            }
+            portEXIT_CRITICAL(&field_submitted_lock);
+            for (int field = 0; field < DISPLAY_FIELD_COUNT; field++) {
+                ssd1306_widget_invalidate(&display_fields[field]);
+                field_pending[field] = false;
+            }
+            break;
+        case DISPLAY_CMD_CONTRAST:
+            // Wait for the bus, the flush task may be sending a frame
+            xSemaphoreTake(flush_idle, portMAX_DELAY);
+            ssd1306_contrast(&display, cmd->value);
+            xSemaphoreGive(flush_idle);
+            break;
+        case DISPLAY_CMD_NUMBER:
+            if (cmd->field >= DISPLAY_FIELD_COUNT) break;
+            field_values[cmd->field] = cmd->number;
+            field_pending[cmd->field] = true;
+#if CONFIG_DISPLAY_DASH
+            if (cmd->field != DISPLAY_FIELD_BATTERY) dash_pending = true;
+#endif
+            break;
+        case DISPLAY_CMD_LOG:
+            display_add_log(cmd->text);
+            break;
+        case DISPLAY_CMD_CONSOLE:
+            display_set_console(cmd->value);
+            break;
+        case DISPLAY_CMD_FADE:
+            display_start_fade(cmd->value, cmd->duration);
+            break;
+        default:
+            ESP_LOGW(TAG, "Unknown display request: %d", cmd->type);
+    }
+}
+
+/**
+ * @brief Draw all changed lines and fields into the back buffer.
+ *
+ * The framebuffer tracks which columns actually changed, so redrawing a
+ * line with mostly the same text only sends the differing glyphs. Fields
+ * are retained widgets and draw nothing unless the shown value changed.
+ */
+static void display_render() {
+    uint8_t image[128];
+    int width = ssd1306_get_width(&display);
+    for (int page = 0; page < ssd1306_get_pages(&display) && page < DISPLAY_LINES; page++) {
+        display_line_t *line = &display_lines[page];
+        if (!line->pending) continue;
+        line->pending = false;
+        // Text plus blank padding, written as one span
+        memset(image, 0, sizeof(image));
+        ssd1306_render_text(&display, image, line->text, strlen(line->text), line->invert);
+        ssd1306_display_image(&display, page, 0, image, width);
+        // The line covered any field on it, draw those again
+        for (int field = 0; field < DISPLAY_FIELD_COUNT; field++) {
+            ssd1306_widget_t *widget = &display_fields[field];
+            if (widget->_page != page || !widget->_drawn) continue;
+            ssd1306_widget_invalidate(widget);
+            field_pending[field] = true;
+        }
+    }
+    // Fields after lines, so a blanked line does not hide a field drawn on it
+    for (int field = 0; field < DISPLAY_FIELD_COUNT; field++) {
+        if (!field_pending[field]) continue;
+        field_pending[field] = false;
+        ssd1306_widget_t *widget = &display_fields[field];
+        if (widget->_type == SSD1306_WIDGET_BAR) {
+            ssd1306_widget_set_bar(&display, widget, lroundf(field_values[field]));
+        } else {
+            ssd1306_widget_set_number(&display, widget, field_values[field]);
+        }
+    }
+}
+
+#if CONFIG_DISPLAY_DASH
+static void display_dash_line(int ypos, const char *text) {
+    int width = _ssd1306_font_text(&dash, 0, ypos, text, strlen(text), 2, true, false);
+    // Blank what a longer previous text left
+    _ssd1306_fill_rect(&dash, width, ypos, ssd1306_get_width(&dash) - width, 16, true);
+}
+
+/**
+ * @brief Draw the voltage and the angle in 16 pixel digits into the dashboard back buffer.
+ */
+static void display_render_dash() {
+    if (!dash_pending) return;
+    dash_pending = false;
+    char text[DISPLAY_TEXT_LEN + 1];
+    snprintf(text, sizeof(text), "%.2fV", field_values[DISPLAY_FIELD_VOLTAGE]);
+    display_dash_line(0, text);
+    snprintf(text, sizeof(text), "%.0f deg", field_values[DISPLAY_FIELD_ANGLE]);
+    display_dash_line(16, text);
+}
+#endif
+
+static void display_task(void *pvParameter) {
+    TickType_t frame_ticks = pdMS_TO_TICKS(1000 / CONFIG_DISPLAY_MAX_FPS);
+    if (frame_ticks == 0) frame_ticks = 1;
+    TickType_t last_frame = xTaskGetTickCount() - frame_ticks;
+    display_cmd_t cmd;
+
+    while (1) {
+        // Sleep until something changes
+        if (xQueueReceive(display_queue, &cmd, portMAX_DELAY) != pdTRUE) continue;
+        display_apply(&cmd);
+
+        // Collect further requests until the next frame is due
+        TickType_t elapsed;
+        while ((elapsed = xTaskGetTickCount() - last_frame) < frame_ticks) {
+            if (xQueueReceive(display_queue, &cmd, frame_ticks - elapsed) == pdTRUE) {
+                display_apply(&cmd);
+            }
+        }
+        while (xQueueReceive(display_queue, &cmd, 0) == pdTRUE) {
+            display_apply(&cmd);
+        }
+
+        // The console draws log lines as they arrive, the status screen waits
+        if (!console_active) display_render();
+#if CONFIG_DISPLAY_DASH
+        display_render_dash();
+#endif
+
+        // Compose off-screen, then publish between two flush runs
+        xSemaphoreTake(flush_idle, portMAX_DELAY);
+        ssd1306_swap_buffers(&display);
+#if CONFIG_DISPLAY_DASH
+        ssd1306_swap_buffers(&dash);
+#endif
+        xSemaphoreGive(flush_idle);
+        xTaskNotifyGive(flush_task_handle);
+        last_frame = xTaskGetTickCount();
+    }
+}
+
+/**
+ * @brief Send published frames of all panels, runs concurrently with rendering.
+ *
+ * The scheduler sends one page per panel in turn and stops once the frame
+ * rate budget is spent, pages left over go out on the next frame tick. The
+ * bus is released after every page, other I2C devices never wait for more
+ * than one page write.
+ */
+static void display_flush_task(void *pvParameter) {
+    TickType_t frame_ticks = pdMS_TO_TICKS(1000 / CONFIG_DISPLAY_MAX_FPS);
+    if (frame_ticks == 0) frame_ticks = 1;
+    int waiting = 0;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, (waiting > 0) ? frame_ticks : portMAX_DELAY);
+        xSemaphoreTake(flush_idle, portMAX_DELAY);
+        waiting = ssd1306_sched_run(&flush_sched);
+        xSemaphoreGive(flush_idle);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef DISPLAY_SERVICE_H
+#define DISPLAY_SERVICE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define DISPLAY_TEXT_LEN 16 ///< Characters per text line
+#define DISPLAY_WIDTH 128
+#define DISPLAY_PAGES 8 ///< Rows of 8 pixels
+#define DISPLAY_FRAME_SIZE (DISPLAY_WIDTH * DISPLAY_PAGES) ///< Bytes of a frame, one per column and page
+
+// Draw requests handled by the display service
+typedef enum {
+    DISPLAY_CMD_NONE,
+    DISPLAY_CMD_TEXT,       ///< Replace the text of a line
+    DISPLAY_CMD_CLEAR_LINE, ///< Blank a line
+    DISPLAY_CMD_CLEAR,      ///< Blank the whole screen
+    DISPLAY_CMD_CONTRAST,   ///< Set panel contrast
+    DISPLAY_CMD_NUMBER,     ///< Update a numeric field
+    DISPLAY_CMD_LOG,        ///< Add a line to the event log
+    DISPLAY_CMD_CONSOLE,    ///< Show the event log instead of the status screen
+    DISPLAY_CMD_FADE        ///< Ramp the contrast in the background
+} display_cmd_type_t;
+
+// Numeric fields of the status screen, redrawn only when the shown value changes
+typedef enum {
+    DISPLAY_FIELD_ANGLE,    ///< Motor angle in degrees, line 0
+    DISPLAY_FIELD_VOLTAGE,  ///< Battery voltage, line 3
+    DISPLAY_FIELD_BATTERY,  ///< Battery charge bar in percent, line 4
+    DISPLAY_FIELD_COUNT
+} display_field_t;
+
+typedef struct {
+    uint8_t type;                       ///< display_cmd_type_t
+    uint8_t page;                       ///< Text line (0-7)
+    bool invert;                        ///< Draw the text inverted
+    uint8_t value;                      ///< Contrast value, console on (1) or off (0)
+    uint16_t duration;                  ///< Fade time in ms
+    uint8_t field;                      ///< display_field_t
+    float number;                       ///< Field value
+    char text[DISPLAY_TEXT_LEN + 1];    ///< Null terminated line text
+} display_cmd_t;
+
+esp_err_t display_service_start();
+esp_err_t display_submit(const display_cmd_t *cmd);
+esp_err_t display_text(uint8_t page, const char *text, bool invert);
+esp_err_t display_clear_line(uint8_t page);
+esp_err_t display_clear();
+esp_err_t display_contrast(uint8_t contrast);
+esp_err_t display_fade(uint8_t contrast, uint16_t duration_ms);
+esp_err_t display_number(display_field_t field, float value);
+esp_err_t display_log(const char *text);
+esp_err_t display_console(bool enable);
+esp_err_t display_get_frame(uint8_t *frame);
+float display_get_fps();
+
+#endif // DISPLAY_SERVICE_H
@@ -13,6 +13,7 @@
 
 #include "Wifi.h"
 #include "wifi_sta_handlers.h"
+#include "display_service.h"
 
 #include "servo.h"
 #include "l298n_motor.h"
@@ -20,8 +21,6 @@
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 #include "esp_sleep.h"
-#include "ssd1306.h"
-// #include "font8x8_basic.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 
@@ -33,6 +32,9 @@ int64_t bootTime;   ///< System boot time in microseconds
 const char *TAG = "main";  ///< Log tag for this module
 const char *NVS_NAMESPACE_APP = "app_settings";
 #define VOLTAGE_DIVIDER_RATIO ((CONFIG_VOLTAGE_DIVIDER_R1 + CONFIG_VOLTAGE_DIVIDER_R2) / CONFIG_VOLTAGE_DIVIDER_R1)
+#define NIMH_EMPTY_VOLTAGE 5.4  ///< 6x NiMH pack voltage at which the car shuts down
+#define NIMH_LOW_VOLTAGE 6.0    ///< 6x NiMH pack voltage that triggers the low battery warning
+#define NIMH_FULL_VOLTAGE 8.4   ///< 6x NiMH pack voltage when fully charged
 
 typedef enum {
     BATTERY_WALL_ADAPTER, ///< Wall adapter power supply
@@ -42,8 +44,6 @@ typedef enum {
 adc_cali_handle_t adc_cali;
 adc_oneshot_unit_handle_t adc_unit;
 
-SSD1306_t display;
-
 servo_handle_t steeringServo = NULL; ///< Handle for the steering servo
 servo_handle_t topServo = NULL; ///< Handle for the throttle servo
 l298n_motor_handle_t motor = NULL;
@@ -77,8 +77,26 @@ l298n_motor_config_t motorCfg = {
     .ledc_channel = LEDC_CHANNEL_0,
     .ledc_mode = LEDC_LOW_SPEED_MODE,
     .ledc_timer = LEDC_TIMER_0,
-    .pwm_freq_hz = 5000
+    .pwm_freq_hz = 5000,
+    .accel_ms = CONFIG_MOTOR_ACCEL_MS,
+    .decel_ms = CONFIG_MOTOR_DECEL_MS,
+#if CONFIG_MOTOR_ENCODER_PCNT
+    .encoder_backend = L298N_MOTOR_ENCODER_PCNT,
+    .encoder_glitch_ns = CONFIG_MOTOR_ENCODER_GLITCH_NS,
+#else
+    .encoder_backend = L298N_MOTOR_ENCODER_GPIO_ISR,
+#endif
+};
+#if CONFIG_MOTOR_SPEED_CONTROL
+l298n_motor_speed_ctrl_config_t motorSpeedCfg = {
+    .kp = 0.2f,
+    .ki = 2.0f,
+    .kd = 0.0f,
+    .kff = 100.0f / CONFIG_MOTOR_MAX_RPM,
+    .ff_offset = 8.0f,
+    .rate_hz = CONFIG_MOTOR_SPEED_CONTROL_RATE_HZ,
 };
+#endif
 battery_type_t batteryType = BATTERY_6xNiMH; ///< Type of battery used in the car
 
 #pragma endregion
@@ -119,12 +137,11 @@ void app_main(void)
     ESP_ERROR_CHECK(gpio_config(&v_bus_config));
     ESP_ERROR_CHECK(gpio_set_level(CONFIG_PIN_3V3_BUS, 1));
 
-    // SSD1306 display config
-    i2c_master_init(&display, CONFIG_PIN_I2C_SDA, CONFIG_PIN_I2C_SCL, -1);
-    display._flip = true;
-    ssd1306_init(&display, 128, 64);
-    ssd1306_clear_screen(&display, false);
-    ssd1306_contrast(&display, 0xff);
+    // SSD1306 display service, owns the panel and the I2C bus
+    ESP_ERROR_CHECK(display_service_start());
+    // Boot log on screen until setup is done
+    display_console(true);
+    display_log("Booting...");
 
     // init ADC
     adc_oneshot_unit_init_cfg_t adc_unit_cfg = {
@@ -157,6 +174,7 @@ void app_main(void)
     ESP_ERROR_CHECK(ret);
 
     load_nvs_calibration(); // Load NVS configuration
+    display_log("NVS loaded");
     
     // Servo config
     ESP_ERROR_CHECK(servo_init(&steeringServo, &steeringCfg));
@@ -164,20 +182,25 @@ void app_main(void)
 
     // DC motor config
     ESP_ERROR_CHECK(l298n_motor_init(&motor, &motorCfg));
+#if CONFIG_MOTOR_SPEED_CONTROL
+    ESP_ERROR_CHECK(l298n_motor_speed_control_init(motor, &motorSpeedCfg));
+#endif
+    display_log("Motors ready");
 
     wifi_init();
+    display_log("WiFi started");
 
     set_handlers();
+    display_log("Ready");
+    display_console(false);
 
     // Get boot time for uptime calculation
     bootTime = esp_timer_get_time();
 
     while (1) {
         vTaskDelay(100 / portTICK_PERIOD_MS);
-        char buff[32];
-        snprintf(buff, sizeof(buff), "Angle: %2.2f°", l298n_motor_get_angle(motor));
-        ssd1306_clear_line(&display, 0, false);
-        ssd1306_display_text(&display, 0, buff, strlen(buff), false);
+        // Only reaches the display when the shown value changes
+        display_number(DISPLAY_FIELD_ANGLE, l298n_motor_get_angle(motor));
     }
 }
 
@@ -195,34 +218,38 @@ float get_battery_voltage() {
 
 void check_battery() {
     const char *TAG = "check_battery";
+    static bool battery_low = false;
     float voltage = get_battery_voltage();
-    char buff[32];
-    snprintf(buff, sizeof(buff), "%2.2fV", voltage);
-    ssd1306_clear_line(&display, 3, false);
-    ssd1306_clear_line(&display, 5, false);
-    ssd1306_clear_line(&display, 6, false);
-    ssd1306_display_text(&display, 2, "Voltage:", 8, false);
-    ssd1306_display_text(&display, 3, buff, strlen(buff), false);
+    // Unchanged values and lines are dropped by the display service, nothing is redrawn
+    display_number(DISPLAY_FIELD_VOLTAGE, voltage);
     switch (batteryType) {
         case BATTERY_WALL_ADAPTER:
-            ssd1306_display_text(&display, 5, "Wall adapter", 12, false);
+            display_text(5, "Wall adapter", false);
+            display_clear_line(6);
             break;
         case BATTERY_6xNiMH:
-            ssd1306_display_text(&display, 5, "6x NiMH battery", 15, false);
+            display_text(5, "6x NiMH battery", false);
             if (voltage < 1) {
                 voltage = 0;
-                ssd1306_display_text(&display, 6, "Connect battery", 15, false);
+                display_text(6, "Connect battery", false);
                 return;
             }
-            if (voltage < 5.4) {
+            display_number(DISPLAY_FIELD_BATTERY, (voltage - NIMH_EMPTY_VOLTAGE) * 100 / (NIMH_FULL_VOLTAGE - NIMH_EMPTY_VOLTAGE));
+            if (voltage < NIMH_EMPTY_VOLTAGE) {
                 ESP_LOGE(TAG, "Battery voltage critical: %fV", voltage);
                 ESP_LOGW(TAG, "Please charge the batteries!");
                 ESP_LOGW(TAG, "Shutting down...");
                 deep_sleep();
                 return;
             }
-            if (voltage < 6.0) {
-                ssd1306_display_text(&display, 6, "Battery low!", 13, true);
+            if (voltage < NIMH_LOW_VOLTAGE) {
+                // Logged once per low period
+                if (!battery_low) display_log("Battery low");
+                battery_low = true;
+                display_text(6, "Battery low!", true);
+            } else {
+                battery_low = false;
+                display_clear_line(6);
             }
         default:
             break;
@@ -230,6 +257,8 @@ void check_battery() {
 }
 
 void deep_sleep() {
+    // Fades out while the rest powers down, nothing waits for it
+    display_fade(0, 800);
     servo_deinit(steeringServo);
     servo_deinit(topServo);
     l298n_motor_deinit(motor);
@@ -248,8 +277,9 @@ void check_battery_task(void *pvParameter) {
 /**
  * @brief Load configuration from NVS (Non-Volatile Storage).
  * 
- * Loads servo and motor configuration to the global variables.
+ * Loads servo configuration to the global variables.
  * If NVS is not initialized or keys are not found, default values are used.
+ * The motor configuration comes from Kconfig only and is not stored.
  */
 void load_nvs_calibration() {
     nvs_handle_t nvs_handle;
@@ -259,8 +289,8 @@ void load_nvs_calibration() {
         nvs_get_blob(nvs_handle, "steering_cfg", &steeringCfg, &len);
         len = sizeof(topCfg);
         nvs_get_blob(nvs_handle, "top_cfg", &topCfg, &len);
-        len = sizeof(motorCfg);
-        nvs_get_blob(nvs_handle, "motor_cfg", &motorCfg, &len);
+        // Drop the motor config older firmware saved, it would override Kconfig
+        if (nvs_erase_key(nvs_handle, "motor_cfg") == ESP_OK) nvs_commit(nvs_handle);
         nvs_close(nvs_handle);
     } else {
         ESP_LOGE(__FILE__, "Failed to open NVS for saving config: %s", esp_err_to_name(err));
@@ -273,7 +303,6 @@ void save_nvs_calibration() {
     if (err == ESP_OK) {
         nvs_set_blob(nvs_handle, "steering_cfg", &steeringCfg, sizeof(steeringCfg));
         nvs_set_blob(nvs_handle, "top_cfg", &topCfg, sizeof(topCfg));
-        nvs_set_blob(nvs_handle, "motor_cfg", &motorCfg, sizeof(motorCfg));
         nvs_commit(nvs_handle);
         nvs_close(nvs_handle);
         ESP_LOGI(__FILE__, "NVS calibration saved successfully");
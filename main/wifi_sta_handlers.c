@@ -4,6 +4,7 @@
 #include "Wifi.h"
 #include "l298n_motor.h"
 #include "servo.h"
+#include "display_service.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
 #include "esp_timer.h"
@@ -33,11 +34,23 @@ extern void save_nvs_calibration(); ///< Save configuration to NVS
 static TimerHandle_t ws_watchdog_timer = NULL; ///< WebSocket timeout watchdog timer handle
 
 static uint32_t ws_watchdog_timeout = 5000; ///< WebSocket timeout in milliseconds
-static int ws_socket_fd = -1; ///< WebSocket socket file descriptor
+static int ws_socket_fd = -1; ///< WebSocket socket file descriptor of the controlling client
+static int ws_mirror_fd = -1; ///< WebSocket socket file descriptor of the display mirror subscriber
 
 static ws_pulsewidth_limits_buffer_t ws_steering_limits_buffer = {0};
 static ws_pulsewidth_limits_buffer_t ws_top_limits_buffer = {0};
 
+#define WS_MIRROR_PERIOD_MS 200 ///< Display mirror update interval
+#define WS_MIRROR_PACKET_SIZE (3 + DISPLAY_PAGES * (DISPLAY_WIDTH + DISPLAY_WIDTH / 128 + 1)) ///< Worst case, every byte a literal
+
+static TimerHandle_t ws_mirror_timer = NULL; ///< Display mirror update timer handle
+static bool ws_mirror_keyframe = false; ///< Next mirror packet sends the whole frame
+static volatile bool ws_mirror_queued = false; ///< A mirror update waits for the httpd task
+// Only touched by the httpd task
+static uint8_t ws_mirror_sent[DISPLAY_FRAME_SIZE]; ///< Frame the client has
+static uint8_t ws_mirror_frame[DISPLAY_FRAME_SIZE];
+static uint8_t ws_mirror_packet[WS_MIRROR_PACKET_SIZE];
+
 #define TAG "WiFi Handlers"
 #define TAG_WS "WebSocket"
 
@@ -48,6 +61,10 @@ esp_err_t status_json_handler(httpd_req_t *req);
 esp_err_t websocket_handler(httpd_req_t *req);
 void ws_watchdog_callback(TimerHandle_t xTimer);
 void ws_watchdog_start();
+void ws_mirror_callback(TimerHandle_t xTimer);
+void ws_mirror_send(void *arg);
+void ws_mirror_start();
+void ws_mirror_stop();
 
 /**
  * @brief Register HTTP URI handlers for the web server in station mode.
@@ -86,12 +103,18 @@ void set_handlers() {
  * @brief HTTP handler for returning JSON data about the ESP32 status.
  */
 esp_err_t status_json_handler(httpd_req_t *req) {
-    char json[300];
+    char json[480];
     int free_heap = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
     int total_heap = heap_caps_get_total_size(MALLOC_CAP_DEFAULT);
-    snprintf(json, sizeof(json), "{\"uptime\": %lli, \"freeHeap\": %d, \"totalHeap\": %d, \"version\": \"%s\", \"speed\": %d, \"steering\": %d, \"top\": %d, \"steeringMinPWM\": %li, \"steeringMaxPWM\": %li, \"steeringMinAngle\": %d, \"steeringMaxAngle\": %d, \"topMinPWM\": %li, \"topMaxPWM\": %li, \"topMinAngle\": %d, \"topMaxAngle\": %d}",
+    l298n_motor_velocity_t velocity = {0};
+    l298n_motor_get_velocity(motor, &velocity);
+    // Control loop timing since the last request, zero when speed control is off
+    l298n_motor_speed_ctrl_stats_t ctrl_stats = {0};
+    l298n_motor_get_speed_control_stats(motor, &ctrl_stats, true);
+    snprintf(json, sizeof(json), "{\"uptime\": %lli, \"freeHeap\": %d, \"totalHeap\": %d, \"version\": \"%s\", \"speed\": %d, \"steering\": %d, \"top\": %d, \"rpm\": %.1f, \"ctrlPeriodUs\": %.1f, \"ctrlJitterUs\": %lu, \"ctrlLoopMaxUs\": %lu, \"displayFps\": %.1f, \"steeringMinPWM\": %li, \"steeringMaxPWM\": %li, \"steeringMinAngle\": %d, \"steeringMaxAngle\": %d, \"topMinPWM\": %li, \"topMaxPWM\": %li, \"topMinAngle\": %d, \"topMaxAngle\": %d}",
              (esp_timer_get_time() - bootTime) / 1000, free_heap, total_heap, CONFIG_VERSION,
-            servo_get_angle(steeringServo), servo_get_angle(topServo), l298n_motor_get_speed(motor),
+            servo_get_angle(steeringServo), servo_get_angle(topServo), l298n_motor_get_speed(motor), velocity.rpm,
+            ctrl_stats.period_avg_us, ctrl_stats.jitter_max_us, ctrl_stats.loop_max_us, display_get_fps(),
             steeringCfg.min_pulsewidth_us, steeringCfg.max_pulsewidth_us, steeringCfg.min_degree, steeringCfg.max_degree,
             topCfg.min_pulsewidth_us, topCfg.max_pulsewidth_us, topCfg.min_degree, topCfg.max_degree);
     ESP_LOGD(TAG, "JSON data requested: %s", json);
@@ -146,10 +169,10 @@ esp_err_t calibrate_post_handler(httpd_req_t *req) {
 
 esp_err_t websocket_handler(httpd_req_t *req) {
     if (req->method == HTTP_GET) {
-        // Initial handshake, just return OK
-        ws_socket_fd = httpd_req_to_sockfd(req);
+        // Initial handshake, just return OK. The client becomes the controlling or mirror client by what it sends
         ws_watchdog_start(); // Start the watchdog timer
         ESP_LOGI(TAG_WS, "WebSocket connection established");
+        display_log("Client connected");
         return ESP_OK;
     }
 
@@ -170,6 +193,7 @@ esp_err_t websocket_handler(httpd_req_t *req) {
             ESP_RETURN_ON_ERROR(ret, TAG_WS, "Failed to receive ws event packet");
         }
         uint8_t event_id = ((uint8_t*)ws_pkt.payload)[0];
+        if (event_id != EVENT_DISPLAY_SUBSCRIBE) ws_socket_fd = httpd_req_to_sockfd(req);
         switch (event_id) {
             case EVENT_TIMEOUT:
                 ws_watchdog_callback(NULL); // Reset power save mode
@@ -178,14 +202,20 @@ esp_err_t websocket_handler(httpd_req_t *req) {
             case EVENT_ESTOP:
                 servo_set_angle(steeringServo, 0);
                 servo_set_angle(topServo, 0);
-                l298n_motor_set_speed(motor, 0);
+                l298n_motor_stop(motor); // At once, no ramp
                 ESP_LOGV(TAG_WS, "Emergency stop activated");
+                display_log("E-STOP");
                 break;
             case EVENT_REVERT_SETTINGS:
                 ESP_LOGV(TAG_WS, "Reverting to default settings");
                 servo_set_nim_max_pulsewidth(steeringServo, steeringCfg.min_pulsewidth_us, steeringCfg.max_pulsewidth_us);
                 servo_set_nim_max_pulsewidth(topServo, topCfg.min_pulsewidth_us, topCfg.max_pulsewidth_us);
-                l298n_motor_set_speed(motor, 0); // Stop the motor
+                l298n_motor_stop(motor); // Stop the motor
+                break;
+            case EVENT_DISPLAY_SUBSCRIBE:
+                ESP_LOGV(TAG_WS, "Display mirror requested");
+                ws_mirror_fd = httpd_req_to_sockfd(req); // A new subscriber gets its own keyframe
+                ws_mirror_start();
                 break;
             default:
                 ESP_LOGW(TAG_WS, "Unknown event id: 0x%2X", event_id);
@@ -203,9 +233,15 @@ esp_err_t websocket_handler(httpd_req_t *req) {
             ESP_RETURN_ON_ERROR(ret, TAG_WS, "Failed to receive ws control packet");
         }
         ws_control_packet_t *packet = (ws_control_packet_t *)ws_pkt.payload;
+        ws_socket_fd = httpd_req_to_sockfd(req);
         switch(packet->type) {
             case CONTROL_SPEED:
+#if CONFIG_MOTOR_SPEED_CONTROL
+                // Percent of the configured top speed
+                l298n_motor_set_rpm(motor, packet->value * CONFIG_MOTOR_MAX_RPM / 100.0f);
+#else
                 l298n_motor_set_speed(motor, packet->value);
+#endif
                 ESP_LOGV(TAG_WS, "Set motor speed to %d", packet->value);
                 break;
             case CONTROL_STEERING:
@@ -267,7 +303,16 @@ esp_err_t websocket_handler(httpd_req_t *req) {
     // Handle WS packets
     if (ws_pkt.type == HTTPD_WS_TYPE_CLOSE) {
         ESP_LOGI(TAG_WS, "WebSocket connection closed");
-        ws_watchdog_callback(NULL); // Reset power save mode
+        int fd = httpd_req_to_sockfd(req);
+        if (fd == ws_mirror_fd) {
+            ws_mirror_fd = -1;
+            ws_mirror_stop();
+        }
+        display_log("Client left");
+        if (fd == ws_socket_fd) {
+            ws_socket_fd = -1;
+            ws_watchdog_callback(NULL); // Reset power save mode
+        }
         free(ws_pkt.payload);
         return ESP_OK;
     }
@@ -324,3 +369,118 @@ void ws_watchdog_start() {
         esp_wifi_set_ps(WIFI_PS_NONE); // Disable power save mode for WebSocket
     }
 }
+
+/**
+ * @brief Run-length encode the XOR delta of one display page.
+ *
+ * Unchanged columns become skip runs, so the packet grows with the number of
+ * changed columns. A single unchanged column between changes stays in the literal.
+ *
+ * @return Bytes written to out, at most len + len / 128 + 1.
+ */
+static int ws_mirror_encode_page(const uint8_t *frame, const uint8_t *sent, int len, uint8_t *out) {
+    int out_len = 0;
+    int col = 0;
+    while (col < len) {
+        int run = 0;
+        while (col + run < len && run < 128 && frame[col + run] == sent[col + run]) run++;
+        if (run > 0) {
+            out[out_len++] = run - 1;
+            col += run;
+            continue;
+        }
+        int literal = 0;
+        while (col + literal < len && literal < 128) {
+            int c = col + literal;
+            // Two unchanged columns in a row are cheaper as a skip run
+            if (frame[c] == sent[c] && (c + 1 >= len || frame[c + 1] == sent[c + 1])) break;
+            literal++;
+        }
+        out[out_len++] = 0x80 | (literal - 1);
+        for (int i = 0; i < literal; i++) {
+            out[out_len++] = frame[col + i] ^ sent[col + i];
+        }
+        col += literal;
+    }
+    return out_len;
+}
+
+/**
+ * @brief Hand the next mirror update to the httpd task.
+ *
+ * Runs in the timer task, which the WebSocket watchdog shares, so it never
+ * waits for the display or the socket. A tick is skipped while the previous
+ * update is still queued.
+ */
+void ws_mirror_callback(TimerHandle_t xTimer) {
+    if (ws_mirror_queued) return;
+    ws_mirror_queued = true;
+    if (httpd_queue_work(server, ws_mirror_send, NULL) != ESP_OK) ws_mirror_queued = false;
+}
+
+/**
+ * @brief Send the pages of the display that changed since the last packet.
+ *
+ * Runs in the httpd task. Nothing is sent while the display does not change.
+ */
+void ws_mirror_send(void *arg) {
+    ws_mirror_queued = false;
+    if (ws_mirror_fd == -1) {
+        ws_mirror_stop();
+        return;
+    }
+    if (display_get_frame(ws_mirror_frame) != ESP_OK) return; // Busy, next tick
+    int len = 0;
+    uint8_t mask = 0;
+    if (ws_mirror_keyframe) {
+        ws_mirror_keyframe = false;
+        // A keyframe is a delta against a blank screen
+        memset(ws_mirror_sent, 0, sizeof(ws_mirror_sent));
+        ws_mirror_packet[len++] = EVENT_DISPLAY_KEYFRAME;
+        ws_mirror_packet[len++] = DISPLAY_WIDTH;
+        ws_mirror_packet[len++] = DISPLAY_PAGES;
+        mask = 0xFF;
+    } else {
+        for (int page = 0; page < DISPLAY_PAGES; page++) {
+            int offset = page * DISPLAY_WIDTH;
+            if (memcmp(&ws_mirror_frame[offset], &ws_mirror_sent[offset], DISPLAY_WIDTH) != 0) mask |= 1 << page;
+        }
+        if (mask == 0) return;
+        ws_mirror_packet[len++] = EVENT_DISPLAY_DELTA;
+        ws_mirror_packet[len++] = mask;
+    }
+    for (int page = 0; page < DISPLAY_PAGES; page++) {
+        if (!(mask & (1 << page))) continue;
+        int offset = page * DISPLAY_WIDTH;
+        len += ws_mirror_encode_page(&ws_mirror_frame[offset], &ws_mirror_sent[offset], DISPLAY_WIDTH, &ws_mirror_packet[len]);
+    }
+    httpd_ws_frame_t ws_frame = {
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = ws_mirror_packet,
+        .len = len
+    };
+    esp_err_t err = httpd_ws_send_frame_async(server, ws_mirror_fd, &ws_frame);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG_WS, "Display mirror stopped: %s", esp_err_to_name(err));
+        ws_mirror_fd = -1;
+        ws_mirror_stop();
+        return;
+    }
+    memcpy(ws_mirror_sent, ws_mirror_frame, sizeof(ws_mirror_sent));
+    ESP_LOGV(TAG_WS, "Display mirror sent %d bytes, pages 0x%02X", len, mask);
+}
+
+/**
+ * @brief Start streaming the display to the mirror subscriber, beginning with a keyframe.
+ */
+void ws_mirror_start() {
+    ws_mirror_keyframe = true;
+    if (ws_mirror_timer == NULL) {
+        ws_mirror_timer = xTimerCreate("ws_mirror", pdMS_TO_TICKS(WS_MIRROR_PERIOD_MS), pdTRUE, NULL, ws_mirror_callback);
+    }
+    xTimerStart(ws_mirror_timer, 0);
+}
+
+void ws_mirror_stop() {
+    if (ws_mirror_timer != NULL) xTimerStop(ws_mirror_timer, 0);
+}
@@ -20,9 +20,17 @@ typedef enum {
     EVENT_NONE,
     EVENT_TIMEOUT,
     EVENT_ESTOP,
-    EVENT_REVERT_SETTINGS
+    EVENT_REVERT_SETTINGS,
+    EVENT_DISPLAY_SUBSCRIBE,    // Client wants the display mirror, answered with a keyframe
+    // Mirror frames are longer than one byte, their ids stay clear of ws_value_type_t
+    EVENT_DISPLAY_KEYFRAME = 0x80,  // Whole frame: width, pages, then every page encoded
+    EVENT_DISPLAY_DELTA             // Changed pages: page mask, then the pages in the mask encoded
 } ws_event_type_t;
 
+// Display mirror pages are run-length encoded XOR deltas against the last sent frame
+// (a keyframe against a blank one). A control byte below 0x80 skips (n + 1) unchanged
+// columns, 0x80 | n is followed by (n + 1) bytes to XOR into the page.
+
 // Binary control packet structure
 typedef struct __attribute__((packed)) {
     uint8_t type;  // Control type (1 byte)
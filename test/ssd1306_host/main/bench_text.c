@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "ssd1306.h"
+#include "font8x8_basic.h"
+#include "bench_text.h"
+
+// Glyphs/s of text rendering, the per glyph path the driver used before the generated
+// glyph tables against ssd1306_render_text() and ssd1306_display_text().
+// The old path copies every glyph, inverts and bit reverses it for a flipped panel
+// and writes it on its own.
+
+#define BENCH_LINES 20000
+#define BENCH_TEXT "Speed 12.34 km/h"
+#define BENCH_TEXT_LEN 16
+
+static int bench_old_render(uint8_t * line, const char * text, int text_len, bool invert, bool flip)
+{
+	uint8_t image[8];
+	for (int i = 0; i < text_len; i++) {
+		memcpy(image, font8x8_basic_tr[(uint8_t)text[i]], 8);
+		if (invert) ssd1306_invert(image, 8);
+		if (flip) ssd1306_flip(image, 8);
+		memcpy(&line[i * 8], image, 8);
+	}
+	return text_len * 8;
+}
+
+static void bench_old_display(SSD1306_t * dev, int page, const char * text, int text_len, bool invert, bool flip)
+{
+	uint8_t image[8];
+	int seg = 0;
+	for (int i = 0; i < text_len; i++) {
+		bench_old_render(image, &text[i], 1, invert, flip);
+		ssd1306_display_image(dev, page, seg, image, 8);
+		seg = seg + 8;
+	}
+}
+
+static double bench_glyphs_per_s(int64_t start)
+{
+	int64_t us = esp_timer_get_time() - start;
+	if (us < 1) us = 1;
+	return (double)BENCH_LINES * BENCH_TEXT_LEN * 1000000.0 / us;
+}
+
+int bench_text(void)
+{
+	int failures = 0;
+	uint8_t old_line[128];
+	uint8_t new_line[128];
+	volatile uint8_t sink = 0;
+
+	SSD1306_t dev;
+	memset(&dev, 0, sizeof(dev));
+	i2c_master_init(&dev, 21, 22, -1);
+	ssd1306_init(&dev, 128, 64);
+
+	// Same pixels as before on an upright panel
+	bench_old_render(old_line, BENCH_TEXT, BENCH_TEXT_LEN, true, false);
+	ssd1306_render_text(&dev, new_line, BENCH_TEXT, BENCH_TEXT_LEN, true);
+	if (memcmp(old_line, new_line, sizeof(old_line)) != 0) {
+		printf("FAIL bench_text: ssd1306_render_text differs from the per glyph path\n");
+		failures++;
+	}
+
+	int64_t start = esp_timer_get_time();
+	for (int i = 0; i < BENCH_LINES; i++) {
+		bench_old_render(old_line, BENCH_TEXT, BENCH_TEXT_LEN, i & 1, true);
+		sink ^= old_line[i & 127];
+	}
+	double old_render = bench_glyphs_per_s(start);
+	start = esp_timer_get_time();
+	for (int i = 0; i < BENCH_LINES; i++) {
+		ssd1306_render_text(&dev, new_line, BENCH_TEXT, BENCH_TEXT_LEN, i & 1);
+		sink ^= new_line[i & 127];
+	}
+	double new_render = bench_glyphs_per_s(start);
+
+	// Through the mock transport, the old path is one write per glyph
+	ssd1306_bus_stats_t old_stats;
+	ssd1306_bus_stats_t new_stats;
+	ssd1306_mock_reset_stats(&dev);
+	start = esp_timer_get_time();
+	for (int i = 0; i < BENCH_LINES; i++) {
+		bench_old_display(&dev, i & 7, BENCH_TEXT, BENCH_TEXT_LEN, i & 8, true);
+	}
+	double old_display = bench_glyphs_per_s(start);
+	ssd1306_mock_get_stats(&dev, &old_stats);
+	ssd1306_mock_reset_stats(&dev);
+	start = esp_timer_get_time();
+	for (int i = 0; i < BENCH_LINES; i++) {
+		ssd1306_display_text(&dev, i & 7, BENCH_TEXT, BENCH_TEXT_LEN, i & 8);
+	}
+	double new_display = bench_glyphs_per_s(start);
+	ssd1306_mock_get_stats(&dev, &new_stats);
+
+	printf("bench_text %d lines of %d glyphs\n", BENCH_LINES, BENCH_TEXT_LEN);
+	printf("  render   per glyph %12.0f glyphs/s   ssd1306_render_text  %12.0f glyphs/s\n", old_render, new_render);
+	printf("  display  per glyph %12.0f glyphs/s   ssd1306_display_text %12.0f glyphs/s\n", old_display, new_display);
+	printf("  writes per line   %5u                      %5u\n",
+		(unsigned)(old_stats.transactions / BENCH_LINES), (unsigned)(new_stats.transactions / BENCH_LINES));
+	if (new_stats.transactions >= old_stats.transactions) {
+		printf("FAIL bench_text: ssd1306_display_text does not save writes\n");
+		failures++;
+	}
+
+	ssd1306_mock_delete(&dev);
+	return failures;
+}
@@ -0,0 +1,7 @@
+#ifndef BENCH_TEXT_H_
+#define BENCH_TEXT_H_
+
+// Print the glyphs/s of the old per glyph text path and the current one, returns the number of failed checks
+int bench_text(void);
+
+#endif /* BENCH_TEXT_H_ */
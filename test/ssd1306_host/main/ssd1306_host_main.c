@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "ssd1306.h"
+#include "ssd1306_font.h"
+#include "ssd1306_widget.h"
+#include "ssd1306_sched.h"
+#include "bench_text.h"
+
+// Host test and bus cost benchmark of the SSD1306 component on the mock transport.
+// Every scene runs on a fresh panel, once over I2C and once over SPI. A step is one
+// public call, drawing steps include the flush that sends them. The bus cost of every
+// step is printed and checked against host_budgets[], and the image the panel shows
+// at the end of a scene is compared with golden/<scene>.pbm.
+// SSD1306_HOST_UPDATE=1 rewrites the golden images instead of comparing them.
+
+typedef enum {
+	HOST_I2C = 0,
+	HOST_SPI = 1,
+	HOST_BUSES = 2
+} host_bus_t;
+
+// Most a step may cost on each bus. A lower cost passes, lower the budget with it
+typedef struct {
+	const char * step; // scene/step
+	uint32_t transactions[HOST_BUSES];
+	uint32_t bytes[HOST_BUSES];
+} host_budget_t;
+
+static const host_budget_t host_budgets[] = {
+	// scene/step, { i2c, spi } transactions, { i2c, spi } bytes
+	{ "init/ssd1306_init", { 1, 1 }, { 27, 26 } },
+	{ "init/ssd1306_show_buffer", { 8, 16 }, { 1080, 1048 } },
+	{ "init/ssd1306_clear_screen", { 8, 16 }, { 1080, 1048 } },
+	{ "init/ssd1306_clear_line", { 1, 2 }, { 135, 131 } },
+	{ "init/ssd1306_contrast", { 1, 1 }, { 3, 2 } },
+	{ "init/ssd1306_display_power", { 2, 2 }, { 4, 2 } },
+	{ "text/ssd1306_display_text", { 1, 2 }, { 95, 91 } },
+	{ "text/ssd1306_display_text/invert", { 1, 2 }, { 87, 83 } },
+	{ "text/ssd1306_display_text_x3", { 6, 12 }, { 186, 162 } },
+	{ "text/ssd1306_display_text_box1", { 28, 56 }, { 996, 884 } },
+	{ "text/ssd1306_display_text_box2", { 60, 120 }, { 2244, 2004 } },
+	{ "text/ssd1306_display_rotate_text", { 3, 6 }, { 45, 33 } },
+	{ "text/ssd1306_display_image", { 1, 2 }, { 39, 35 } },
+	{ "shapes/_ssd1306_pixel", { 1, 2 }, { 8, 4 } },
+	{ "shapes/_ssd1306_line", { 7, 14 }, { 110, 82 } },
+	{ "shapes/_ssd1306_hline", { 1, 2 }, { 135, 131 } },
+	{ "shapes/_ssd1306_vline", { 8, 16 }, { 64, 32 } },
+	{ "shapes/_ssd1306_rect", { 3, 6 }, { 141, 129 } },
+	{ "shapes/_ssd1306_fill_rect", { 2, 4 }, { 78, 70 } },
+	{ "shapes/_ssd1306_circle", { 5, 10 }, { 146, 126 } },
+	{ "shapes/_ssd1306_fill_circle", { 3, 6 }, { 66, 54 } },
+	{ "shapes/_ssd1306_cursor", { 2, 4 }, { 28, 20 } },
+	{ "shapes/_ssd1306_round_rect", { 3, 6 }, { 139, 127 } },
+	{ "shapes/_ssd1306_fill_round_rect", { 3, 6 }, { 99, 87 } },
+	{ "shapes/ssd1306_flush/clean", { 0, 0 }, { 0, 0 } },
+	{ "shapes/ssd1306_mark_dirty", { 1, 2 }, { 135, 131 } },
+	{ "bitmap/ssd1306_bitmaps", { 3, 6 }, { 69, 57 } },
+	{ "bitmap/_ssd1306_bitmaps", { 3, 6 }, { 69, 57 } },
+	{ "bitmap/_ssd1306_blit/xor", { 3, 6 }, { 69, 57 } },
+	{ "bitmap/_ssd1306_blit_columns", { 2, 4 }, { 30, 22 } },
+	{ "bitmap/ssd1306_display_region/clipped", { 1, 2 }, { 15, 11 } },
+	{ "bitmap/ssd1306_set_page", { 1, 2 }, { 135, 131 } },
+	{ "fonts/ssd1306_font_text/x1", { 1, 2 }, { 58, 54 } },
+	{ "fonts/ssd1306_font_text/x1 mono", { 1, 2 }, { 39, 35 } },
+	{ "fonts/ssd1306_font_text/x2", { 3, 6 }, { 231, 219 } },
+	{ "fonts/ssd1306_font_text/x3", { 4, 8 }, { 208, 192 } },
+	{ "fonts/ssd1306_font_text/x4 invert", { 5, 10 }, { 195, 175 } },
+	{ "frame/ssd1306_set_buffer", { 8, 16 }, { 1079, 1047 } },
+	{ "frame/ssd1306_show_buffer", { 8, 16 }, { 1080, 1048 } },
+	{ "frame/ssd1306_show_buffer/burst", { 1, 2 }, { 1041, 1032 } },
+	{ "frame/ssd1306_flush/burst", { 1, 2 }, { 1041, 1032 } },
+	{ "frame/ssd1306_swap_and_flush", { 1, 2 }, { 99, 93 } },
+	{ "frame/ssd1306_flush_async", { 1, 2 }, { 47, 43 } },
+	{ "frame/ssd1306_flush_page", { 2, 4 }, { 190, 182 } },
+	{ "frame/ssd1306_wrap_arround/left", { 8, 16 }, { 1080, 1048 } },
+	{ "frame/ssd1306_wrap_arround/up", { 8, 16 }, { 1080, 1048 } },
+	{ "frame/ssd1306_wrap_arround/page_down", { 8, 16 }, { 1080, 1048 } },
+	{ "scroll/ssd1306_scroll_text", { 7, 14 }, { 865, 837 } },
+	{ "scroll/ssd1306_scroll_clear", { 7, 14 }, { 945, 917 } },
+	{ "scroll/ssd1306_hardware_scroll", { 1, 1 }, { 9, 8 } },
+	{ "scroll/ssd1306_hardware_scroll/stop", { 1, 1 }, { 2, 1 } },
+	{ "scroll/ssd1306_hardware_scroll_region", { 1, 1 }, { 12, 11 } },
+	{ "console/ssd1306_console_enable", { 9, 17 }, { 1082, 1049 } },
+	{ "console/ssd1306_console_print", { 2, 3 }, { 137, 132 } },
+	{ "console/ssd1306_console_disable", { 1, 1 }, { 2, 1 } },
+	{ "fade/ssd1306_fade_start/contrast", { 10, 10 }, { 30, 20 } },
+	{ "fade/ssd1306_fade_start/wipe", { 64, 128 }, { 8640, 8384 } },
+	{ "fade/ssd1306_fadeout", { 64, 128 }, { 8640, 8384 } },
+	{ "widgets/ssd1306_widget_set_text", { 1, 2 }, { 135, 131 } },
+	{ "widgets/ssd1306_widget_set_number", { 1, 2 }, { 135, 131 } },
+	{ "widgets/ssd1306_widget_set_number/same", { 0, 0 }, { 0, 0 } },
+	{ "widgets/ssd1306_widget_set_bar", { 1, 2 }, { 135, 131 } },
+	{ "widgets/ssd1306_widget_set_bar/same", { 0, 0 }, { 0, 0 } },
+	{ "widgets/ssd1306_widget_invalidate", { 1, 2 }, { 135, 131 } },
+	{ "sched/ssd1306_sched_run/main", { 2, 4 }, { 171, 163 } },
+	{ "sched/ssd1306_sched_run/dash", { 4, 8 }, { 342, 326 } },
+	{ "sched/ssd1306_sched_run/idle", { 0, 0 }, { 0, 0 } },
+	{ NULL, { 0, 0 }, { 0, 0 } },
+};
+
+typedef struct {
+	const char * name;
+	int height;
+	bool golden; // Compare the last image with golden/<name>.pbm
+	bool synced; // GRAM holds the shown buffer at the end
+	void (*draw)(SSD1306_t * dev);
+} host_scene_t;
+
+static const char * host_bus_names[HOST_BUSES] = { "i2c", "spi" };
+static host_bus_t host_bus;
+static const char * host_scene;
+static int host_steps;
+static int host_failures;
+
+static void host_fail(const char * what)
+{
+	printf("FAIL %s (%s): %s\n", host_scene, host_bus_names[host_bus], what);
+	host_failures++;
+}
+
+static void host_expect(bool ok, const char * what)
+{
+	if (!ok) host_fail(what);
+}
+
+static const host_budget_t * host_find_budget(const char * step)
+{
+	char key[80];
+	snprintf(key, sizeof(key), "%s/%s", host_scene, step);
+	for (int i = 0; host_budgets[i].step != NULL; i++) {
+		if (strcmp(host_budgets[i].step, key) == 0) return &host_budgets[i];
+	}
+	return NULL;
+}
+
+// Print the bus cost of the step that just ran and check it against its budget
+static void host_step_done(SSD1306_t * dev, const char * step)
+{
+	ssd1306_bus_stats_t stats;
+	ssd1306_mock_get_stats(dev, &stats);
+	host_steps++;
+	printf("%-10s %-36s %5u %6u %6u %6u", host_scene, step, (unsigned)stats.transactions, (unsigned)stats.bytes,
+		(unsigned)stats.cmd_bytes, (unsigned)stats.data_bytes);
+	const host_budget_t * budget = host_find_budget(step);
+	if (budget == NULL) {
+		printf("  no budget\n");
+		host_fail(step);
+		return;
+	}
+	uint32_t transactions = budget->transactions[host_bus];
+	uint32_t bytes = budget->bytes[host_bus];
+	if (stats.transactions > transactions || stats.bytes > bytes) {
+		printf("  over budget %u/%u\n", (unsigned)transactions, (unsigned)bytes);
+		host_fail(step);
+		return;
+	}
+	if (stats.transactions < transactions || stats.bytes < bytes) {
+		printf("  below budget %u/%u\n", (unsigned)transactions, (unsigned)bytes);
+		return;
+	}
+	printf("\n");
+}
+
+#define HOST_STEP(dev, step, ...) do { \
+	ssd1306_mock_reset_stats(dev); \
+	__VA_ARGS__; \
+	host_step_done(dev, step); \
+} while (0)
+
+// Add a panel to the bus of the run, blank it and clear the counters
+static void host_panel_start(SSD1306_t * dev, int height)
+{
+	memset(dev, 0, sizeof(SSD1306_t));
+	if (host_bus == HOST_I2C) {
+		i2c_master_init(dev, 21, 22, -1);
+	} else {
+		spi_master_init(dev, 23, 18, 5, 4, -1);
+	}
+	ssd1306_init(dev, 128, height);
+	ssd1306_show_buffer(dev);
+	ssd1306_mock_reset_stats(dev);
+}
+
+static void host_panel_stop(SSD1306_t * dev)
+{
+	ssd1306_disable_back_buffer(dev);
+	ssd1306_mock_delete(dev);
+}
+
+// The panel GRAM must hold exactly the frame the driver thinks is shown
+static void host_check_gram(SSD1306_t * dev)
+{
+	uint8_t shown[8 * 128];
+	ssd1306_get_shown_buffer(dev, shown);
+	for (int page = 0; page < ssd1306_get_pages(dev); page++) {
+		if (memcmp(ssd1306_mock_get_gram(dev, page), &shown[page * 128], ssd1306_get_width(dev)) != 0) {
+			host_fail("GRAM differs from the shown buffer");
+			return;
+		}
+	}
+}
+
+static long host_read_file(const char * path, char * buf, long size)
+{
+	FILE * fp = fopen(path, "r");
+	if (fp == NULL) return -1;
+	long len = fread(buf, 1, size, fp);
+	fclose(fp);
+	return len;
+}
+
+// Dump what the panel shows and compare it with the golden image of the scene.
+// A mismatch leaves the dump in the working directory.
+static void host_check_image(SSD1306_t * dev, const char * name)
+{
+	char path[128];
+	char golden[256];
+	snprintf(path, sizeof(path), "%s.%s.pbm", name, host_bus_names[host_bus]);
+	snprintf(golden, sizeof(golden), "%s/%s.pbm", HOST_GOLDEN_DIR, name);
+	if (ssd1306_mock_dump_pbm(dev, path) != ESP_OK) {
+		host_fail("could not dump the panel image");
+		return;
+	}
+	static char actual[20000];
+	static char expected[20000];
+	long actual_len = host_read_file(path, actual, sizeof(actual));
+	if (getenv("SSD1306_HOST_UPDATE") != NULL && host_bus == HOST_I2C) {
+		FILE * fp = fopen(golden, "w");
+		if (fp == NULL || fwrite(actual, 1, actual_len, fp) != actual_len) host_fail("could not write the golden image");
+		if (fp != NULL) fclose(fp);
+	}
+	long expected_len = host_read_file(golden, expected, sizeof(expected));
+	if (expected_len < 0) {
+		host_fail("golden image missing");
+		return;
+	}
+	if (actual_len != expected_len || memcmp(actual, expected, actual_len) != 0) {
+		printf("     image differs from %s, see %s\n", golden, path);
+		host_fail("image differs from the golden image");
+		return;
+	}
+	remove(path);
+}
+
+// 16x16 row major test bitmap, MSB is the leftmost pixel
+static const uint8_t host_face[32] = {
+	0x07, 0xE0, 0x18, 0x18, 0x20, 0x04, 0x40, 0x02,
+	0x4C, 0x32, 0x8C, 0x31, 0x80, 0x01, 0x80, 0x01,
+	0x80, 0x01, 0x88, 0x11, 0x44, 0x22, 0x43, 0xC2,
+	0x20, 0x04, 0x18, 0x18, 0x07, 0xE0, 0x00, 0x00,
+};
+
+static void scene_init(SSD1306_t * dev)
+{
+	HOST_STEP(dev, "ssd1306_init", ssd1306_init(dev, 128, 64));
+	HOST_STEP(dev, "ssd1306_show_buffer", ssd1306_show_buffer(dev));
+	HOST_STEP(dev, "ssd1306_clear_screen", ssd1306_clear_screen(dev, false));
+	HOST_STEP(dev, "ssd1306_clear_line", ssd1306_clear_line(dev, 3, true));
+	HOST_STEP(dev, "ssd1306_contrast", ssd1306_contrast(dev, 0x40));
+	host_expect(ssd1306_mock_get_contrast(dev) == 0x40, "contrast not set");
+	HOST_STEP(dev, "ssd1306_display_power", ssd1306_display_power(dev, false); ssd1306_display_power(dev, true));
+	host_expect(ssd1306_get_width(dev) == 128 && ssd1306_get_height(dev) == 64 && ssd1306_get_pages(dev) == 8, "panel size");
+}
+
+static void scene_text(SSD1306_t * dev)
+{
+	uint8_t image[32];
+	for (int i = 0; i < sizeof(image); i++) {
+		image[i] = (i & 1) ? 0xAA : 0x55;
+	}
+	HOST_STEP(dev, "ssd1306_display_text", ssd1306_display_text(dev, 0, "Hello world", 11, false));
+	HOST_STEP(dev, "ssd1306_display_text/invert", ssd1306_display_text(dev, 1, " Inverted ", 10, true));
+	HOST_STEP(dev, "ssd1306_display_text_x3", ssd1306_display_text_x3(dev, 2, "x3", 2, false));
+	HOST_STEP(dev, "ssd1306_display_text_box1", ssd1306_display_text_box1(dev, 5, 56, "Box one", 4, 7, false, 0));
+	HOST_STEP(dev, "ssd1306_display_text_box2", ssd1306_display_text_box2(dev, 6, 56, "Two", 4, 3, false, 0));
+	HOST_STEP(dev, "ssd1306_display_rotate_text", ssd1306_display_rotate_text(dev, 120, "Rot", 3, false));
+	HOST_STEP(dev, "ssd1306_display_image", ssd1306_display_image(dev, 7, 0, image, sizeof(image)));
+	uint8_t line[128];
+	host_expect(ssd1306_render_text(dev, line, "Hello world", 11, false) == 88, "render_text width");
+	uint8_t page[128];
+	ssd1306_get_page(dev, 0, page);
+	host_expect(memcmp(page, line, 88) == 0, "render_text differs from display_text");
+}
+
+static void scene_shapes(SSD1306_t * dev)
+{
+	ssd1306_set_deferred(dev, true);
+	HOST_STEP(dev, "_ssd1306_pixel", _ssd1306_pixel(dev, 2, 2, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_line", _ssd1306_line(dev, 0, 63, 60, 10, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_hline", _ssd1306_hline(dev, 0, 0, 128, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_vline", _ssd1306_vline(dev, 127, 0, 64, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_rect", _ssd1306_rect(dev, 4, 4, 40, 20, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_fill_rect", _ssd1306_fill_rect(dev, 8, 8, 32, 12, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_circle", _ssd1306_circle(dev, 80, 20, 14, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_fill_circle", _ssd1306_fill_circle(dev, 80, 20, 8, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_cursor", _ssd1306_cursor(dev, 110, 16, 6, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_round_rect", _ssd1306_round_rect(dev, 50, 40, 40, 20, 6, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "_ssd1306_fill_round_rect", _ssd1306_fill_round_rect(dev, 96, 40, 26, 20, 5, false); ssd1306_flush(dev));
+	HOST_STEP(dev, "ssd1306_flush/clean", ssd1306_flush(dev));
+	HOST_STEP(dev, "ssd1306_mark_dirty", ssd1306_mark_dirty(dev, 3, 0, 128); ssd1306_flush(dev));
+}
+
+static void scene_bitmap(SSD1306_t * dev)
+{
+	static const uint8_t columns[8] = { 0x3C, 0x42, 0x81, 0x99, 0x99, 0x81, 0x42, 0x3C };
+	uint8_t stripes[128];
+	for (int i = 0; i < sizeof(stripes); i++) {
+		stripes[i] = (i % 8 < 4) ? 0xF0 : 0x0F;
+	}
+	HOST_STEP(dev, "ssd1306_bitmaps", ssd1306_bitmaps(dev, 3, 5, host_face, 16, 16, false));
+	HOST_STEP(dev, "_ssd1306_bitmaps", _ssd1306_bitmaps(dev, 30, 20, host_face, 16, 16, true); ssd1306_display_region(dev, 30, 20, 16, 16));
+	HOST_STEP(dev, "_ssd1306_blit/xor", _ssd1306_blit(dev, 10, 10, host_face, 16, 16, SSD1306_ROP_XOR, false); ssd1306_display_region(dev, 10, 10, 16, 16));
+	HOST_STEP(dev, "_ssd1306_blit_columns", _ssd1306_blit_columns(dev, 60, 36, columns, 8, 8, SSD1306_ROP_OR, false); ssd1306_display_region(dev, 60, 36, 8, 8));
+	HOST_STEP(dev, "ssd1306_display_region/clipped", _ssd1306_bitmaps(dev, 120, 56, host_face, 16, 16, false); ssd1306_display_region(dev, 120, 56, 16, 16));
+	HOST_STEP(dev, "ssd1306_set_page", ssd1306_set_page(dev, 6, stripes); ssd1306_flush(dev));
+	uint8_t page[128];
+	ssd1306_get_page(dev, 6, page);
+	host_expect(memcmp(page, stripes, sizeof(page)) == 0, "get_page differs from set_page");
+}
+
+static void scene_fonts(SSD1306_t * dev)
+{
+	int width = 0;
+	HOST_STEP(dev, "ssd1306_font_text/x1", width = ssd1306_font_text(dev, 0, 0, "Prop 1x", 7, 1, true, false));
+	host_expect(width == ssd1306_font_text_width("Prop 1x", 7, 1, true), "font_text_width x1");
+	HOST_STEP(dev, "ssd1306_font_text/x1 mono", ssd1306_font_text(dev, 64, 0, "Mono", 4, 1, false, false));
+	HOST_STEP(dev, "ssd1306_font_text/x2", width = ssd1306_font_text(dev, 0, 9, "Ab 2x", 5, 2, true, false));
+	host_expect(width == ssd1306_font_text_width("Ab 2x", 5, 2, true), "font_text_width x2");
+	HOST_STEP(dev, "ssd1306_font_text/x3", ssd1306_font_text(dev, 0, 28, "x3", 2, 3, true, false));
+	HOST_STEP(dev, "ssd1306_font_text/x4 invert", ssd1306_font_text(dev, 80, 30, "4", 1, 4, false, true));
+}
+
+static bool host_done_called;
+
+static bool host_flush_done(void * arg)
+{
+	host_done_called = true;
+	return false;
+}
+
+static void scene_frame(SSD1306_t * dev)
+{
+	uint8_t frame[8 * 128];
+	for (int i = 0; i < sizeof(frame); i++) {
+		frame[i] = (i / 128 + i % 128) & 0xFF;
+	}
+	HOST_STEP(dev, "ssd1306_set_buffer", ssd1306_set_buffer(dev, frame); ssd1306_flush(dev));
+	uint8_t buffer[8 * 128];
+	ssd1306_get_buffer(dev, buffer);
+	host_expect(memcmp(buffer, frame, sizeof(buffer)) == 0, "get_buffer differs from set_buffer");
+	HOST_STEP(dev, "ssd1306_show_buffer", ssd1306_show_buffer(dev));
+	ssd1306_set_burst(dev, true);
+	HOST_STEP(dev, "ssd1306_show_buffer/burst", ssd1306_show_buffer(dev));
+	for (int i = 0; i < sizeof(frame); i++) {
+		frame[i] = ~frame[i];
+	}
+	HOST_STEP(dev, "ssd1306_flush/burst", ssd1306_set_buffer(dev, frame); ssd1306_flush(dev));
+	ssd1306_set_burst(dev, false);
+
+	// Double buffered, drawing goes to the back buffer
+	ssd1306_set_deferred(dev, true);
+	host_expect(ssd1306_enable_back_buffer(dev) == ESP_OK, "enable_back_buffer");
+	HOST_STEP(dev, "ssd1306_swap_and_flush", ssd1306_display_text(dev, 0, "Back buffer", 11, false); ssd1306_swap_and_flush(dev));
+	host_done_called = false;
+	HOST_STEP(dev, "ssd1306_flush_async", ssd1306_display_text(dev, 1, "Async", 5, false); ssd1306_swap_buffers(dev);
+		ssd1306_flush_async(dev, host_flush_done, NULL); ssd1306_flush(dev));
+	host_expect(host_done_called, "flush_async did not call back");
+	ssd1306_display_text(dev, 2, "Page by page", 12, false);
+	ssd1306_display_text(dev, 3, "flush_page", 10, false);
+	ssd1306_swap_buffers(dev);
+	HOST_STEP(dev, "ssd1306_flush_page", for (int page = 0; page < ssd1306_get_pages(dev); page++) ssd1306_flush_page(dev, page));
+	host_expect(ssd1306_get_dirty(dev, 2) == 0 && ssd1306_get_dirty(dev, 3) == 0, "flush_page left dirty pages");
+	ssd1306_disable_back_buffer(dev);
+	ssd1306_set_deferred(dev, false);
+
+	HOST_STEP(dev, "ssd1306_wrap_arround/left", ssd1306_wrap_arround(dev, SCROLL_LEFT, 0, 7, 0));
+	HOST_STEP(dev, "ssd1306_wrap_arround/up", ssd1306_wrap_arround(dev, SCROLL_UP, 0, 127, 0));
+	HOST_STEP(dev, "ssd1306_wrap_arround/page_down", ssd1306_wrap_arround(dev, PAGE_SCROLL_DOWN, 0, 7, 0));
+}
+
+static void scene_scroll(SSD1306_t * dev)
+{
+	char text[17];
+	ssd1306_software_scroll(dev, 7, 1);
+	for (int line = 0; line < 8; line++) {
+		snprintf(text, sizeof(text), "Line %d", line);
+		ssd1306_scroll_text(dev, text, strlen(text), false);
+	}
+	HOST_STEP(dev, "ssd1306_scroll_text", ssd1306_scroll_text(dev, "Line 8", 6, false));
+	HOST_STEP(dev, "ssd1306_scroll_clear", ssd1306_scroll_clear(dev));
+	ssd1306_scroll_text(dev, "After clear", 11, true);
+	HOST_STEP(dev, "ssd1306_hardware_scroll", ssd1306_hardware_scroll(dev, SCROLL_RIGHT));
+	HOST_STEP(dev, "ssd1306_hardware_scroll/stop", ssd1306_hardware_scroll(dev, SCROLL_STOP));
+	HOST_STEP(dev, "ssd1306_hardware_scroll_region", ssd1306_hardware_scroll_region(dev, SCROLL_UP, 2, 3, 5));
+	ssd1306_hardware_scroll(dev, SCROLL_STOP);
+}
+
+static void scene_console(SSD1306_t * dev)
+{
+	char text[17];
+	HOST_STEP(dev, "ssd1306_console_enable", ssd1306_console_enable(dev));
+	HOST_STEP(dev, "ssd1306_console_print", ssd1306_console_print(dev, "Console", 7, false));
+	HOST_STEP(dev, "ssd1306_console_disable", ssd1306_console_disable(dev));
+	ssd1306_console_enable(dev);
+	for (int line = 0; line < 11; line++) {
+		snprintf(text, sizeof(text), "Event %d", line);
+		ssd1306_console_print(dev, text, strlen(text), line == 10);
+	}
+}
+
+static volatile bool host_fade_finished;
+
+static void host_fade_done(void * arg)
+{
+	host_fade_finished = true;
+}
+
+static void host_wait_fade(SSD1306_t * dev)
+{
+	while (ssd1306_fade_busy(dev)) {
+		vTaskDelay(1);
+	}
+}
+
+static void scene_fade(SSD1306_t * dev)
+{
+	ssd1306_display_text(dev, 0, "Fading", 6, false);
+	host_fade_finished = false;
+	HOST_STEP(dev, "ssd1306_fade_start/contrast", ssd1306_fade_start(dev, SSD1306_FADE_CONTRAST, 0xF0, 200, host_fade_done, NULL); host_wait_fade(dev));
+	host_expect(host_fade_finished && ssd1306_mock_get_contrast(dev) == 0xF0, "contrast fade");
+	HOST_STEP(dev, "ssd1306_fade_start/wipe", ssd1306_fade_start(dev, SSD1306_FADE_WIPE, 0, 64, NULL, NULL); host_wait_fade(dev));
+	ssd1306_display_text(dev, 7, "Fade out", 8, true);
+	HOST_STEP(dev, "ssd1306_fadeout", ssd1306_fadeout(dev));
+}
+
+static void scene_widgets(SSD1306_t * dev)
+{
+	ssd1306_widget_t text;
+	ssd1306_widget_t number;
+	ssd1306_widget_t bar;
+	ssd1306_widget_text_init(&text, 0, 0, 16, false);
+	ssd1306_widget_number_init(&number, 2, 0, 16, "Volt: ", "V", 2);
+	ssd1306_widget_bar_init(&bar, 4, 0, 128, 0, 100);
+	HOST_STEP(dev, "ssd1306_widget_set_text", ssd1306_widget_set_text(dev, &text, "Status ok"));
+	HOST_STEP(dev, "ssd1306_widget_set_number", ssd1306_widget_set_number(dev, &number, 7.42f));
+	HOST_STEP(dev, "ssd1306_widget_set_number/same", ssd1306_widget_set_number(dev, &number, 7.421f));
+	HOST_STEP(dev, "ssd1306_widget_set_bar", ssd1306_widget_set_bar(dev, &bar, 60));
+	HOST_STEP(dev, "ssd1306_widget_set_bar/same", ssd1306_widget_set_bar(dev, &bar, 60));
+	ssd1306_widget_invalidate(&text);
+	HOST_STEP(dev, "ssd1306_widget_invalidate", ssd1306_widget_set_text(dev, &text, "Status ok"));
+}
+
+// A 128x32 dashboard shares the bus, each panel has its own GRAM and counters
+static void scene_sched(SSD1306_t * dev)
+{
+	static SSD1306_t dash;
+	memset(&dash, 0, sizeof(dash));
+	if (host_bus == HOST_I2C) {
+		i2c_device_add(&dash, dev->_i2c_num, -1, I2C_ADDRESS + 1);
+	} else {
+		spi_device_add(&dash, 15, 4, -1);
+	}
+	ssd1306_init(&dash, 128, 32);
+	ssd1306_show_buffer(&dash);
+
+	ssd1306_sched_t sched;
+	ssd1306_sched_init(&sched, 30);
+	ssd1306_sched_add(&sched, dev);
+	ssd1306_sched_add(&sched, &dash);
+	ssd1306_set_deferred(dev, true);
+	ssd1306_set_deferred(&dash, true);
+	ssd1306_display_text(dev, 0, "Main panel", 10, false);
+	ssd1306_display_text(dev, 7, "Shared bus", 10, true);
+	_ssd1306_font_text(&dash, 0, 0, "12.34V", 6, 2, true, false);
+	_ssd1306_font_text(&dash, 0, 16, "90 deg", 6, 2, true, false);
+
+	ssd1306_mock_reset_stats(dev);
+	ssd1306_mock_reset_stats(&dash);
+	int waiting = ssd1306_sched_run(&sched);
+	host_step_done(dev, "ssd1306_sched_run/main");
+	host_step_done(&dash, "ssd1306_sched_run/dash");
+	host_expect(waiting == 0, "sched_run left pages behind");
+	HOST_STEP(dev, "ssd1306_sched_run/idle", ssd1306_sched_run(&sched));
+
+	host_check_gram(&dash);
+	host_check_image(&dash, "sched_dash");
+	host_expect(memcmp(ssd1306_mock_get_gram(dev, 0), ssd1306_mock_get_gram(&dash, 0), 128) != 0, "panels share GRAM");
+	host_panel_stop(&dash);
+}
+
+static const host_scene_t host_scenes[] = {
+	{ "init", 64, false, true, scene_init },
+	{ "text", 64, true, true, scene_text },
+	{ "shapes", 64, true, true, scene_shapes },
+	{ "bitmap", 64, true, true, scene_bitmap },
+	{ "fonts", 64, true, true, scene_fonts },
+	{ "frame", 64, true, true, scene_frame },
+	{ "scroll", 64, true, true, scene_scroll },
+	{ "console", 64, true, false, scene_console },
+	{ "fade", 64, false, true, scene_fade },
+	{ "widgets", 64, true, true, scene_widgets },
+	{ "sched", 64, true, true, scene_sched },
+};
+
+void app_main(void)
+{
+	static SSD1306_t dev;
+	printf("%-10s %-36s %5s %6s %6s %6s\n", "scene", "step", "trans", "bytes", "cmd", "data");
+	for (host_bus = HOST_I2C; host_bus < HOST_BUSES; host_bus++) {
+		printf("--- %s\n", host_bus_names[host_bus]);
+		for (int i = 0; i < sizeof(host_scenes) / sizeof(host_scenes[0]); i++) {
+			const host_scene_t * scene = &host_scenes[i];
+			host_scene = scene->name;
+			host_panel_start(&dev, scene->height);
+			scene->draw(&dev);
+			if (scene->synced) host_check_gram(&dev);
+			if (scene->golden) host_check_image(&dev, scene->name);
+			host_panel_stop(&dev);
+		}
+	}
+	host_failures += bench_text();
+	printf("%d steps, %d failures\n", host_steps, host_failures);
+	exit(host_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -2,7 +2,10 @@ const WS_event = {
     EVENT_NONE: 0,
     EVENT_TIMEOUT: 1,
     EVENT_ESTOP: 2,
-    EVENT_REVERT_SETTINGS: 3
+    EVENT_REVERT_SETTINGS: 3,
+    EVENT_DISPLAY_SUBSCRIBE: 4,
+    EVENT_DISPLAY_KEYFRAME: 0x80,
+    EVENT_DISPLAY_DELTA: 0x81
 }
 
 const WS_value = {
@@ -29,6 +32,9 @@ function setupWebSocket() {
     ws.onopen = () => {
         console.log('WebSocket connected');
         message('info', 'WebSocket connected', 3000);
+        if (window.handleWSOpen) {
+            window.handleWSOpen();
+        }
     };
     ws.onmessage = async (event) => {
         try {
@@ -37,6 +43,15 @@ function setupWebSocket() {
                 const buffer = event.data instanceof Blob ? await event.data.arrayBuffer() : event.data;
                 const view = new DataView(buffer);
 
+                // Display mirror frames have their own layout
+                const header = view.byteLength > 1 ? view.getUint8(0) : WS_event.EVENT_NONE;
+                if (header === WS_event.EVENT_DISPLAY_KEYFRAME || header === WS_event.EVENT_DISPLAY_DELTA) {
+                    if (window.handleWSDisplay) {
+                        window.handleWSDisplay(view);
+                    }
+                    return;
+                }
+
                 // Detect message type based on size
                 if (view.byteLength === 1) {
                     // Event message (1 byte header only)